@@ -5,20 +5,26 @@
 #include <assert.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include "wiringPi.h"
 #include "wpiExtensions.h"
-#include <bits/types/struct_timeval.h>
-#include <bits/types/sig_atomic_t.h>
+#include "wpiLoop.h"
+#include "piTimer.h"
 
 #define BUF_SIZE 1024
 #define DEFAULT_PORT 5020
 #define LedPin 0
 #define PlayButton 1
 
+#define ACK_TIMEOUT_NS 500000000ULL     // Resend if no ACK within this.
+#define MAX_RESENDS 5
+#define DEBOUNCE_NS 200000000ULL        // Presses closer than this are bounce.
+
 // Tracking Ip and port information for client and ser server.
 struct options
 {
@@ -29,28 +35,33 @@ struct options
     int fd_in;
 };
 
+// What the event loop callbacks share: the packet waiting for an ACK, and its resend timer.
+struct client_state
+{
+    const struct options *opts;
+    int sequence;
+    int awaiting_ack;
+    uint8_t *bytes;
+    size_t size;
+    int resend_timer;
+    int resends;
+    uint64_t last_press;
+};
+
 // Prototypes of functions.
-static volatile sig_atomic_t running;   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 static void options_init(struct options *opts);
 static void parse_arguments(int argc, char *argv[], struct options *opts);
 static void options_process(struct options *opts);
 static void cleanup(const struct options *opts);
+static void stop_handler(int sig);
+static void button_pressed(int pin, int level, void *arg);
+static void ack_timeout(void *arg);
+static void socket_readable(int fd, int events, void *arg);
+static void finish_send(struct client_state *state);
 
 int main(int argc, char *argv[])
 {
-    char *buffer;
-    ssize_t bytesRead;
-    uint8_t *bytes;
-    size_t size;
-    int sequence = 1;
-
-    buffer = malloc(BUF_SIZE);
-    // Special data type for
-    struct data_packet dataPacket;
-
-    // dynamic memory for data packet to be sent over to server.
-    memset(&dataPacket, 0, sizeof(struct data_packet)); // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
-
+    struct client_state state;
 
     // Initiating our custom struct.
     struct options opts;
@@ -64,45 +75,33 @@ int main(int argc, char *argv[])
     // If valid information for client and server, send data to server.
     if(opts.ip_client && opts.ip_receiver)
     {
-        // Custom copy method for sending data packet to server.
-        //copy(STDIN_FILENO, opts.fd_in,  opts.server_addr);
         if(wiringPiSetup() == -1){
             setupFailure(-1);
         }
-        running = 1;
         pinMode(PlayButton, INPUT);
         pinMode(LedPin, OUTPUT);
         digitalWrite(LedPin, HIGH);
-        printf("before button pressed\n");
-        while (running){
-            if(digitalRead(PlayButton) == 0)
-            {
-                printf("play music (button pressed)\n");
-                digitalWrite(LedPin, LOW);
-                dataPacket.data_flag = 1;
-                // Ack flag set to 0
-                dataPacket.ack_flag = 0;
-                // Alternate sequence number
-                sequence = !sequence;
-                dataPacket.sequence_flag = sequence;
-                // Get data
-                buffer[bytesRead-1] = '\0';
-                // Dynamic memory for data to send and fill with what was read into the buffer.
-                dataPacket.data = malloc(BUF_SIZE);
-                dataPacket.data = buffer;
-
-                // Serialize struct
-                bytes = dp_serialize(&dataPacket, &size);
-                // Send to server by using Socket FD.
-                write_bytes(opts.fd_in, bytes, size, opts.server_addr);
-                // Read socket FD until response from server is available, deserialize packet info and
-                //  display response.
-                read_bytes(opts.fd_in, bytes, size, opts.server_addr, sequence);
-                process_response();
-                digitalWrite(LedPin, HIGH);
-            }
 
+        memset(&state, 0, sizeof(state)); // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        state.opts = &opts;
+        state.sequence = 1;
+        state.resend_timer = -1;
+
+        // Button presses, ACKs and resend timeouts all arrive on this one thread.
+        if(wpiLoopEdge(PlayButton, INT_EDGE_FALLING, button_pressed, &state) < 0 ||
+           wpiLoopFd(opts.fd_in, WPI_LOOP_READ, socket_readable, &state) < 0)
+        {
+            setupFailure(-1);
         }
+
+        signal(SIGINT, stop_handler);
+        signal(SIGTERM, stop_handler);
+
+        printf("before button pressed\n");
+        wpiLoopRun();
+
+        free(state.bytes);
+        digitalWrite(LedPin, HIGH);
     }
 
     // Clean up memory from option struct pointer.
@@ -110,6 +109,128 @@ int main(int argc, char *argv[])
     return EXIT_SUCCESS;
 }
 
+/**
+ * Leave the event loop on Ctrl-C or kill.
+ * @param sig the signal.
+ */
+static void stop_handler(int sig)
+{
+    (void)sig;
+    wpiLoopStop();
+}
+
+/**
+ * Play button edge: send a play request to the server and wait for its ACK.
+ * @param pin the button pin.
+ * @param level the pin level after the edge.
+ * @param arg the client state.
+ */
+static void button_pressed(int pin, int level, void *arg)
+{
+    struct client_state *state = arg;
+    struct data_packet dataPacket;
+    uint64_t now = piTimerNow();
+    char message[] = "play";
+
+    (void)pin;
+    (void)level;
+
+    // Ignore contact bounce, and presses while the last request is still going.
+    if(now - state->last_press < DEBOUNCE_NS || state->awaiting_ack)
+    {
+        return;
+    }
+    state->last_press = now;
+
+    printf("play music (button pressed)\n");
+    digitalWrite(LedPin, LOW);
+
+    memset(&dataPacket, 0, sizeof(struct data_packet)); // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    dataPacket.data_flag = 1;
+    // Ack flag set to 0
+    dataPacket.ack_flag = 0;
+    // Alternate sequence number
+    state->sequence = !state->sequence;
+    dataPacket.sequence_flag = state->sequence;
+    dataPacket.data = message;
+
+    // Serialize struct and send to server by using Socket FD.
+    free(state->bytes);
+    state->bytes = dp_serialize(&dataPacket, &state->size);
+    write_bytes(state->opts->fd_in, state->bytes, state->size, state->opts->server_addr);
+
+    // The ACK comes back through socket_readable; until then resend on a timer.
+    state->awaiting_ack = 1;
+    state->resends = 0;
+    state->resend_timer = wpiLoopTimer(now + ACK_TIMEOUT_NS, ACK_TIMEOUT_NS, ack_timeout, state);
+    printf("\n Waiting \n");
+}
+
+/**
+ * No ACK in time: resend the packet, or give up after MAX_RESENDS.
+ * @param arg the client state.
+ */
+static void ack_timeout(void *arg)
+{
+    struct client_state *state = arg;
+
+    if(state->resends >= MAX_RESENDS)
+    {
+        printf("No Ack from server, giving up\n");
+        finish_send(state);
+        return;
+    }
+
+    state->resends++;
+
+    write_bytes(state->opts->fd_in, state->bytes, state->size, state->opts->server_addr);
+}
+
+/**
+ * Socket readable: take the ACK if it is for the packet we sent.
+ * @param fd Socket FD.
+ * @param events what the socket is ready for.
+ * @param arg the client state.
+ */
+static void socket_readable(int fd, int events, void *arg)
+{
+    struct client_state *state = arg;
+    struct data_packet *dataPacket;
+    struct sockaddr from_addr;
+    socklen_t from_addr_len = sizeof(struct sockaddr);
+    char data[BUF_SIZE];
+    ssize_t nRead;
+
+    (void)events;
+
+    nRead = recvfrom(fd, data, BUF_SIZE, 0, &from_addr, &from_addr_len);
+    if(nRead < (ssize_t)(3 * sizeof(int)))
+    {
+        return;
+    }
+
+    // Return the data packet from the serialized information sent over.
+    dataPacket = dp_deserialize(nRead, data);
+    if(state->awaiting_ack && dataPacket->sequence_flag == state->sequence)
+    {
+        process_response();
+        finish_send(state);
+    }
+    free(dataPacket);
+}
+
+/**
+ * The send is over, one way or the other: stop resending and put the LED back.
+ * @param state the client state.
+ */
+static void finish_send(struct client_state *state)
+{
+    wpiLoopCancel(state->resend_timer);
+    state->resend_timer = -1;
+    state->awaiting_ack = 0;
+    digitalWrite(LedPin, HIGH);
+}
+
 /**
  * Initiating the option struct.
  * @param opts Pointer to option struct.
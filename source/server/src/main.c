@@ -99,28 +99,50 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
+static volatile sig_atomic_t songPlaying = 0;
+
+/**
+ * Called from the tone thread once the last note has played.
+ * @param pin The buzzer pin.
+ * @param arg Unused.
+ */
+static void songDone(int pin, void *arg) {
+    (void) pin;
+    (void) arg;
+    songPlaying = 0;
+}
+
+/**
+ * Start the melody on the buzzer and return straight away. The notes are
+ * timed by the wiringPi tone thread, so the server keeps answering packets
+ * while it plays. A packet that arrives mid-song doesn't restart it.
+ */
 static void playSong(void) {
+    static struct softToneNote song[sizeof(melody) / sizeof(melody[0])];
     int failure = -1;
+
+    if (songPlaying) {
+        return;
+    }
+
     if(wiringPiSetup() == -1)
     {
         setupFailure(failure);
     }
 
-    if(softToneCreate(BuzPin) == -1){
-        softToneFailure(failure);
+    for (size_t thisNote = 0; thisNote < sizeof(melody) / sizeof(melody[0]); thisNote++) {
+        int noteDuration = 750 / noteDurations[thisNote];
+        song[thisNote].freq = melody[thisNote];
+        song[thisNote].durationMs = (unsigned int) (noteDuration * songSpeed);
     }
 
     printf("music being played\n");
 
-    delay(100);
-    for (int thisNote = 0; thisNote < sizeof(melody); thisNote++) {
-        int noteDuration = 750 / noteDurations[thisNote];
-        softToneWrite(BuzPin, melody[thisNote]);
-        int pauseBetweenNotes = noteDuration * songSpeed;
-        delay(pauseBetweenNotes);
+    songPlaying = 1;
+    if (softToneSequence(BuzPin, song, (int) (sizeof(song) / sizeof(song[0])), songDone, NULL) == -1) {
+        songPlaying = 0;
+        softToneFailure(failure);
     }
-    BuzPin = 0;
-    softToneStop(BuzPin);
 }
 
 /**
@@ -424,5 +446,6 @@ static void cleanup(const struct options *opts, struct server_information *serve
     if (opts->ip_server) {
         close(opts->fd_in);
     }
+    softToneStop(BuzPin);
     free(serverInformation->struct_message_data);
 }
@@ -26,13 +26,23 @@
  ***********************************************************************
  */
 
+// One note of a sequence. A freq of 0 is a rest.
+
+struct softToneNote
+{
+  int          freq ;		// Hz
+  unsigned int durationMs ;
+} ;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern int  softToneCreate (int pin) ;
-extern void softToneStop   (int pin) ;
-extern void softToneWrite  (int pin, int freq) ;
+extern int  softToneCreate   (int pin) ;
+extern void softToneStop     (int pin) ;
+extern void softToneWrite    (int pin, int freq) ;
+extern int  softToneSequence (int pin, const struct softToneNote *notes, int count,
+				void (*done)(int pin, void *arg), void *arg) ;
 
 #ifdef __cplusplus
 }
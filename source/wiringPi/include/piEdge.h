@@ -0,0 +1,88 @@
+/*
+ * piEdge.h:
+ *	Timestamped edge capture - a poor-mans logic analyser.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__PI_EDGE_H__
+#define	__PI_EDGE_H__
+
+#include <stdint.h>
+
+#define	PI_EDGE_MAGIC		0x45445057	// "WPDE"
+#define	PI_EDGE_VERSION		1
+
+// Record flags
+
+#define	PI_EDGE_OVERFLOW	0x01	// Edges were dropped before this one
+
+// piEdgeRecord:
+//	One edge. The timestamp is CLOCK_MONOTONIC in nanoseconds so it can be
+//	compared with timestamps taken in other processes.
+
+struct piEdgeRecord
+{
+  uint64_t ns ;
+  uint16_t pin ;	// Pin number as given to piEdgeCaptureAdd
+  uint8_t  level ;	// LOW or HIGH after the edge
+  uint8_t  flags ;
+  uint32_t seq ;	// Running edge count
+} ;
+
+// piEdgeRing:
+//	The header of the (possibly shared) capture buffer. A single producer
+//	(the capture thread) advances head, a single consumer advances tail.
+//	They live on their own cache lines so the two sides don't fight.
+
+struct piEdgeRing
+{
+  uint32_t magic ;
+  uint32_t version ;
+  uint32_t size ;	// Number of records - always a power of 2
+  uint32_t recordSize ;
+  uint8_t  pad0 [48] ;
+
+  volatile uint64_t head ;
+  volatile uint64_t dropped ;
+  uint8_t  pad1 [48] ;
+
+  volatile uint64_t tail ;
+  uint8_t  pad2 [56] ;
+
+  struct piEdgeRecord records [] ;
+} ;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int                piEdgeCaptureSetup  (const char *shmName, int size) ;
+extern int                piEdgeCaptureAdd    (int pin, int mode) ;
+extern int                piEdgeCaptureRead   (struct piEdgeRecord *records, int max) ;
+extern void               piEdgeCaptureStop   (void) ;
+
+extern struct piEdgeRing *piEdgeCaptureAttach (const char *shmName) ;
+extern int                piEdgeRingRead      (struct piEdgeRing *ring, struct piEdgeRecord *records, int max) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * piJournal.h:
+ *	Binary journal of pin operations for later replay.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__PI_JOURNAL_H__
+#define	__PI_JOURNAL_H__
+
+#include <stdint.h>
+
+#define	PI_JOURNAL_MAGIC	0x4C4E524A	// "JRNL"
+#define	PI_JOURNAL_VERSION	2	// 2 added the bank writes
+#define	PI_JOURNAL_DEFAULT_SIZE	65536
+
+// Operations. 0 marks a record that's still being written.
+
+#define	PI_JOURNAL_PIN_MODE		1
+#define	PI_JOURNAL_DIGITAL_WRITE	2
+#define	PI_JOURNAL_DIGITAL_READ		3	// value is what was read
+#define	PI_JOURNAL_PWM_WRITE		4
+#define	PI_JOURNAL_ANALOG_READ		5	// value is what was read
+#define	PI_JOURNAL_BANK_CLEAR		6	// digitalWriteBank: pin is the bank,
+#define	PI_JOURNAL_BANK_SET		7	//	value the BCM_GPIO mask
+
+// piJournalRecord:
+//	Pin numbers are as the program gave them, so a replay needs to use
+//	the same numbering scheme. Time is CLOCK_MONOTONIC in nanoseconds.
+
+struct piJournalRecord
+{
+  uint64_t ns ;
+  int32_t  pin ;
+  int32_t  value ;
+  uint32_t op ;
+  uint32_t seq ;	// Bottom 32 bits of the record number
+} ;
+
+// piJournal:
+//	The file is this header followed by a ring of records. head counts
+//	every record ever written, so if it's bigger than size the oldest
+//	have been overwritten and the journal starts at head - size.
+
+struct piJournal
+{
+  uint32_t magic ;
+  uint32_t version ;
+  uint32_t size ;	// Number of records - always a power of 2
+  uint32_t recordSize ;
+  uint64_t start ;	// When the journal was opened
+  volatile uint64_t head ;
+  uint8_t  pad [32] ;
+
+  struct piJournalRecord records [] ;
+} ;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int piJournalActive ;
+
+extern int               piJournalOpen  (const char *path, int size) ;
+extern void              piJournalClose (void) ;
+extern void              piJournalLog   (int op, int pin, int value) ;
+
+extern struct piJournal *piJournalMap   (const char *path) ;
+extern void              piJournalUnmap (struct piJournal *journal) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
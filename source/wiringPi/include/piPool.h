@@ -0,0 +1,54 @@
+/*
+ * piPool.h:
+ *	A pool of worker threads for short jobs.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+
+#ifndef	__PI_POOL_H__
+#define	__PI_POOL_H__
+
+// Jobs that can be queued or running at once, and most workers
+
+#define	PI_POOL_MAX		1024
+#define	PI_POOL_MAX_WORKERS	64
+
+// For piPoolSubmit
+
+#define	PI_POOL_ANY_CPU		-1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// piPoolSetup is optional - the first job starts one worker per CPU.
+//	Jobs return a job number for piPoolJoin and piPoolCancel, or -1.
+
+extern int  piPoolSetup  (int workers) ;
+extern int  piPoolSubmit (void (*fn)(void *arg), void *arg, int cpu, int priority) ;
+extern int  piPoolJoin   (int job) ;
+extern int  piPoolCancel (int job) ;
+extern void piPoolStop   (void) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
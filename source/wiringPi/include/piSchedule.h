@@ -0,0 +1,50 @@
+/*
+ * piSchedule.h:
+ *	Run pin writes and functions at given times, from one thread.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__PI_SCHEDULE_H__
+#define	__PI_SCHEDULE_H__
+
+#include <stdint.h>
+
+// Jobs that can be waiting at once
+
+#define	PI_SCHEDULE_MAX		4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Times are absolute, in piTimerNow () nanoseconds. They all return a job
+//	number for piScheduleCancel, or -1 if there's no room.
+
+extern int  piScheduleWrite  (uint64_t when, int pin, int value) ;
+extern int  piScheduleCall   (uint64_t when, void (*fn)(void *arg), void *arg) ;
+extern int  piScheduleEvery  (uint64_t first, uint64_t period, void (*fn)(void *arg), void *arg) ;
+extern int  piScheduleCancel (int job) ;
+extern void piScheduleStop   (void) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
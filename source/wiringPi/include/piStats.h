@@ -0,0 +1,133 @@
+/*
+ * piStats.h:
+ *	Hot path counters, exported through shared memory for wpistat.
+ *
+ *	Only compiled in when the library is built with WPI_STATS defined
+ *	(make WPI_STATS=1) - otherwise the macros below are empty and cost
+ *	nothing.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__PI_STATS_H__
+#define	__PI_STATS_H__
+
+#include <stdint.h>
+
+#define	PI_STATS_MAGIC		0x54535057	// "WPST"
+#define	PI_STATS_VERSION	2
+#define	PI_STATS_NAME		"/wiringPi.%d"	// shm_open name, by pid
+
+#define	PI_STATS_SLOTS		32	// Threads - the last slot is shared by any more
+#define	PI_STATS_FDS		32	// I2C/SPI fds tracked - higher ones share the last
+#define	PI_STATS_BUCKETS	32	// Histogram bucket n is [2^n, 2^(n+1)) nS
+
+// Counters
+
+#define	PI_STAT_PIN_MODE	0
+#define	PI_STAT_PULL_UP_DN	1
+#define	PI_STAT_DIGITAL_READ	2
+#define	PI_STAT_DIGITAL_WRITE	3
+#define	PI_STAT_PWM_WRITE	4
+#define	PI_STAT_ANALOG_READ	5
+#define	PI_STAT_ANALOG_WRITE	6
+#define	PI_STAT_SOFT_PWM_OVERRUN 7
+#define	PI_STAT_SOFT_TONE_OVERRUN 8
+#define	PI_STAT_ISR_DISPATCH	9
+#define	PI_STAT_COUNTERS	10
+
+// Histograms
+
+#define	PI_STAT_HIST_NODE	0	// Time spent in node callbacks
+#define	PI_STAT_HIST_ISR	1	// Time in ISRs - the next edge on that pin waits this long
+#define	PI_STAT_HISTOGRAMS	2
+
+struct piStatsBus
+{
+  uint64_t transactions ;
+  uint64_t bytes ;
+} ;
+
+// piStatsSlot:
+//	Each thread gets its own, so it only ever writes to its own cache
+//	lines and needs no atomics. wpistat adds them up.
+
+struct piStatsSlot
+{
+  int32_t           tid ;	// 0 if the slot is free
+  char              name [16] ;
+  uint32_t          pad ;
+  uint64_t          counters   [PI_STAT_COUNTERS] ;
+  struct piStatsBus i2c        [PI_STATS_FDS] ;
+  struct piStatsBus spi        [PI_STATS_FDS] ;
+  uint64_t          histograms [PI_STAT_HISTOGRAMS][PI_STATS_BUCKETS] ;
+} __attribute__ ((aligned (64))) ;
+
+struct piStats
+{
+  uint32_t magic ;
+  uint32_t version ;
+  uint32_t slots ;
+  uint32_t slotSize ;
+  int32_t  pid ;
+  uint32_t pad [11] ;
+
+  struct piStatsSlot slot [PI_STATS_SLOTS] ;
+  struct piStatsSlot retired ;		// Threads that have exited, folded in
+} ;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern __thread struct piStatsSlot *piStatsMySlot ;
+
+extern struct piStatsSlot *piStatsClaim (void) ;
+extern void                piStatsHist  (int hist, uint64_t ns) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+// The macros the library uses. All of them are statements.
+
+#ifdef	WPI_STATS
+
+static inline struct piStatsSlot *piStatsGetSlot (void)
+{
+  struct piStatsSlot *slot = piStatsMySlot ;
+
+  return (slot != NULL) ? slot : piStatsClaim () ;
+}
+
+#  define	PI_STAT_INC(c)		do { piStatsGetSlot ()->counters [(c)]++ ; } while (0)
+#  define	PI_STAT_I2C(fd, n)	do { struct piStatsBus *_b = &piStatsGetSlot ()->i2c [((unsigned)(fd) < PI_STATS_FDS) ? (fd) : PI_STATS_FDS - 1] ; _b->transactions++ ; _b->bytes += (n) ; } while (0)
+#  define	PI_STAT_SPI(fd, n)	do { struct piStatsBus *_b = &piStatsGetSlot ()->spi [((unsigned)(fd) < PI_STATS_FDS) ? (fd) : PI_STATS_FDS - 1] ; _b->transactions++ ; _b->bytes += (n) ; } while (0)
+#  define	PI_STAT_TIME(h, stmt)	do { uint64_t _t = piTimerNow () ; stmt ; piStatsHist ((h), piTimerNow () - _t) ; } while (0)
+
+#else
+
+#  define	PI_STAT_INC(c)		do { } while (0)
+#  define	PI_STAT_I2C(fd, n)	do { } while (0)
+#  define	PI_STAT_SPI(fd, n)	do { } while (0)
+#  define	PI_STAT_TIME(h, stmt)	do { stmt ; } while (0)
+
+#endif
+
+#endif
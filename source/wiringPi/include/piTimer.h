@@ -0,0 +1,87 @@
+/*
+ * piTimer.h:
+ *	Absolute deadline sleeps and drift-free periodic timers.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__PI_TIMER_H__
+#define	__PI_TIMER_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define	PI_TIMER_MAX	32
+
+// piClockSetup modes. The virtual clock only moves when the program
+//	moves it, so tests can run hours of timing in seconds, the same way
+//	every time.
+
+#define	PI_CLOCK_REAL		0
+#define	PI_CLOCK_VIRTUAL	1
+
+// A piClockCondWait deadline that never comes
+
+#define	PI_CLOCK_NEVER		UINT64_MAX
+
+// piTimerStats:
+//	Jitter is how late we returned from piTimerWait compared to when the
+//	period was due, in nanoseconds.
+
+struct piTimerStats
+{
+  uint64_t ticks ;		// Periods we've returned for
+  uint64_t overruns ;		// Periods that went by without us
+  int64_t  minJitter ;
+  int64_t  maxJitter ;
+  int64_t  meanJitter ;
+} ;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Time is CLOCK_MONOTONIC in nanoseconds
+
+extern uint64_t     piTimerNow        (void) ;
+extern void         piSleepUntil      (uint64_t deadline) ;
+extern unsigned int piTimerCalibrate  (void) ;
+
+extern int          piTimerCreate     (unsigned int periodUs) ;
+extern int          piTimerWait       (int timer) ;
+extern int          piTimerFd         (int timer) ;
+extern void         piTimerGetStats   (int timer, struct piTimerStats *stats) ;
+extern void         piTimerDestroy    (int timer) ;
+
+// The clock everything above (and delay, millis, micros ...) runs on
+
+extern int          piClockVirtual ;
+
+extern int          piClockSetup        (int mode) ;
+extern void         piClockAdvance      (uint64_t nS) ;
+extern int          piClockThreadCreate (pthread_t *thread, void *(*fn)(void *), void *arg) ;
+extern int          piClockJoin         (pthread_t thread, void **retval) ;
+extern int          piClockCondWait     (pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t deadline) ;
+extern void         piClockCondSignal   (pthread_cond_t *cond) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
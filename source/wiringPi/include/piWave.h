@@ -0,0 +1,60 @@
+/*
+ * piWave.h:
+ *	Precomputed multi-pin waveforms, replayed by a single thread.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__PI_WAVE_H__
+#define	__PI_WAVE_H__
+
+#include <stdint.h>
+
+#define	PI_WAVE_MAX		32
+#define	PI_WAVE_FOREVER		0
+
+// piWaveStep:
+//	Drive the pins in on HIGH and the pins in off LOW, then wait delay
+//	microseconds before the next step. The masks are BCM_GPIO bits
+//	(bit N is BCM_GPIO N) regardless of the wiringPi pin mode in use.
+
+struct piWaveStep
+{
+  uint64_t     on ;
+  uint64_t     off ;
+  unsigned int delay ;
+} ;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int  piWaveCreate (const struct piWaveStep *steps, int numSteps) ;
+extern int  piWaveRepeat (int wave, int count) ;
+extern int  piWaveChain  (int wave, int next) ;
+extern int  piWaveSend   (int wave) ;
+extern int  piWaveBusy   (void) ;
+extern void piWaveStop   (void) ;
+extern int  piWaveDelete (int wave) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
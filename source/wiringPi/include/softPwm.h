@@ -22,13 +22,26 @@
  ***********************************************************************
  */
 
+#include <stdint.h>
+
+struct softPwmStats
+{
+  uint64_t wakeups ;
+  uint64_t edges ;
+  uint64_t overruns ;
+  uint64_t maxLate ;	// nS
+  uint64_t meanLate ;	// nS
+} ;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern int  softPwmCreate (int pin, int value, int range) ;
-extern void softPwmWrite  (int pin, int value) ;
-extern void softPwmStop   (int pin) ;
+extern int  softPwmCreate     (int pin, int value, int range) ;
+extern int  softPwmCreateFreq (int pin, int value, int range, int frequency) ;
+extern void softPwmWrite      (int pin, int value) ;
+extern void softPwmStop       (int pin) ;
+extern void softPwmGetStats   (struct softPwmStats *stats) ;
 
 #ifdef __cplusplus
 }
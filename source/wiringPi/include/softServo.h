@@ -23,12 +23,22 @@
  ***********************************************************************
  */
 
+// How a servo gets to a new value
+
+#define	SERVO_PROFILE_STEP	0	// Straight there
+#define	SERVO_PROFILE_TRAPEZOID	1	// Constant acceleration up to a top speed
+#define	SERVO_PROFILE_SCURVE	2	// Smooth acceleration, no jerk at either end
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern void softServoWrite  (int pin, int value) ;
-extern int softServoSetup   (int p0, int p1, int p2, int p3, int p4, int p5, int p6, int p7) ;
+extern void softServoWrite    (int pin, int value) ;
+extern int  softServoSetup    (int p0, int p1, int p2, int p3, int p4, int p5, int p6, int p7) ;
+extern int  softServoCreate   (int pin, int value) ;
+extern void softServoStop     (int pin) ;
+extern int  softServoProfile  (int pin, int profile, int velocity, int accel) ;
+extern int  softServoPosition (int pin) ;
 
 #ifdef __cplusplus
 }
@@ -22,12 +22,16 @@
  ***********************************************************************
  */
 
+#define	SR595_MAX_PINS	1024
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern int sr595Setup (const int pinBase, const int numPins,
+extern int sr595Setup    (const int pinBase, const int numPins,
 	const int dataPin, const int clockPin, const int latchPin) ;
+extern int sr595SPISetup (const int pinBase, const int numPins,
+	const int spiChannel, const int latchPin) ;
 
 #ifdef __cplusplus
 }
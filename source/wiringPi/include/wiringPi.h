@@ -24,6 +24,9 @@
 #ifndef	__WIRING_PI_H__
 #define	__WIRING_PI_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 // C doesn't have true/false by default and I can never remember which
 //	way round they are, so ...
 //	(and yes, I know about stdbool.h but I like capitals for these and I'm old)
@@ -130,6 +133,14 @@ extern const int   piMemorySize    [ 8] ;
 
 #define	PI_THREAD(X)	void *X (UNU void *dummy)
 
+// Rings - one producer or many, and one consumer
+
+#define	PI_RING_SPSC		0
+#define	PI_RING_MPSC		1
+#define	PI_RING_WAKE		2	// Or'd in: consumer can wait
+
+struct piRing ;
+
 // Failure modes
 
 #define	WPI_FATAL	(1==1)
@@ -154,6 +165,7 @@ struct wiringPiNodeStruct
   unsigned int data1 ;	//  ditto
   unsigned int data2 ;	//  ditto
   unsigned int data3 ;	//  ditto
+  void        *dataPtr ;	//  ditto - for state that won't fit in the above
 
            void   (*pinMode)          (struct wiringPiNodeStruct *node, int pin, int mode) ;
            void   (*pullUpDnControl)  (struct wiringPiNodeStruct *node, int pin, int mode) ;
@@ -165,10 +177,18 @@ struct wiringPiNodeStruct
            int    (*analogRead)       (struct wiringPiNodeStruct *node, int pin) ;
            void   (*analogWrite)      (struct wiringPiNodeStruct *node, int pin, int value) ;
 
+// Write combining: between wiringPiBegin () and wiringPiCommit () a node
+//	that supports it only updates its shadow registers and sets bits in
+//	dirty. flush () is then called once at commit to write them out.
+
+           void   (*flush)            (struct wiringPiNodeStruct *node) ;
+  unsigned int dirty ;
+
   struct wiringPiNodeStruct *next ;
 } ;
 
 extern struct wiringPiNodeStruct *wiringPiNodes ;
+extern int wiringPiBatching ;
 
 // Export variables for the hardware pointers
 
@@ -179,6 +199,72 @@ extern volatile unsigned int *_wiringPiPads ;
 extern volatile unsigned int *_wiringPiTimer ;
 extern volatile unsigned int *_wiringPiTimerIrqRaw ;
 
+// piRealtimeProfile:
+//	For piRealtimeSetup (). The CPU masks are bit n for CPU n, 0 to leave
+//	affinity alone; mainCpus is for the calling thread and threadCpus
+//	for the threads the library starts (e.g. an isolated core).
+//	A priority of 0 leaves that role's scheduling alone.
+
+#define	PI_RT_LOCK_MEMORY	0x01
+#define	PI_RT_PREFAULT		0x02
+#define	PI_RT_FIFO		0x04	// Else SCHED_RR
+
+#define	PI_RT_ISR		0	// wiringPiISR handler threads
+#define	PI_RT_EDGE		1	// piEdge capture
+#define	PI_RT_WAVE		2	// piWave playback
+#define	PI_RT_PWM		3	// softPwm
+#define	PI_RT_TONE		4	// softTone
+#define	PI_RT_SERVO		5	// softServo
+#define	PI_RT_SCHEDULE		6	// piSchedule
+#define	PI_RT_ROLES		7
+#define	PI_RT_MAIN		PI_RT_ROLES	// The thread calling piRealtimeSetup
+
+struct piRealtimeProfile
+{
+  int          flags ;
+  unsigned int mainCpus ;
+  unsigned int threadCpus ;
+  size_t       stackBytes ;	// Prefaulted in the calling thread
+  size_t       heapBytes ;	// Prefaulted and kept by malloc
+  int          priority [PI_RT_ROLES + 1] ;
+} ;
+
+// wiringPiPinHandle:
+//	An on-board pin resolved down to its registers and bit by
+//	wiringPiGetPinHandle (). For when digitalWrite isn't fast enough.
+
+struct wiringPiPinHandle
+{
+  volatile unsigned int *set ;
+  volatile unsigned int *clr ;
+  volatile unsigned int *lev ;
+  unsigned int           mask ;
+} ;
+
+static inline void digitalWriteFast (const struct wiringPiPinHandle *handle, int value)
+{
+  if (value == 0)
+    *handle->clr = handle->mask ;
+  else
+    *handle->set = handle->mask ;
+}
+
+static inline int digitalReadFast (const struct wiringPiPinHandle *handle)
+{
+  return ((*handle->lev & handle->mask) != 0) ? HIGH : LOW ;
+}
+
+// pinConfig:
+//	One entry in a table for pinConfigureMany (). -1 for mode or pud
+//	leaves it as it is.
+
+struct pinConfig
+{
+  int pin ;
+  int mode ;
+  int pud ;
+} ;
+
 
 // Function prototypes
 //	c++ wrappers thanks to a comment by Nick Lott
@@ -198,6 +284,8 @@ extern int wiringPiFailure (int fatal, const char *message, ...) ;
 
 extern struct wiringPiNodeStruct *wiringPiFindNode (int pin) ;
 extern struct wiringPiNodeStruct *wiringPiNewNode  (int pinBase, int numPins) ;
+extern void wiringPiBegin	(void) ;
+extern void wiringPiCommit	(void) ;
 
 extern void wiringPiVersion	(int *major, int *minor) ;
 extern int  wiringPiSetup       (void) ;
@@ -208,6 +296,7 @@ extern int  wiringPiSetupPhys   (void) ;
 extern          void pinModeAlt          (int pin, int mode) ;
 extern          void pinMode             (int pin, int mode) ;
 extern          void pullUpDnControl     (int pin, int pud) ;
+extern          int  pinConfigureMany    (const struct pinConfig *cfg, int n) ;
 extern          int  digitalRead         (int pin) ;
 extern          void digitalWrite        (int pin, int value) ;
 extern unsigned int  digitalRead8        (int pin) ;
@@ -231,6 +320,7 @@ extern          int  wpiPinToGpio        (int wpiPin) ;
 extern          int  physPinToGpio       (int physPin) ;
 extern          void setPadDrive         (int group, int value) ;
 extern          int  getAlt              (int pin) ;
+extern          int  pwmToneChannel      (int pin) ;
 extern          void pwmToneWrite        (int pin, int freq) ;
 extern          void pwmSetMode          (int mode) ;
 extern          void pwmSetRange         (unsigned int range) ;
@@ -240,12 +330,16 @@ extern unsigned int  digitalReadByte     (void) ;
 extern unsigned int  digitalReadByte2    (void) ;
 extern          void digitalWriteByte    (int value) ;
 extern          void digitalWriteByte2   (int value) ;
+extern          void digitalWriteBank    (int bank, unsigned int set, unsigned int clear) ;
+extern          int  wiringPiGetPinHandle (int pin, struct wiringPiPinHandle *handle) ;
 
 // Interrupts
 //	(Also Pi hardware specific)
 
 extern int  waitForInterrupt    (int pin, int mS) ;
 extern int  wiringPiISR         (int pin, int mode, void (*function)(void)) ;
+extern int  wiringPiEdgeSetup   (int pin, int mode) ;
+extern void wiringPiEdgeRelease (int pin) ;
 
 // Threads
 
@@ -253,16 +347,28 @@ extern int  piThreadCreate      (void *(*fn)(void *)) ;
 extern void piLock              (int key) ;
 extern void piUnlock            (int key) ;
 
+extern struct piRing *piRingCreate (int flags, unsigned int slots, unsigned int itemSize) ;
+extern void           piRingFree   (struct piRing *ring) ;
+extern int            piRingPush   (struct piRing *ring, const void *items, int count) ;
+extern int            piRingPop    (struct piRing *ring, void *items, int max) ;
+extern int            piRingWait   (struct piRing *ring, int mS) ;
+extern int            piRingFd     (struct piRing *ring) ;
+
 // Schedulling priority
 
 extern int piHiPri (const int pri) ;
 
+extern int piRealtimeSetup  (const struct piRealtimeProfile *profile) ;
+extern int piRealtimeThread (int role) ;
+
 // Extras from arduino land
 
 extern void         delay             (unsigned int howLong) ;
 extern void         delayMicroseconds (unsigned int howLong) ;
 extern unsigned int millis            (void) ;
 extern unsigned int micros            (void) ;
+extern uint64_t     micros64          (void) ;
+extern uint64_t     nanos             (void) ;
 
 #ifdef __cplusplus
 }
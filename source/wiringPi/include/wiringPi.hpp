@@ -0,0 +1,282 @@
+/*
+ * wiringPi.hpp:
+ *	C++17 templates for on-board pins with the pin number known at
+ *	compile time.
+ *
+ *	The pin number and numbering scheme are template arguments, so the
+ *	translation to a BCM_GPIO number, the register offsets and the bit
+ *	mask are all worked out by the compiler. pin.set () is then a single
+ *	store to the GPSET register, with no run-time translation at all.
+ *	Invalid pins are rejected by static_assert.
+ *
+ *	wiringPiSetup* must still be called first to map the hardware, and
+ *	it must be one of the memory mapped setups - not wiringPiSetupSys.
+ *	The templates don't care which numbering scheme you give to setup.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__WIRING_PI_HPP__
+#define	__WIRING_PI_HPP__
+
+#if __cplusplus < 201703L
+#  error "wiringPi.hpp needs C++17 or later"
+#endif
+
+#include <stdint.h>
+
+#include "wiringPi.h"
+
+namespace wiringPi
+{
+
+// Numbering:
+//	Which pin numbering scheme the template argument is in.
+
+enum class Numbering
+{
+  WiringPi = WPI_MODE_PINS,
+  Bcm      = WPI_MODE_GPIO,
+  Phys     = WPI_MODE_PHYS,
+} ;
+
+namespace detail
+{
+
+// The same tables as wiringPi.c. Only the Rev 2 layout is here - the
+//	Rev 1 boards (the very first Model B) need Numbering::Bcm.
+
+inline constexpr int pinToGpio [64] =
+{
+  17, 18, 27, 22, 23, 24, 25,  4,  2,  3,  8,  7, 10,  9, 11, 14,
+  15, 28, 29, 30, 31,  5,  6, 13, 19, 26, 12, 16, 20, 21,  0,  1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+} ;
+
+inline constexpr int physToGpio [64] =
+{
+  -1, -1, -1,  2, -1,  3, -1,  4, 14, -1, 15, 17, 18, 27, -1, 22,
+  23, -1, 24, 10, -1,  9, 25, 11,  8, -1,  7,  0,  1,  5, -1,  6,
+  12, 13, -1, 19, 16, 26, 20, -1, 21, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+} ;
+
+// Register word offsets - see wiringPi.c
+
+inline constexpr unsigned int GPFSEL0 =  0 ;
+inline constexpr unsigned int GPSET0  =  7 ;
+inline constexpr unsigned int GPCLR0  = 10 ;
+inline constexpr unsigned int GPLEV0  = 13 ;
+
+// toGpio:
+//	Translate a pin to BCM_GPIO, or -1 if it isn't a GPIO pin.
+
+constexpr int toGpio (int pin, Numbering numbering)
+{
+  if ((pin < 0) || (pin > 63))
+    return -1 ;
+
+  switch (numbering)
+  {
+    case Numbering::WiringPi:	return pinToGpio  [pin] ;
+    case Numbering::Phys:	return physToGpio [pin] ;
+    case Numbering::Bcm:	return (pin <= 53) ? pin : -1 ;
+  }
+  return -1 ;
+}
+
+// PinInfo:
+//	Everything we need to know about a pin, worked out at compile time.
+
+template <int Pin, Numbering N>
+struct PinInfo
+{
+  static constexpr int gpio = toGpio (Pin, N) ;
+
+  static_assert (gpio >= 0, "wiringPi: Not a GPIO pin in this numbering scheme") ;
+
+  static constexpr unsigned int bank     = (unsigned int)gpio / 32 ;
+  static constexpr uint32_t     mask     = (uint32_t)1 << (gpio & 31) ;
+  static constexpr unsigned int set      = GPSET0  + bank ;
+  static constexpr unsigned int clr      = GPCLR0  + bank ;
+  static constexpr unsigned int lev      = GPLEV0  + bank ;
+  static constexpr unsigned int fsel     = GPFSEL0 + (unsigned int)gpio / 10 ;
+  static constexpr unsigned int fselShift = ((unsigned int)gpio % 10) * 3 ;
+} ;
+
+// setFunction:
+//	Read-modify-write the function select register. 0 is input, 1 output.
+
+inline void setFunction (unsigned int fsel, unsigned int shift, uint32_t function)
+{
+  _wiringPiGpio [fsel] = (_wiringPiGpio [fsel] & ~((uint32_t)7 << shift)) | (function << shift) ;
+}
+
+} // namespace detail
+
+
+/*
+ * OutputPin:
+ *	An on-board pin set to output when constructed.
+ *********************************************************************************
+ */
+
+template <int Pin, Numbering N = Numbering::WiringPi>
+class OutputPin
+{
+  using Info = detail::PinInfo <Pin, N> ;
+
+public:
+  static constexpr int      gpio = Info::gpio ;
+  static constexpr uint32_t mask = Info::mask ;
+
+  OutputPin ()
+  {
+    detail::setFunction (Info::fsel, Info::fselShift, 1) ;
+  }
+
+  void set   () const { _wiringPiGpio [Info::set] = Info::mask ; }
+  void clear () const { _wiringPiGpio [Info::clr] = Info::mask ; }
+
+  void write (int value) const
+  {
+    if (value == LOW)
+      clear () ;
+    else
+      set () ;
+  }
+
+  int read () const
+  {
+    return ((_wiringPiGpio [Info::lev] & Info::mask) != 0) ? HIGH : LOW ;
+  }
+
+  void toggle () const
+  {
+    write (!read ()) ;
+  }
+} ;
+
+
+/*
+ * InputPin:
+ *	An on-board pin set to input when constructed. Use pullUpDnControl ()
+ *	for the pull-up/down - that's a slow operation anyway.
+ *********************************************************************************
+ */
+
+template <int Pin, Numbering N = Numbering::WiringPi>
+class InputPin
+{
+  using Info = detail::PinInfo <Pin, N> ;
+
+public:
+  static constexpr int      gpio = Info::gpio ;
+  static constexpr uint32_t mask = Info::mask ;
+
+  InputPin ()
+  {
+    detail::setFunction (Info::fsel, Info::fselShift, 0) ;
+  }
+
+  int read () const
+  {
+    return ((_wiringPiGpio [Info::lev] & Info::mask) != 0) ? HIGH : LOW ;
+  }
+} ;
+
+
+/*
+ * PinBus:
+ *	A group of output pins written together as a number. The first pin
+ *	is bit 0. The masks for each bank are known at compile time, so a
+ *	write is one clear and one set store per bank the pins live in.
+ *********************************************************************************
+ */
+
+template <Numbering N, int... Pins>
+class PinBus
+{
+  static_assert (sizeof... (Pins) > 0,  "wiringPi: PinBus needs at least one pin") ;
+  static_assert (sizeof... (Pins) <= 32, "wiringPi: PinBus is limited to 32 pins") ;
+
+  static constexpr uint32_t bankMask (unsigned int bank)
+  {
+    return ((detail::PinInfo <Pins, N>::bank == bank ? detail::PinInfo <Pins, N>::mask : 0) | ...) ;
+  }
+
+  static constexpr int bitCount (uint32_t bits)
+  {
+    int count = 0 ;
+    for ( ; bits != 0 ; bits &= bits - 1)
+      ++count ;
+    return count ;
+  }
+
+  static constexpr uint32_t bankMask0 = bankMask (0) ;
+  static constexpr uint32_t bankMask1 = bankMask (1) ;
+
+  static_assert (bitCount (bankMask0) + bitCount (bankMask1) == (int)sizeof... (Pins), "wiringPi: PinBus pins must be distinct") ;
+
+public:
+  static constexpr int width = (int)sizeof... (Pins) ;
+
+  PinBus ()
+  {
+    (detail::setFunction (detail::PinInfo <Pins, N>::fsel, detail::PinInfo <Pins, N>::fselShift, 1), ...) ;
+  }
+
+  void write (uint32_t value) const
+  {
+    uint32_t set [2] = { 0, 0 } ;
+    unsigned int bit = 0 ;
+
+    ((set [detail::PinInfo <Pins, N>::bank] |= ((value >> bit++) & 1) ? detail::PinInfo <Pins, N>::mask : 0), ...) ;
+
+    if constexpr (bankMask0 != 0)
+    {
+      _wiringPiGpio [detail::GPCLR0] = bankMask0 & ~set [0] ;
+      _wiringPiGpio [detail::GPSET0] = set [0] ;
+    }
+    if constexpr (bankMask1 != 0)
+    {
+      _wiringPiGpio [detail::GPCLR0 + 1] = bankMask1 & ~set [1] ;
+      _wiringPiGpio [detail::GPSET0 + 1] = set [1] ;
+    }
+  }
+
+  uint32_t read () const
+  {
+    uint32_t lev [2] = { 0, 0 } ;
+    uint32_t value = 0 ;
+    unsigned int bit = 0 ;
+
+    if constexpr (bankMask0 != 0) lev [0] = _wiringPiGpio [detail::GPLEV0] ;
+    if constexpr (bankMask1 != 0) lev [1] = _wiringPiGpio [detail::GPLEV0 + 1] ;
+
+    ((value |= ((lev [detail::PinInfo <Pins, N>::bank] & detail::PinInfo <Pins, N>::mask) != 0 ? 1u : 0u) << bit++), ...) ;
+
+    return value ;
+  }
+} ;
+
+} // namespace wiringPi
+
+#endif
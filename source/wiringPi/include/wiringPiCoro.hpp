@@ -0,0 +1,544 @@
+/*
+ * wiringPiCoro.hpp:
+ *	C++20 coroutines over wiringPi.
+ *
+ *	An Executor runs an epoll loop on one thread and resumes coroutines
+ *	when what they're waiting for has happened:
+ *
+ *	  co_await ex.edge (pin, INT_EDGE_RISING) ;	// Next edge on a pin
+ *	  co_await ex.sleepUntil (deadline) ;		// piTimerNow () time
+ *	  co_await ex.sleepFor (nS) ;
+ *	  co_await ex.readable (fd) ;			// Sockets, pipes, ...
+ *	  int v = co_await ex.analogRead (pin) ;	// Done on a helper thread
+ *
+ *	A suspended coroutine costs a small heap frame and nothing else, so
+ *	thousands of them can share the one thread. All the timers share a
+ *	single timerfd - or, on the virtual clock (piClockSetup), sleep on
+ *	that instead.
+ *
+ *	Tasks are fire-and-forget: spawn () them, then call run (). run ()
+ *	returns when there is nothing left to wait for, or after stop ().
+ *	Everything except stop () must be called from the executor thread.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef	__WIRING_PI_CORO_HPP__
+#define	__WIRING_PI_CORO_HPP__
+
+#if __cplusplus < 202002L
+#  error "wiringPiCoro.hpp needs C++20 or later"
+#endif
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "wiringPi.h"
+#include "piTimer.h"
+
+namespace wiringPi
+{
+
+/*
+ * Task:
+ *	A fire-and-forget coroutine. It starts suspended and the executor
+ *	starts it when spawned. The frame frees itself when it finishes.
+ *********************************************************************************
+ */
+
+struct Task
+{
+  struct promise_type
+  {
+    Task get_return_object ()
+    {
+      return Task { std::coroutine_handle <promise_type>::from_promise (*this) } ;
+    }
+
+    std::suspend_always initial_suspend () noexcept { return {} ; }
+    std::suspend_never  final_suspend   () noexcept { return {} ; }
+    void return_void () {}
+    void unhandled_exception () { std::terminate () ; }
+  } ;
+
+  std::coroutine_handle <promise_type> handle ;
+} ;
+
+
+/*
+ * Executor:
+ *********************************************************************************
+ */
+
+class Executor
+{
+public:
+  Executor ()
+  {
+    epollFd = epoll_create1 (EPOLL_CLOEXEC) ;
+    timerFd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK) ;
+    wakeFd  = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK) ;
+
+    if ((epollFd < 0) || (timerFd < 0) || (wakeFd < 0))
+      (void)wiringPiFailure (WPI_FATAL, "wiringPi::Executor: Unable to create epoll/timerfd/eventfd\n") ;
+
+    addInternal (timerFd) ;
+    addInternal (wakeFd) ;
+  }
+
+  ~Executor ()
+  {
+    if (helper.joinable ())
+    {
+      {
+	std::lock_guard <std::mutex> lock (helperMutex) ;
+	helperQuit = true ;
+      }
+      helperCond.notify_one () ;
+      helper.join () ;
+    }
+
+// The edge fds belong to wiringPi - see wiringPiEdgeSetup ()
+
+    close (wakeFd) ;
+    close (timerFd) ;
+    close (epollFd) ;
+  }
+
+  Executor (const Executor &) = delete ;
+  Executor &operator= (const Executor &) = delete ;
+
+// spawn:
+//	Queue a task to be started by run ()
+
+  void spawn (Task task)
+  {
+    ready.push_back (task.handle) ;
+  }
+
+// stop:
+//	Make run () return. Safe to call from any thread, including before
+//	run () has started - it then returns straight away.
+
+  void stop ()
+  {
+    uint64_t one = 1 ;
+
+    stopping = true ;
+    (void)write (wakeFd, &one, sizeof (one)) ;
+  }
+
+  void run () ;
+
+// Awaitables
+
+  struct FdAwaiter ;
+  struct SleepAwaiter ;
+  struct EdgeAwaiter ;
+  struct AnalogAwaiter ;
+
+  FdAwaiter     readable   (int fd) ;
+  SleepAwaiter  sleepUntil (uint64_t deadline) ;
+  SleepAwaiter  sleepFor   (uint64_t nS) ;
+  EdgeAwaiter   edge       (int pin, int mode) ;
+  AnalogAwaiter analogRead (int pin) ;
+
+private:
+  struct FdWaiters
+  {
+    uint32_t                             events = 0 ;
+    std::vector <std::coroutine_handle<>> handles ;
+  } ;
+
+  struct Timer
+  {
+    uint64_t                deadline ;
+    std::coroutine_handle<> handle ;
+
+    bool operator> (const Timer &other) const { return deadline > other.deadline ; }
+  } ;
+
+  struct AnalogJob
+  {
+    int                     pin ;
+    int                     value ;
+    std::coroutine_handle<> handle ;
+  } ;
+
+  void addInternal (int fd)
+  {
+    struct epoll_event ev {} ;
+
+    ev.events  = EPOLLIN ;
+    ev.data.fd = fd ;
+    epoll_ctl (epollFd, EPOLL_CTL_ADD, fd, &ev) ;
+  }
+
+// waitFd:
+//	Park a coroutine until fd reports one of events. The fd is only in
+//	the epoll set while someone is waiting on it.
+
+  void waitFd (int fd, uint32_t events, std::coroutine_handle<> handle)
+  {
+    struct epoll_event ev {} ;
+    FdWaiters &w = fdWaiters [fd] ;
+    int op = w.handles.empty () ? EPOLL_CTL_ADD : EPOLL_CTL_MOD ;
+
+    w.events |= events ;
+    w.handles.push_back (handle) ;
+
+    ev.events  = w.events ;
+    ev.data.fd = fd ;
+    epoll_ctl (epollFd, op, fd, &ev) ;
+  }
+
+// armTimer:
+//	The timerfd only knows real time, so it's left disarmed on the
+//	virtual clock - run () sleeps on the clock instead.
+
+  void armTimer ()
+  {
+    struct itimerspec its {} ;
+
+    if (!timers.empty () && !piClockVirtual)
+    {
+      uint64_t deadline = timers.top ().deadline ;
+
+      if (deadline == 0)
+	deadline = 1 ;	// Zero would disarm it
+      its.it_value.tv_sec  = (time_t)(deadline / 1000000000) ;
+      its.it_value.tv_nsec = (long)  (deadline % 1000000000) ;
+    }
+    timerfd_settime (timerFd, TFD_TIMER_ABSTIME, &its, NULL) ;
+  }
+
+  void expireTimers ()
+  {
+    uint64_t now = piTimerNow () ;
+
+    while (!timers.empty () && (timers.top ().deadline <= now))
+    {
+      ready.push_back (timers.top ().handle) ;
+      timers.pop () ;
+    }
+    armTimer () ;
+  }
+
+  void addTimer (uint64_t deadline, std::coroutine_handle<> handle)
+  {
+    bool earliest = timers.empty () || (deadline < timers.top ().deadline) ;
+
+    timers.push ({ deadline, handle }) ;
+    if (earliest)
+      armTimer () ;
+  }
+
+  void startAnalog (AnalogJob *job) ;
+  void helperThread () ;
+
+  bool idle () const
+  {
+    return ready.empty () && fdWaiters.empty () && timers.empty () && (analogPending == 0) ;
+  }
+
+  int epollFd, timerFd, wakeFd ;
+  std::atomic <bool> stopping { false } ;
+
+  std::deque <std::coroutine_handle<>>                                  ready ;
+  std::unordered_map <int, FdWaiters>                                   fdWaiters ;
+  std::priority_queue <Timer, std::vector <Timer>, std::greater <Timer>> timers ;
+  std::unordered_map <int, int>                                         edgeFds ;
+
+// The analogRead helper thread. Most analogRead ()s end up in I2C or SPI
+//	transfers that block, so they're done on one side thread and the
+//	results handed back through wakeFd.
+
+  std::thread               helper ;
+  std::mutex                helperMutex ;
+  std::condition_variable   helperCond ;
+  bool                      helperQuit = false ;
+  std::deque <AnalogJob *>  analogQueue ;
+  std::vector <AnalogJob *> analogDone ;
+  int                       analogPending = 0 ;
+
+public:
+
+  struct FdAwaiter
+  {
+    Executor &ex ;
+    int       fd ;
+    uint32_t  events ;
+
+    bool await_ready () const noexcept { return false ; }
+    void await_suspend (std::coroutine_handle<> h) { ex.waitFd (fd, events, h) ; }
+    void await_resume () const noexcept {}
+  } ;
+
+  struct SleepAwaiter
+  {
+    Executor &ex ;
+    uint64_t  deadline ;
+
+    bool await_ready () const noexcept { return piTimerNow () >= deadline ; }
+    void await_suspend (std::coroutine_handle<> h) { ex.addTimer (deadline, h) ; }
+    void await_resume () const noexcept {}
+  } ;
+
+// EdgeAwaiter:
+//	Returns the level of the pin after the edge, or -1 if the pin
+//	couldn't be set up for edges.
+
+  struct EdgeAwaiter
+  {
+    Executor &ex ;
+    int       fd ;
+
+    bool await_ready () const noexcept { return fd < 0 ; }
+
+    void await_suspend (std::coroutine_handle<> h)
+    {
+      char c ;
+
+      // Clear anything already pending, so we only see a new edge
+
+      lseek (fd, 0L, SEEK_SET) ;
+      (void)read (fd, &c, 1) ;
+      ex.waitFd (fd, EPOLLPRI | EPOLLERR, h) ;
+    }
+
+    int await_resume () const
+    {
+      char c = '0' ;
+
+      if (fd < 0)
+	return -1 ;
+
+      lseek (fd, 0L, SEEK_SET) ;
+      if (read (fd, &c, 1) != 1)
+	return -1 ;
+      return (c == '0') ? LOW : HIGH ;
+    }
+  } ;
+
+  struct AnalogAwaiter
+  {
+    Executor &ex ;
+    AnalogJob job ;
+
+    bool await_ready () const noexcept { return false ; }
+    void await_suspend (std::coroutine_handle<> h) { job.handle = h ; ex.startAnalog (&job) ; }
+    int  await_resume () const noexcept { return job.value ; }
+  } ;
+} ;
+
+
+/*
+ * Awaitable factories
+ *********************************************************************************
+ */
+
+inline Executor::FdAwaiter Executor::readable (int fd)
+{
+  return FdAwaiter { *this, fd, EPOLLIN | EPOLLRDHUP } ;
+}
+
+inline Executor::SleepAwaiter Executor::sleepUntil (uint64_t deadline)
+{
+  return SleepAwaiter { *this, deadline } ;
+}
+
+inline Executor::SleepAwaiter Executor::sleepFor (uint64_t nS)
+{
+  return SleepAwaiter { *this, piTimerNow () + nS } ;
+}
+
+// edge:
+//	The first wait on a pin sets it up via wiringPiEdgeSetup (). After
+//	that the mode is fixed - as with wiringPiISR ().
+
+inline Executor::EdgeAwaiter Executor::edge (int pin, int mode)
+{
+  auto it = edgeFds.find (pin) ;
+
+  if (it == edgeFds.end ())
+    it = edgeFds.emplace (pin, wiringPiEdgeSetup (pin, mode)).first ;
+
+  return EdgeAwaiter { *this, it->second } ;
+}
+
+inline Executor::AnalogAwaiter Executor::analogRead (int pin)
+{
+  return AnalogAwaiter { *this, AnalogJob { pin, 0, nullptr } } ;
+}
+
+
+/*
+ * startAnalog: helperThread:
+ *********************************************************************************
+ */
+
+inline void Executor::startAnalog (AnalogJob *job)
+{
+  ++analogPending ;
+
+  {
+    std::lock_guard <std::mutex> lock (helperMutex) ;
+    analogQueue.push_back (job) ;
+    if (!helper.joinable ())
+      helper = std::thread (&Executor::helperThread, this) ;
+  }
+  helperCond.notify_one () ;
+}
+
+inline void Executor::helperThread ()
+{
+  uint64_t one = 1 ;
+  AnalogJob *job ;
+
+  for (;;)
+  {
+    {
+      std::unique_lock <std::mutex> lock (helperMutex) ;
+      helperCond.wait (lock, [this] { return helperQuit || !analogQueue.empty () ; }) ;
+      if (helperQuit)
+	return ;
+      job = analogQueue.front () ;
+      analogQueue.pop_front () ;
+    }
+
+    job->value = ::analogRead (job->pin) ;
+
+    {
+      std::lock_guard <std::mutex> lock (helperMutex) ;
+      analogDone.push_back (job) ;
+    }
+    (void)write (wakeFd, &one, sizeof (one)) ;
+  }
+}
+
+
+/*
+ * run:
+ *	The event loop.
+ *********************************************************************************
+ */
+
+inline void Executor::run ()
+{
+  struct epoll_event events [64] ;
+  std::vector <AnalogJob *> done ;
+  uint64_t count ;
+  int n, i ;
+
+  for (;;)
+  {
+    while (!ready.empty () && !stopping)
+    {
+      std::coroutine_handle<> h = ready.front () ;
+      ready.pop_front () ;
+      h.resume () ;
+    }
+
+// A stop is used up by the run it ends, so one issued before run ()
+//	started still counts.
+
+    if (stopping.exchange (false) || idle ())
+      return ;
+
+// On the virtual clock take whatever's ready now, and if there's
+//	nothing, sleep on the clock to the first timer.
+
+    if (piClockVirtual && !timers.empty ())
+    {
+      if ((n = epoll_wait (epollFd, events, 64, 0)) == 0)
+      {
+	piSleepUntil (timers.top ().deadline) ;
+	expireTimers () ;
+	continue ;
+      }
+    }
+    else
+      n = epoll_wait (epollFd, events, 64, -1) ;
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+	continue ;
+      (void)wiringPiFailure (WPI_FATAL, "wiringPi::Executor: epoll_wait failed\n") ;
+      return ;
+    }
+
+    for (i = 0 ; i < n ; ++i)
+    {
+      int fd = events [i].data.fd ;
+
+      if (fd == timerFd)
+      {
+	(void)read (timerFd, &count, sizeof (count)) ;
+	expireTimers () ;
+      }
+      else if (fd == wakeFd)
+      {
+	(void)read (wakeFd, &count, sizeof (count)) ;
+
+	{
+	  std::lock_guard <std::mutex> lock (helperMutex) ;
+	  done.swap (analogDone) ;
+	}
+	for (AnalogJob *job : done)
+	{
+	  --analogPending ;
+	  ready.push_back (job->handle) ;
+	}
+	done.clear () ;
+      }
+      else
+      {
+	auto it = fdWaiters.find (fd) ;
+
+	if (it == fdWaiters.end ())
+	  continue ;
+
+	epoll_ctl (epollFd, EPOLL_CTL_DEL, fd, NULL) ;
+	for (auto h : it->second.handles)
+	  ready.push_back (h) ;
+	fdWaiters.erase (it) ;
+      }
+    }
+  }
+}
+
+} // namespace wiringPi
+
+#endif
@@ -25,10 +25,43 @@
 #define	LSBFIRST	0
 #define	MSBFIRST	1
 
+// SPI style clock modes for shiftBusSetup: bit 1 is the clock polarity
+//	(idle level), bit 0 the phase (0 to sample on the leading edge, 1 on
+//	the trailing edge). shiftIn/shiftOut are mode 0.
+
+#define	SHIFT_MODE_0	0
+#define	SHIFT_MODE_1	1
+#define	SHIFT_MODE_2	2
+#define	SHIFT_MODE_3	3
+
 #ifndef	_STDINT_H
 #  include <stdint.h>
 #endif
 
+// shiftBusPin:
+//	One pin of a bus, resolved to its registers when it's on-board and
+//	we're memory mapped. set is NULL when it isn't and we fall back to
+//	digitalWrite/digitalRead.
+
+struct shiftBusPin
+{
+  int                    pin ;
+  volatile unsigned int *set ;
+  volatile unsigned int *clr ;
+  volatile unsigned int *lev ;
+  unsigned int           mask ;
+} ;
+
+struct shiftBus
+{
+  struct shiftBusPin dOut ;
+  struct shiftBusPin dIn ;
+  struct shiftBusPin clk ;
+  int                mode ;
+  int                order ;
+  unsigned int       halfPeriod ;	// nS, 0 for as fast as possible
+} ;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,6 +69,9 @@ extern "C" {
 extern uint8_t shiftIn      (uint8_t dPin, uint8_t cPin, uint8_t order) ;
 extern void    shiftOut     (uint8_t dPin, uint8_t cPin, uint8_t order, uint8_t val) ;
 
+extern int     shiftBusSetup    (struct shiftBus *bus, int dOutPin, int dInPin, int clkPin, int mode, int order, unsigned int speed) ;
+extern void    shiftBusTransfer (struct shiftBus *bus, const uint8_t *tx, uint8_t *rx, int len) ;
+
 #ifdef __cplusplus
 }
 #endif
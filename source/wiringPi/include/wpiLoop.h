@@ -0,0 +1,61 @@
+/*
+ * wpiLoop.h:
+ *	One thread, one epoll set: callbacks for GPIO edges, timers and
+ *	any other file descriptor - serial ports, sockets, rings, ...
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+
+#ifndef	__WPI_LOOP_H__
+#define	__WPI_LOOP_H__
+
+#include <stdint.h>
+
+// Most things being watched at once
+
+#define	WPI_LOOP_MAX		256
+
+// Events for wpiLoopFd
+
+#define	WPI_LOOP_READ		0x01
+#define	WPI_LOOP_WRITE		0x02
+#define	WPI_LOOP_ERROR		0x04	// Always reported - error or hangup
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// They all return a watch number for wpiLoopCancel, or -1. Timer times
+//	are absolute, in piTimerNow () nanoseconds, and a period of 0 is once
+//	only. Everything but wpiLoopStop is for the thread that runs the loop
+//	(or before it starts).
+
+extern int  wpiLoopEdge   (int pin, int mode, void (*fn)(int pin, int level, void *arg), void *arg) ;
+extern int  wpiLoopFd     (int fd, int events, void (*fn)(int fd, int events, void *arg), void *arg) ;
+extern int  wpiLoopTimer  (uint64_t first, uint64_t period, void (*fn)(void *arg), void *arg) ;
+extern int  wpiLoopCancel (int watch) ;
+extern int  wpiLoopRun    (void) ;
+extern void wpiLoopStop   (void) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -94,8 +94,24 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
   else
     old |=   bit ;
 
-  wiringPiI2CWriteReg8 (node->fd, MCP23x08_GPIO, old) ;
   node->data2 = old ;
+
+  if (wiringPiBatching)
+    node->dirty = 1 ;
+  else
+    wiringPiI2CWriteReg8 (node->fd, MCP23x08_GPIO, old) ;
+}
+
+
+/*
+ * myFlush:
+ *	Write out the port after wiringPiBegin ()
+ *********************************************************************************
+ */
+
+static void myFlush (struct wiringPiNodeStruct *node)
+{
+  wiringPiI2CWriteReg8 (node->fd, MCP23x08_GPIO, node->data2) ;
 }
 
 
@@ -143,6 +159,7 @@ int mcp23008Setup (const int pinBase, const int i2cAddress)
   node->pullUpDnControl = myPullUpDnControl ;
   node->digitalRead     = myDigitalRead ;
   node->digitalWrite    = myDigitalWrite ;
+  node->flush           = myFlush ;
   node->data2           = wiringPiI2CReadReg8 (fd, MCP23x08_OLAT) ;
 
   return TRUE ;
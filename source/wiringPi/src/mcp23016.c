@@ -85,8 +85,12 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
     else
       old |=   bit ;
 
-    wiringPiI2CWriteReg8 (node->fd, MCP23016_GP0, old) ;
     node->data2 = old ;
+
+    if (wiringPiBatching)
+      node->dirty |= 1 ;
+    else
+      wiringPiI2CWriteReg8 (node->fd, MCP23016_GP0, old) ;
   }
   else				// Bank B
   {
@@ -97,12 +101,34 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
     else
       old |=   bit ;
 
-    wiringPiI2CWriteReg8 (node->fd, MCP23016_GP1, old) ;
     node->data3 = old ;
+
+    if (wiringPiBatching)
+      node->dirty |= 2 ;
+    else
+      wiringPiI2CWriteReg8 (node->fd, MCP23016_GP1, old) ;
   }
 }
 
 
+/*
+ * myFlush:
+ *	Write out the ports changed since wiringPiBegin (). GP0 and GP1 are
+ *	a register pair, so both go in one transaction.
+ *********************************************************************************
+ */
+
+static void myFlush (struct wiringPiNodeStruct *node)
+{
+  /**/ if (node->dirty == 3)
+    wiringPiI2CWriteReg16 (node->fd, MCP23016_GP0, node->data2 | (node->data3 << 8)) ;
+  else if (node->dirty == 1)
+    wiringPiI2CWriteReg8  (node->fd, MCP23016_GP0, node->data2) ;
+  else if (node->dirty == 2)
+    wiringPiI2CWriteReg8  (node->fd, MCP23016_GP1, node->data3) ;
+}
+
+
 /*
  * myDigitalRead:
  *********************************************************************************
@@ -157,6 +183,7 @@ int mcp23016Setup (const int pinBase, const int i2cAddress)
   node->pinMode         = myPinMode ;
   node->digitalRead     = myDigitalRead ;
   node->digitalWrite    = myDigitalWrite ;
+  node->flush           = myFlush ;
   node->data2           = wiringPiI2CReadReg8 (fd, MCP23016_OLAT0) ;
   node->data3           = wiringPiI2CReadReg8 (fd, MCP23016_OLAT1) ;
 
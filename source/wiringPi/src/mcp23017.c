@@ -116,8 +116,12 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
     else
       old |=   bit ;
 
-    wiringPiI2CWriteReg8 (node->fd, MCP23x17_GPIOA, old) ;
     node->data2 = old ;
+
+    if (wiringPiBatching)
+      node->dirty |= 1 ;
+    else
+      wiringPiI2CWriteReg8 (node->fd, MCP23x17_GPIOA, old) ;
   }
   else				// Bank B
   {
@@ -128,12 +132,35 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
     else
       old |=   bit ;
 
-    wiringPiI2CWriteReg8 (node->fd, MCP23x17_GPIOB, old) ;
     node->data3 = old ;
+
+    if (wiringPiBatching)
+      node->dirty |= 2 ;
+    else
+      wiringPiI2CWriteReg8 (node->fd, MCP23x17_GPIOB, old) ;
   }
 }
 
 
+/*
+ * myFlush:
+ *	Write out the banks changed since wiringPiBegin (). With IOCON.BANK
+ *	clear and sequential operation off, the address pointer toggles
+ *	between GPIOA and GPIOB, so both go in one transaction.
+ *********************************************************************************
+ */
+
+static void myFlush (struct wiringPiNodeStruct *node)
+{
+  /**/ if (node->dirty == 3)
+    wiringPiI2CWriteReg16 (node->fd, MCP23x17_GPIOA, node->data2 | (node->data3 << 8)) ;
+  else if (node->dirty == 1)
+    wiringPiI2CWriteReg8  (node->fd, MCP23x17_GPIOA, node->data2) ;
+  else if (node->dirty == 2)
+    wiringPiI2CWriteReg8  (node->fd, MCP23x17_GPIOB, node->data3) ;
+}
+
+
 /*
  * myDigitalRead:
  *********************************************************************************
@@ -188,6 +215,7 @@ int mcp23017Setup (const int pinBase, const int i2cAddress)
   node->pullUpDnControl = myPullUpDnControl ;
   node->digitalRead     = myDigitalRead ;
   node->digitalWrite    = myDigitalWrite ;
+  node->flush           = myFlush ;
   node->data2           = wiringPiI2CReadReg8 (fd, MCP23x17_OLATA) ;
   node->data3           = wiringPiI2CReadReg8 (fd, MCP23x17_OLATB) ;
 
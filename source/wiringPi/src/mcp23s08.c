@@ -133,8 +133,24 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
   else
     old |=   bit ;
 
-  writeByte (node->data0, node->data1, MCP23x08_GPIO, old) ;
   node->data2 = old ;
+
+  if (wiringPiBatching)
+    node->dirty = 1 ;
+  else
+    writeByte (node->data0, node->data1, MCP23x08_GPIO, old) ;
+}
+
+
+/*
+ * myFlush:
+ *	Write out the port after wiringPiBegin ()
+ *********************************************************************************
+ */
+
+static void myFlush (struct wiringPiNodeStruct *node)
+{
+  writeByte (node->data0, node->data1, MCP23x08_GPIO, node->data2) ;
 }
 
 
@@ -182,6 +198,7 @@ int mcp23s08Setup (const int pinBase, const int spiPort, const int devId)
   node->pullUpDnControl = myPullUpDnControl ;
   node->digitalRead     = myDigitalRead ;
   node->digitalWrite    = myDigitalWrite ;
+  node->flush           = myFlush ;
   node->data2           = readByte (spiPort, devId, MCP23x08_OLAT) ;
 
   return TRUE ;
@@ -155,8 +155,12 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
     else
       old |=   bit ;
 
-    writeByte (node->data0, node->data1, MCP23x17_GPIOA, old) ;
     node->data2 = old ;
+
+    if (wiringPiBatching)
+      node->dirty |= 1 ;
+    else
+      writeByte (node->data0, node->data1, MCP23x17_GPIOA, old) ;
   }
   else				// Bank B
   {
@@ -167,9 +171,41 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
     else
       old |=   bit ;
 
-    writeByte (node->data0, node->data1, MCP23x17_GPIOB, old) ;
     node->data3 = old ;
+
+    if (wiringPiBatching)
+      node->dirty |= 2 ;
+    else
+      writeByte (node->data0, node->data1, MCP23x17_GPIOB, old) ;
+  }
+}
+
+
+/*
+ * myFlush:
+ *	Write out the banks changed since wiringPiBegin (). With IOCON.BANK
+ *	clear and sequential operation off, the address pointer toggles
+ *	between GPIOA and GPIOB, so both go in one transfer.
+ *********************************************************************************
+ */
+
+static void myFlush (struct wiringPiNodeStruct *node)
+{
+  uint8_t spiData [4] ;
+
+  /**/ if (node->dirty == 3)
+  {
+    spiData [0] = CMD_WRITE | ((node->data1 & 7) << 1) ;
+    spiData [1] = MCP23x17_GPIOA ;
+    spiData [2] = node->data2 ;
+    spiData [3] = node->data3 ;
+
+    wiringPiSPIDataRW (node->data0, spiData, 4) ;
   }
+  else if (node->dirty == 1)
+    writeByte (node->data0, node->data1, MCP23x17_GPIOA, node->data2) ;
+  else if (node->dirty == 2)
+    writeByte (node->data0, node->data1, MCP23x17_GPIOB, node->data3) ;
 }
 
 
@@ -228,6 +264,7 @@ int mcp23s17Setup (const int pinBase, const int spiPort, const int devId)
   node->pullUpDnControl = myPullUpDnControl ;
   node->digitalRead     = myDigitalRead ;
   node->digitalWrite    = myDigitalWrite ;
+  node->flush           = myFlush ;
   node->data2           = readByte (spiPort, devId, MCP23x17_OLATA) ;
   node->data3           = readByte (spiPort, devId, MCP23x17_OLATB) ;
 
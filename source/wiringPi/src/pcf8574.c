@@ -51,8 +51,12 @@ static void myPinMode (struct wiringPiNodeStruct *node, int pin, int mode)
   else
     old |=   bit ;	// Write bit to 1
 
-  wiringPiI2CWrite (node->fd, old) ;
   node->data2 = old ;
+
+  if (wiringPiBatching)
+    node->dirty = 1 ;
+  else
+    wiringPiI2CWrite (node->fd, old) ;
 }
 
 
@@ -74,8 +78,24 @@ static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
   else
     old |=   bit ;
 
-  wiringPiI2CWrite (node->fd, old) ;
   node->data2 = old ;
+
+  if (wiringPiBatching)
+    node->dirty = 1 ;
+  else
+    wiringPiI2CWrite (node->fd, old) ;
+}
+
+
+/*
+ * myFlush:
+ *	Write out the port after wiringPiBegin ()
+ *********************************************************************************
+ */
+
+static void myFlush (struct wiringPiNodeStruct *node)
+{
+  wiringPiI2CWrite (node->fd, node->data2) ;
 }
 
 
@@ -120,6 +140,7 @@ int pcf8574Setup (const int pinBase, const int i2cAddress)
   node->pinMode      = myPinMode ;
   node->digitalRead  = myDigitalRead ;
   node->digitalWrite = myDigitalWrite ;
+  node->flush        = myFlush ;
   node->data2        = wiringPiI2CRead (fd) ;
 
   return TRUE ;
@@ -0,0 +1,414 @@
+/*
+ * piEdge.c:
+ *	Timestamped edge capture - a poor-mans logic analyser.
+ *
+ *	Every edge on the pins we're watching gets recorded as a
+ *	(pin, level, timestamp) record into a lock-free single producer,
+ *	single consumer ring buffer. One thread watches all the pins, so
+ *	there is no busy-polling thread per pin, and the buffer can live
+ *	in a named shared memory segment so another process can mmap it
+ *	and drain it.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piEdge.h"
+
+#define	MAX_PINS	64
+#define	MIN_RECORDS	64
+#define	MAX_RECORDS	(1 << 24)
+
+// The pins we're watching. The index into this is what we hand to epoll.
+
+struct edgeWatch
+{
+  int fd ;
+  int pin ;
+  int mode ;
+} ;
+
+static struct edgeWatch watches [MAX_PINS] ;
+static int numWatches = 0 ;
+
+static struct piEdgeRing *ring = NULL ;
+static size_t    ringBytes ;
+static char      ringName [64] ;
+static int       epollFd = -1 ;
+static pthread_t captureThread ;
+
+
+/*
+ * mapRing:
+ *	Create (or attach to) the memory for the ring.
+ *********************************************************************************
+ */
+
+static struct piEdgeRing *mapRing (const char *shmName, size_t *bytes, int create)
+{
+  struct stat st ;
+  void *mem ;
+  int fd ;
+
+  if (shmName == NULL)
+  {
+    mem = mmap (NULL, *bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0) ;
+    return (mem == MAP_FAILED) ? NULL : (struct piEdgeRing *)mem ;
+  }
+
+  if (create)
+  {
+    if ((fd = shm_open (shmName, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+      return NULL ;
+
+    if (ftruncate (fd, (off_t)*bytes) < 0)
+    {
+      close (fd) ;
+      return NULL ;
+    }
+  }
+  else
+  {
+    if ((fd = shm_open (shmName, O_RDWR, 0)) < 0)
+      return NULL ;
+
+    if ((fstat (fd, &st) < 0) || ((size_t)st.st_size < sizeof (struct piEdgeRing)))
+    {
+      close (fd) ;
+      return NULL ;
+    }
+    *bytes = (size_t)st.st_size ;
+  }
+
+  mem = mmap (NULL, *bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+
+  return (mem == MAP_FAILED) ? NULL : (struct piEdgeRing *)mem ;
+}
+
+
+/*
+ * edgeCaptureThread:
+ *	Wait for edges on any of the watched pins and record them.
+ *	We never block the producer - if the consumer isn't keeping up then
+ *	we count the edges we drop and flag the next record we do write.
+ *********************************************************************************
+ */
+
+static PI_THREAD (edgeCaptureThread)
+{
+  struct epoll_event events [MAX_PINS] ;
+  struct edgeWatch *w ;
+  struct piEdgeRecord *r ;
+  struct timespec ts ;
+  uint64_t ns, head, tail ;
+  uint32_t seq = 0 ;
+  int n, i, level ;
+  int overflow = FALSE ;
+  char c ;
+
+  (void)piRealtimeThread (PI_RT_EDGE) ;	// Only effective if we run as root
+
+  for (;;)
+  {
+    if ((n = epoll_wait (epollFd, events, MAX_PINS, -1)) < 0)
+    {
+      if (errno == EINTR)
+	continue ;
+      break ;
+    }
+
+// Take the time first - everything after this is overhead
+
+    clock_gettime (CLOCK_MONOTONIC, &ts) ;
+    ns = (uint64_t)ts.tv_sec * (uint64_t)1000000000 + (uint64_t)ts.tv_nsec ;
+
+    for (i = 0 ; i < n ; ++i)
+    {
+      w = &watches [events [i].data.u32] ;
+
+// Read & clear. For single edge modes we know what the level must have
+//	been, for both edges we have to take what the pin says now.
+
+      lseek (w->fd, 0, SEEK_SET) ;
+      if (read (w->fd, &c, 1) != 1)
+	continue ;
+
+      /**/ if (w->mode == INT_EDGE_RISING)
+	level = HIGH ;
+      else if (w->mode == INT_EDGE_FALLING)
+	level = LOW ;
+      else
+	level = (c == '0') ? LOW : HIGH ;
+
+      ++seq ;
+
+      head = ring->head ;
+      tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) ;
+      if ((head - tail) >= ring->size)
+      {
+	__atomic_store_n (&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED) ;
+	overflow = TRUE ;
+	continue ;
+      }
+
+      r        = &ring->records [head & (ring->size - 1)] ;
+      r->ns    = ns ;
+      r->pin   = (uint16_t)w->pin ;
+      r->level = (uint8_t)level ;
+      r->flags = overflow ? PI_EDGE_OVERFLOW : 0 ;
+      r->seq   = seq ;
+      overflow = FALSE ;
+
+      __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE) ;
+    }
+  }
+
+  return NULL ;
+}
+
+
+/*
+ * piEdgeCaptureSetup:
+ *	Create the capture buffer with room for at least size records (up to
+ *	16M) and start the capture thread. If shmName is not NULL then the buffer is
+ *	created as a POSIX shared memory object of that name (e.g. "/edges")
+ *	so that other processes can use piEdgeCaptureAttach to get at it.
+ *********************************************************************************
+ */
+
+int piEdgeCaptureSetup (const char *shmName, int size)
+{
+  uint32_t records = MIN_RECORDS ;
+
+  if (ring != NULL)
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureSetup: Capture already running\n") ;
+
+  if (size > MAX_RECORDS)
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureSetup: %d records is too many (max %d)\n", size, MAX_RECORDS) ;
+
+  while (records < (uint32_t)size)
+    records <<= 1 ;
+
+  ringBytes = sizeof (struct piEdgeRing) + records * sizeof (struct piEdgeRecord) ;
+
+  if ((ring = mapRing (shmName, &ringBytes, TRUE)) == NULL)
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureSetup: Unable to create buffer: %s\n", strerror (errno)) ;
+
+  ring->version    = PI_EDGE_VERSION ;
+  ring->size       = records ;
+  ring->recordSize = sizeof (struct piEdgeRecord) ;
+  ring->head       = 0 ;
+  ring->tail       = 0 ;
+  ring->dropped    = 0 ;
+  __atomic_store_n (&ring->magic, PI_EDGE_MAGIC, __ATOMIC_RELEASE) ;	// Last, so attachers see a complete header
+
+  if (shmName != NULL)
+  {
+    strncpy (ringName, shmName, sizeof (ringName) - 1) ;
+    ringName [sizeof (ringName) - 1] = 0 ;
+  }
+  else
+    ringName [0] = 0 ;
+
+  if ((epollFd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+  {
+    piEdgeCaptureStop () ;
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureSetup: epoll_create1 failed: %s\n", strerror (errno)) ;
+  }
+
+  if (pthread_create (&captureThread, NULL, edgeCaptureThread, NULL) != 0)
+  {
+    close (epollFd) ;
+    epollFd = -1 ;
+    piEdgeCaptureStop () ;
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureSetup: Unable to start capture thread\n") ;
+  }
+
+  return 0 ;
+}
+
+
+/*
+ * piEdgeCaptureAdd:
+ *	Start recording edges on the given pin. Mode is one of the INT_EDGE_
+ *	values, as for wiringPiISR. Pins can be added while the capture is
+ *	running. Note that a pin can be captured or have an ISR, not both.
+ *********************************************************************************
+ */
+
+int piEdgeCaptureAdd (int pin, int mode)
+{
+  struct epoll_event ev ;
+  int fd, err ;
+
+  if (epollFd == -1)
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureAdd: Capture not setup\n") ;
+
+  if (numWatches == MAX_PINS)
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureAdd: Too many pins\n") ;
+
+  if ((fd = wiringPiEdgeSetup (pin, mode)) < 0)
+    return fd ;
+
+  watches [numWatches].fd   = fd ;
+  watches [numWatches].pin  = pin ;
+  watches [numWatches].mode = mode ;
+
+  memset (&ev, 0, sizeof (ev)) ;
+  ev.events   = EPOLLPRI | EPOLLERR ;
+  ev.data.u32 = numWatches ;
+
+  if (epoll_ctl (epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    err = errno ;
+    wiringPiEdgeRelease (pin) ;
+    return wiringPiFailure (WPI_ALMOST, "piEdgeCaptureAdd: epoll_ctl failed: %s\n", strerror (err)) ;
+  }
+
+  ++numWatches ;
+
+  return 0 ;
+}
+
+
+/*
+ * piEdgeRingRead:
+ *	Drain up to max records from a ring into the supplied array.
+ *	Returns the number of records copied. Only one consumer per ring!
+ *********************************************************************************
+ */
+
+int piEdgeRingRead (struct piEdgeRing *r, struct piEdgeRecord *records, int max)
+{
+  uint64_t head, tail ;
+  uint32_t mask, first, n, count ;
+
+  if ((r == NULL) || (max <= 0))
+    return 0 ;
+
+  mask = r->size - 1 ;
+  tail = r->tail ;
+  head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE) ;
+
+  n = (uint32_t)(head - tail) ;
+  if (n > (uint32_t)max)
+    n = (uint32_t)max ;
+
+// At most two copies - up to the end of the buffer and then from the start
+
+  first = (uint32_t)(tail & mask) ;
+  count = r->size - first ;
+  if (count > n)
+    count = n ;
+
+  memcpy (records,         &r->records [first], count       * sizeof (struct piEdgeRecord)) ;
+  memcpy (records + count, &r->records [0],     (n - count) * sizeof (struct piEdgeRecord)) ;
+
+  __atomic_store_n (&r->tail, tail + n, __ATOMIC_RELEASE) ;
+
+  return (int)n ;
+}
+
+
+/*
+ * piEdgeCaptureRead:
+ *	Drain records from our own capture buffer.
+ *********************************************************************************
+ */
+
+int piEdgeCaptureRead (struct piEdgeRecord *records, int max)
+{
+  return piEdgeRingRead (ring, records, max) ;
+}
+
+
+/*
+ * piEdgeCaptureAttach:
+ *	Map a capture buffer created by another process.
+ *********************************************************************************
+ */
+
+struct piEdgeRing *piEdgeCaptureAttach (const char *shmName)
+{
+  struct piEdgeRing *r ;
+  size_t bytes ;
+
+  if ((r = mapRing (shmName, &bytes, FALSE)) == NULL)
+    return NULL ;
+
+// Check the header before we trust it: size has to be a power of 2 and
+//	that many records have to be inside what we mapped, or a truncated
+//	or foreign segment would have piEdgeRingRead read off the end.
+
+  if ((__atomic_load_n (&r->magic, __ATOMIC_ACQUIRE) != PI_EDGE_MAGIC) || (r->version != PI_EDGE_VERSION) ||
+      (r->recordSize != sizeof (struct piEdgeRecord)) ||
+      (r->size == 0) || ((r->size & (r->size - 1)) != 0) ||
+      ((bytes - sizeof (struct piEdgeRing)) / sizeof (struct piEdgeRecord) < r->size))
+  {
+    munmap (r, bytes) ;
+    return NULL ;
+  }
+
+  return r ;
+}
+
+
+/*
+ * piEdgeCaptureStop:
+ *	Stop capturing and release everything.
+ *********************************************************************************
+ */
+
+void piEdgeCaptureStop (void)
+{
+  if (epollFd != -1)
+  {
+    pthread_cancel (captureThread) ;
+    pthread_join   (captureThread, NULL) ;
+    close (epollFd) ;
+    epollFd = -1 ;
+  }
+
+  numWatches = 0 ;
+
+  if (ring != NULL)
+  {
+    munmap (ring, ringBytes) ;
+    ring = NULL ;
+  }
+
+  if (ringName [0] != 0)
+  {
+    shm_unlink (ringName) ;
+    ringName [0] = 0 ;
+  }
+}
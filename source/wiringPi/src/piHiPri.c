@@ -2,6 +2,9 @@
  * piHiPri:
  *	Simple way to get your program running at high priority
  *	with realtime schedulling.
+ *	piRealtimeSetup goes further for latency sensitive programs: it
+ *	locks and prefaults memory, pins threads to CPUs and gives every
+ *	thread the library starts a priority from one scheme.
  *
  *	Copyright (c) 2012 Gordon Henderson
  ***********************************************************************
@@ -24,11 +27,59 @@
  ***********************************************************************
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <sched.h>
 #include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "../include/wiringPi.h"
 
+#define	MAX_RT_THREADS	64
+#define	THREAD_PREFAULT	(16 * 1024)
+
+// The priorities the library's threads have always used (SCHED_RR)
+//	when there's no profile.
+
+static const int legacyPri [PI_RT_ROLES] = { 55, 55, 90, 90, 50, 50, 50 } ;
+
+// The default profile. Capturing an edge is the most urgent thing we do
+//	- a late timestamp can't be put right - then generating waveforms,
+//	with the slow audio-rate and servo loops under those.
+
+static const struct piRealtimeProfile defaultProfile =
+{
+  PI_RT_LOCK_MEMORY | PI_RT_PREFAULT | PI_RT_FIFO,
+  0,
+  0,
+  256 * 1024,
+  1024 * 1024,
+  { 80, 80, 70, 60, 50, 50, 50, 40 },
+} ;
+
+static pthread_mutex_t          rtLock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_once_t           rtOnce = PTHREAD_ONCE_INIT ;
+static pthread_key_t            rtKey ;
+static struct piRealtimeProfile rtProfile ;
+static int                      rtActive = FALSE ;
+
+// Internal threads as kernel thread IDs. Those are system-wide and get
+//	reused, so a thread takes itself off the list as it exits, and we
+//	check a tid is still one of ours before touching it.
+
+static struct
+{
+  pid_t tid ;
+  int   role ;
+} rtThreads [MAX_RT_THREADS] ;
+
 
 /*
  * piHiPri:
@@ -49,3 +100,221 @@ int piHiPri (const int pri)
 
   return sched_setscheduler (0, SCHED_RR, &sched) ;
 }
+
+
+/*
+ * rtThreadDone: rtInit:
+ *	A registered thread is exiting - free its slot.
+ *********************************************************************************
+ */
+
+static void rtThreadDone (void *slot)
+{
+  int i = (int)(intptr_t)slot - 1 ;
+
+  pthread_mutex_lock (&rtLock) ;
+    if (rtThreads [i].tid == (pid_t)syscall (SYS_gettid))
+      rtThreads [i].tid = 0 ;
+  pthread_mutex_unlock (&rtLock) ;
+}
+
+static void rtInit (void)
+{
+  pthread_key_create (&rtKey, rtThreadDone) ;
+}
+
+
+/*
+ * ourThread:
+ *	Is tid a thread in this process?
+ *********************************************************************************
+ */
+
+static int ourThread (pid_t tid)
+{
+  return syscall (SYS_tgkill, getpid (), tid, 0) == 0 ;
+}
+
+
+/*
+ * applyThread:
+ *	Put one thread (by kernel tid, 0 for the caller) under the profile
+ *********************************************************************************
+ */
+
+static int applyThread (pid_t tid, int role)
+{
+  struct sched_param sched ;
+  cpu_set_t cpus ;
+  int policy, cpu, ret = 0 ;
+
+  policy = (rtProfile.flags & PI_RT_FIFO) ? SCHED_FIFO : SCHED_RR ;
+
+  memset (&sched, 0, sizeof (sched)) ;
+  sched.sched_priority = rtProfile.priority [role] ;
+  if (sched.sched_priority > sched_get_priority_max (policy))
+    sched.sched_priority = sched_get_priority_max (policy) ;
+
+  if ((sched.sched_priority > 0) && (sched_setscheduler (tid, policy, &sched) < 0))
+    ret = -1 ;
+
+  if (rtProfile.threadCpus != 0)
+  {
+    CPU_ZERO (&cpus) ;
+    for (cpu = 0 ; cpu < 32 ; ++cpu)
+      if (rtProfile.threadCpus & (1u << cpu))
+	CPU_SET (cpu, &cpus) ;
+    if (sched_setaffinity (tid, sizeof (cpus), &cpus) < 0)
+      ret = -1 ;
+  }
+
+  return ret ;
+}
+
+
+/*
+ * prefaultStack:
+ *	Touch the next few pages of stack so we don't take a page fault the
+ *	first time we go that deep.
+ *********************************************************************************
+ */
+
+static void prefaultStack (size_t bytes)
+{
+  volatile uint8_t *stack = alloca (bytes) ;
+  size_t i ;
+
+  for (i = 0 ; i < bytes ; i += 4096)
+    stack [i] = 0 ;
+}
+
+
+/*
+ * piRealtimeThread:
+ *	Called by each thread the library starts, with its role. Without a
+ *	profile we do what we always did - piHiPri with the thread's old
+ *	priority, which only works as root.
+ *********************************************************************************
+ */
+
+int piRealtimeThread (int role)
+{
+  pid_t tid = (pid_t)syscall (SYS_gettid) ;
+  int i, ret ;
+
+  if ((role < 0) || (role >= PI_RT_ROLES))
+    return -1 ;
+
+  pthread_once (&rtOnce, rtInit) ;
+
+  pthread_mutex_lock (&rtLock) ;
+
+  for (i = 0 ; i < MAX_RT_THREADS ; ++i)
+    if ((rtThreads [i].tid == 0) || !ourThread (rtThreads [i].tid))
+    {
+      rtThreads [i].tid  = tid ;
+      rtThreads [i].role = role ;
+      pthread_setspecific (rtKey, (void *)(intptr_t)(i + 1)) ;
+      break ;
+    }
+
+  if (!rtActive)
+  {
+    pthread_mutex_unlock (&rtLock) ;
+    return piHiPri (legacyPri [role]) ;
+  }
+
+  ret = applyThread (0, role) ;
+  pthread_mutex_unlock (&rtLock) ;
+
+  if (rtProfile.flags & PI_RT_PREFAULT)
+    prefaultStack (THREAD_PREFAULT) ;
+
+  return ret ;
+}
+
+
+/*
+ * piRealtimeSetup:
+ *	Apply a real-time profile to the process: lock memory, prefault the
+ *	calling thread's stack and some heap, move the caller to mainCpus and
+ *	the library's threads - those running now and any started later - to
+ *	threadCpus, with the profile's priority for each role. NULL gives the
+ *	default profile.
+ *	Needs root (or CAP_SYS_NICE and CAP_IPC_LOCK). Every step is tried;
+ *	returns -1 with errno from the first that failed.
+ *********************************************************************************
+ */
+
+int piRealtimeSetup (const struct piRealtimeProfile *profile)
+{
+  struct sched_param sched ;
+  cpu_set_t cpus ;
+  uint8_t *heap ;
+  int i, cpu, policy, err = 0 ;
+
+  if (profile == NULL)
+    profile = &defaultProfile ;
+
+  pthread_mutex_lock (&rtLock) ;
+  rtProfile = *profile ;
+  rtActive  = TRUE ;
+
+// Memory: lock everything, now and later, and stop malloc from giving
+//	memory back to the kernel or using mmap, so what we prefault stays.
+
+  if (rtProfile.flags & PI_RT_LOCK_MEMORY)
+    if ((mlockall (MCL_CURRENT | MCL_FUTURE) < 0) && (err == 0))
+      err = errno ;
+
+  if (rtProfile.flags & PI_RT_PREFAULT)
+  {
+    mallopt (M_TRIM_THRESHOLD, -1) ;
+    mallopt (M_MMAP_MAX, 0) ;
+
+    if ((rtProfile.heapBytes != 0) && ((heap = malloc (rtProfile.heapBytes)) != NULL))
+    {
+      memset (heap, 0, rtProfile.heapBytes) ;
+      free (heap) ;
+    }
+    if (rtProfile.stackBytes != 0)
+      prefaultStack (rtProfile.stackBytes) ;
+  }
+
+// The calling thread
+
+  policy = (rtProfile.flags & PI_RT_FIFO) ? SCHED_FIFO : SCHED_RR ;
+  memset (&sched, 0, sizeof (sched)) ;
+  sched.sched_priority = rtProfile.priority [PI_RT_MAIN] ;
+  if (sched.sched_priority > sched_get_priority_max (policy))
+    sched.sched_priority = sched_get_priority_max (policy) ;
+  if ((sched.sched_priority > 0) && (sched_setscheduler (0, policy, &sched) < 0) && (err == 0))
+    err = errno ;
+
+  if (rtProfile.mainCpus != 0)
+  {
+    CPU_ZERO (&cpus) ;
+    for (cpu = 0 ; cpu < 32 ; ++cpu)
+      if (rtProfile.mainCpus & (1u << cpu))
+	CPU_SET (cpu, &cpus) ;
+    if ((sched_setaffinity (0, sizeof (cpus), &cpus) < 0) && (err == 0))
+      err = errno ;
+  }
+
+// Threads already running
+
+  for (i = 0 ; i < MAX_RT_THREADS ; ++i)
+    if ((rtThreads [i].tid != 0) && ourThread (rtThreads [i].tid))
+      if ((applyThread (rtThreads [i].tid, rtThreads [i].role) < 0) && (errno != ESRCH) && (err == 0))
+	err = errno ;
+
+  pthread_mutex_unlock (&rtLock) ;
+
+  if (err != 0)
+  {
+    errno = err ;
+    return -1 ;
+  }
+
+  return 0 ;
+}
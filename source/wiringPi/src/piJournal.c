@@ -0,0 +1,290 @@
+/*
+ * piJournal.c:
+ *	Binary journal of pin operations for later replay.
+ *
+ *	When enabled - either by calling piJournalOpen () or by setting
+ *	WIRINGPI_JOURNAL to a file name before wiringPiSetup* - every
+ *	pinMode, digitalWrite, pwmWrite, and the results of every digitalRead
+ *	and analogRead, are appended to a ring of fixed size records in a
+ *	memory mapped file. The file survives the program, and the wpiReplay
+ *	tool can play it back against the same or a different setup.
+ *
+ *	That includes the writes the soft PWM, tone, servo and shift bus code
+ *	make straight to the registers, pinConfigureMany and digitalWriteBank.
+ *	The one thing not logged is digitalWriteFast on a handle the program
+ *	holds itself - a handle doesn't know its pin number.
+ *
+ *	Logging a record is an atomic increment and a few stores - no system
+ *	calls - so it's usable on the hot paths it's there to measure.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piTimer.h"
+#include "../include/piJournal.h"
+
+int piJournalActive = FALSE ;
+
+// journal is swapped atomically. A thread may still be part way through
+//	logging to one that's just been closed, so a closed journal stays
+//	mapped for RETIRE_GRACE before it goes, and we keep at most RETIRED
+//	of them - if they're closed faster than that, close waits.
+
+#define	RETIRED		4
+#define	RETIRE_GRACE	1000000000		// nS
+
+static struct piJournal *journal ;
+static size_t            journalBytes ;
+
+static struct
+{
+  void    *map ;
+  size_t   bytes ;
+  uint64_t when ;
+} retired [RETIRED] ;
+static int numRetired ;
+
+
+/*
+ * realNow: retire:
+ *	Closed journals. Always on the real clock - the virtual one may not
+ *	be moving while we wait out the grace period.
+ *********************************************************************************
+ */
+
+static uint64_t realNow (void)
+{
+  struct timespec ts ;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * (uint64_t)1000000000 + (uint64_t)ts.tv_nsec ;
+}
+
+static void retire (void *map, size_t bytes)
+{
+  struct timespec ts ;
+  uint64_t now = realNow (), wait ;
+
+  while ((numRetired > 0) && ((numRetired == RETIRED) || (now - retired [0].when >= RETIRE_GRACE)))
+  {
+    if (now - retired [0].when < RETIRE_GRACE)		// Full, and the oldest is still too new
+    {
+      wait       = RETIRE_GRACE - (now - retired [0].when) ;
+      ts.tv_sec  = (time_t)(wait / 1000000000) ;
+      ts.tv_nsec = (long)  (wait % 1000000000) ;
+      while ((nanosleep (&ts, &ts) == -1) && (errno == EINTR))
+	;
+    }
+
+    munmap (retired [0].map, retired [0].bytes) ;
+    memmove (&retired [0], &retired [1], sizeof (retired [0]) * (size_t)--numRetired) ;
+    now = realNow () ;
+  }
+
+  retired [numRetired].map   = map ;
+  retired [numRetired].bytes = bytes ;
+  retired [numRetired].when  = now ;
+  ++numRetired ;
+}
+
+
+/*
+ * piJournalOpen:
+ *	Create (or replace) the journal file and start logging to it.
+ *	size is the number of records and is rounded up to a power of 2.
+ *
+ *	It's built under a temporary name and renamed over the old one, so
+ *	a journal we're still mapped onto is never truncated under us.
+ *********************************************************************************
+ */
+
+int piJournalOpen (const char *path, int size)
+{
+  struct piJournal *j ;
+  uint32_t records ;
+  size_t bytes ;
+  char temp [PATH_MAX] ;
+  void *map ;
+  int fd ;
+
+  if (journal != NULL)
+    piJournalClose () ;
+
+  if (size <= 0)
+    size = PI_JOURNAL_DEFAULT_SIZE ;
+
+  for (records = 1 ; records < (uint32_t)size ; records <<= 1)
+    ;
+
+  bytes = sizeof (struct piJournal) + (size_t)records * sizeof (struct piJournalRecord) ;
+
+  if (snprintf (temp, sizeof (temp), "%s.XXXXXX", path) >= (int)sizeof (temp))
+    return wiringPiFailure (WPI_ALMOST, "piJournalOpen: %s: %s\n", path, strerror (ENAMETOOLONG)) ;
+
+  if ((fd = mkostemp (temp, O_CLOEXEC)) < 0)
+    return wiringPiFailure (WPI_ALMOST, "piJournalOpen: Unable to create %s: %s\n", temp, strerror (errno)) ;
+
+  if ((fchmod (fd, 0644) < 0) || (ftruncate (fd, (off_t)bytes) < 0))
+  {
+    close  (fd) ;
+    unlink (temp) ;
+    return wiringPiFailure (WPI_ALMOST, "piJournalOpen: Unable to size %s: %s\n", temp, strerror (errno)) ;
+  }
+
+  map = mmap (NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (map == MAP_FAILED)
+  {
+    unlink (temp) ;
+    return wiringPiFailure (WPI_ALMOST, "piJournalOpen: Unable to map %s: %s\n", temp, strerror (errno)) ;
+  }
+
+  j = (struct piJournal *)map ;
+  j->version    = PI_JOURNAL_VERSION ;
+  j->size       = records ;
+  j->recordSize = sizeof (struct piJournalRecord) ;
+  j->start      = piTimerNow () ;
+  j->head       = 0 ;
+  __atomic_store_n (&j->magic, PI_JOURNAL_MAGIC, __ATOMIC_RELEASE) ;
+
+  if (rename (temp, path) < 0)
+  {
+    munmap (map, bytes) ;
+    unlink (temp) ;
+    return wiringPiFailure (WPI_ALMOST, "piJournalOpen: Unable to rename %s: %s\n", temp, strerror (errno)) ;
+  }
+
+  journalBytes    = bytes ;
+  __atomic_store_n (&journal, j, __ATOMIC_RELEASE) ;
+  piJournalActive = TRUE ;
+
+  return 0 ;
+}
+
+
+/*
+ * piJournalClose:
+ *	Stop logging. The file stays behind for wpiReplay; the mapping goes
+ *	after a grace period - see above.
+ *********************************************************************************
+ */
+
+void piJournalClose (void)
+{
+  struct piJournal *j = journal ;
+
+  if (j == NULL)
+    return ;
+
+  piJournalActive = FALSE ;
+  __atomic_store_n (&journal, NULL, __ATOMIC_RELEASE) ;
+
+  msync  (j, journalBytes, MS_ASYNC) ;
+  retire (j, journalBytes) ;
+}
+
+
+/*
+ * piJournalLog:
+ *	Add a record. Safe to call from any number of threads at once - each
+ *	gets its own slot. The op is stored last so a reader can tell a
+ *	half-written record.
+ *********************************************************************************
+ */
+
+void piJournalLog (int op, int pin, int value)
+{
+  struct piJournal *j = __atomic_load_n (&journal, __ATOMIC_ACQUIRE) ;
+  struct piJournalRecord *r ;
+  uint64_t slot ;
+
+  if (j == NULL)
+    return ;
+
+  slot = __atomic_fetch_add (&j->head, 1, __ATOMIC_RELAXED) ;
+  r    = &j->records [slot & (j->size - 1)] ;	// From the mapping, so it can't go with a different one
+
+  __atomic_store_n (&r->op, 0, __ATOMIC_RELAXED) ;
+  r->ns    = piTimerNow () ;
+  r->pin   = pin ;
+  r->value = value ;
+  r->seq   = (uint32_t)slot ;
+  __atomic_store_n (&r->op, (uint32_t)op, __ATOMIC_RELEASE) ;
+}
+
+
+/*
+ * piJournalMap: piJournalUnmap:
+ *	Map an existing journal file read-only, e.g. for replay.
+ *********************************************************************************
+ */
+
+struct piJournal *piJournalMap (const char *path)
+{
+  struct piJournal *j ;
+  struct stat st ;
+  void *map ;
+  int fd ;
+
+  if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+    return NULL ;
+
+  if ((fstat (fd, &st) < 0) || ((size_t)st.st_size < sizeof (struct piJournal)))
+  {
+    close (fd) ;
+    return NULL ;
+  }
+
+  map = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (map == MAP_FAILED)
+    return NULL ;
+
+  j = (struct piJournal *)map ;
+  if ((j->magic != PI_JOURNAL_MAGIC) || (j->version == 0) || (j->version > PI_JOURNAL_VERSION) ||
+      (j->recordSize != sizeof (struct piJournalRecord)) ||
+      (j->size == 0) || ((j->size & (j->size - 1)) != 0) ||
+      ((uint64_t)st.st_size < sizeof (struct piJournal) + (uint64_t)j->size * sizeof (struct piJournalRecord)))
+  {
+    munmap (map, (size_t)st.st_size) ;
+    errno = EINVAL ;
+    return NULL ;
+  }
+
+  return j ;
+}
+
+void piJournalUnmap (struct piJournal *j)
+{
+  if (j != NULL)
+    munmap (j, sizeof (struct piJournal) + (size_t)j->size * sizeof (struct piJournalRecord)) ;
+}
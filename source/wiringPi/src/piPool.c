@@ -0,0 +1,515 @@
+/*
+ * piPool.c:
+ *	A pool of worker threads for short jobs - sensor reads, bus
+ *	transactions and the like - so they can run side by side without
+ *	starting a thread for each one.
+ *
+ *	There's a worker per CPU, each pinned to its CPU. Each has a deque
+ *	of jobs: it takes the newest off its own end, which keeps the jobs
+ *	a job submits on the same CPU while they're still in the cache, and
+ *	when it runs dry it steals the oldest off the other end of someone
+ *	else's. Jobs for a particular CPU go on a queue of that worker's own
+ *	which is never stolen from.
+ *
+ *	The deques each have their own lock, so workers only meet when one
+ *	is stealing from another.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piPool.h"
+
+#define	CACHE_LINE	64
+#define	INDEX_BITS	10		// PI_POOL_MAX
+#define	INDEX_MASK	((1 << INDEX_BITS) - 1)
+#define	GEN_MASK	0xFFFFF
+
+#define	JOB_FREE	0
+#define	JOB_QUEUED	1
+#define	JOB_RUNNING	2
+#define	JOB_CANCELLED	3		// Still on a deque - freed when it comes off
+
+struct job
+{
+  int    state ;
+  int    gen ;
+  int    priority ;
+  int    next ;			// Free list
+  void (*fn)(void *arg) ;
+  void  *arg ;
+} ;
+
+// A deque of job numbers. It can't overflow, as there are only
+//	PI_POOL_MAX jobs.
+
+struct deque
+{
+  pthread_mutex_t lock ;
+  unsigned int    top, bottom ;
+  int             slot [PI_POOL_MAX] ;
+} ;
+
+struct worker
+{
+  struct deque shared ;		// Ours first, but anyone can steal
+  struct deque pinned ;		// Only ever run here
+  int          pinnedCount ;
+  int          cpu ;
+  pthread_t    thread ;
+} __attribute__ ((aligned (CACHE_LINE))) ;
+
+static struct job     jobs    [PI_POOL_MAX] ;
+static struct worker  workers [PI_POOL_MAX_WORKERS] ;
+static int            numWorkers ;
+static int            freeJobs = -1 ;
+static int            stealable ;		// Jobs on the shared deques
+static unsigned int   nextWorker ;
+static int            joiners ;
+static int            running ;
+
+static __thread struct worker *self ;		// In a worker
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t  work     = PTHREAD_COND_INITIALIZER ;
+static pthread_cond_t  finished = PTHREAD_COND_INITIALIZER ;
+static pthread_once_t  poolOnce = PTHREAD_ONCE_INIT ;
+
+
+/*
+ * poolInit:
+ *********************************************************************************
+ */
+
+static void poolInit (void)
+{
+  int i ;
+
+  for (i = PI_POOL_MAX - 1 ; i >= 0 ; --i)
+  {
+    jobs [i].next = freeJobs ;
+    freeJobs      = i ;
+  }
+
+  for (i = 0 ; i < PI_POOL_MAX_WORKERS ; ++i)
+  {
+    pthread_mutex_init (&workers [i].shared.lock, NULL) ;
+    pthread_mutex_init (&workers [i].pinned.lock, NULL) ;
+  }
+}
+
+
+/*
+ * push: popBottom: popTop:
+ *	Jobs go on at the bottom. The owner takes from the bottom, thieves
+ *	and the pinned queue from the top. -1 if it's empty.
+ *********************************************************************************
+ */
+
+static void push (struct deque *d, int job)
+{
+  pthread_mutex_lock (&d->lock) ;
+    d->slot [d->bottom++ & (PI_POOL_MAX - 1)] = job ;
+  pthread_mutex_unlock (&d->lock) ;
+}
+
+static int popBottom (struct deque *d)
+{
+  int job = -1 ;
+
+  pthread_mutex_lock (&d->lock) ;
+    if (d->bottom != d->top)
+      job = d->slot [--d->bottom & (PI_POOL_MAX - 1)] ;
+  pthread_mutex_unlock (&d->lock) ;
+
+  return job ;
+}
+
+static int popTop (struct deque *d)
+{
+  int job = -1 ;
+
+  pthread_mutex_lock (&d->lock) ;
+    if (d->bottom != d->top)
+      job = d->slot [d->top++ & (PI_POOL_MAX - 1)] ;
+  pthread_mutex_unlock (&d->lock) ;
+
+  return job ;
+}
+
+
+/*
+ * take:
+ *	The next job for a worker: one pinned to it, then its own newest,
+ *	then the oldest of whoever's next along.
+ *********************************************************************************
+ */
+
+static int take (struct worker *w)
+{
+  int job, i, n ;
+
+  if (__atomic_load_n (&w->pinnedCount, __ATOMIC_RELAXED) > 0)
+    if ((job = popTop (&w->pinned)) != -1)
+    {
+      __atomic_fetch_sub (&w->pinnedCount, 1, __ATOMIC_RELAXED) ;
+      return job ;
+    }
+
+  if (__atomic_load_n (&stealable, __ATOMIC_RELAXED) == 0)
+    return -1 ;
+
+  if ((job = popBottom (&w->shared)) == -1)
+    for (i = 1 ; i < numWorkers ; ++i)
+    {
+      n = (int)(w - workers) + i ;
+      if ((job = popTop (&workers [n % numWorkers].shared)) != -1)
+	break ;
+    }
+
+  if (job != -1)
+    __atomic_fetch_sub (&stealable, 1, __ATOMIC_RELAXED) ;
+
+  return job ;
+}
+
+
+/*
+ * release:
+ *	Back on the free list, and tell anyone joining it
+ *********************************************************************************
+ */
+
+static void release (int job)
+{
+  pthread_mutex_lock (&poolLock) ;
+    jobs [job].state = JOB_FREE ;
+    jobs [job].gen   = (jobs [job].gen + 1) & GEN_MASK ;
+    jobs [job].next  = freeJobs ;
+    freeJobs         = job ;
+    if (joiners > 0)
+      pthread_cond_broadcast (&finished) ;
+  pthread_mutex_unlock (&poolLock) ;
+}
+
+
+/*
+ * runJob:
+ *	Unless it's been cancelled. A job with a priority runs at that
+ *	priority (SCHED_FIFO) if we can, then we go back to what we were.
+ *********************************************************************************
+ */
+
+static void runJob (int job)
+{
+  struct job *j = &jobs [job] ;
+  struct sched_param param, saved ;
+  int queued = JOB_QUEUED, policy, raised = FALSE ;
+
+  if (!__atomic_compare_exchange_n (&j->state, &queued, JOB_RUNNING, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    release (job) ;
+    return ;
+  }
+
+  if ((j->priority > 0) && (pthread_getschedparam (pthread_self (), &policy, &saved) == 0))
+  {
+    memset (&param, 0, sizeof (param)) ;
+    param.sched_priority = j->priority ;
+    raised = (pthread_setschedparam (pthread_self (), SCHED_FIFO, &param) == 0) ;
+  }
+
+  j->fn (j->arg) ;
+
+  if (raised)
+    pthread_setschedparam (pthread_self (), policy, &saved) ;
+
+  release (job) ;
+}
+
+
+/*
+ * poolWorker:
+ *********************************************************************************
+ */
+
+static void *poolWorker (void *arg)
+{
+  struct worker *w = (struct worker *)arg ;
+  int job ;
+
+  self = w ;
+
+  for (;;)
+  {
+    if (!__atomic_load_n (&running, __ATOMIC_RELAXED))
+      break ;
+
+    if ((job = take (w)) != -1)
+    {
+      runJob (job) ;
+      continue ;
+    }
+
+    pthread_mutex_lock (&poolLock) ;
+      while (running && (__atomic_load_n (&stealable, __ATOMIC_RELAXED) == 0) && (__atomic_load_n (&w->pinnedCount, __ATOMIC_RELAXED) == 0))
+	pthread_cond_wait (&work, &poolLock) ;
+    pthread_mutex_unlock (&poolLock) ;
+  }
+
+  return NULL ;
+}
+
+
+/*
+ * piPoolSetup:
+ *	Start the workers - one per CPU if workers is 0. Only needed for
+ *	some other number.
+ *********************************************************************************
+ */
+
+static int startWorkers (int count)
+{
+  pthread_attr_t attr ;
+  cpu_set_t cpus ;
+  int numCpus, i ;
+
+  if ((numCpus = (int)sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    numCpus = 1 ;
+
+  if (count <= 0)
+    count = numCpus ;
+  if (count > PI_POOL_MAX_WORKERS)
+    count = PI_POOL_MAX_WORKERS ;
+
+  running = TRUE ;
+
+  for (numWorkers = 0 ; numWorkers < count ; ++numWorkers)
+  {
+    workers [numWorkers].cpu = numWorkers % numCpus ;
+
+    CPU_ZERO (&cpus) ;
+    CPU_SET  (workers [numWorkers].cpu, &cpus) ;
+    pthread_attr_init (&attr) ;
+    pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus) ;
+    i = pthread_create (&workers [numWorkers].thread, &attr, poolWorker, &workers [numWorkers]) ;
+    pthread_attr_destroy (&attr) ;
+
+    if (i != 0)
+    {
+      if (numWorkers > 0)		// Make do
+	break ;
+      running = FALSE ;
+      return wiringPiFailure (WPI_ALMOST, "piPool: Unable to start workers\n") ;
+    }
+  }
+
+  return 0 ;
+}
+
+int piPoolSetup (int workers)
+{
+  int ret = -1 ;
+
+  pthread_once (&poolOnce, poolInit) ;
+
+  pthread_mutex_lock (&poolLock) ;
+    if (!running)
+      ret = startWorkers (workers) ;
+  pthread_mutex_unlock (&poolLock) ;
+
+  return ret ;
+}
+
+
+/*
+ * piPoolSubmit:
+ *	Queue fn (arg) to run on a worker. cpu is PI_POOL_ANY_CPU, or the
+ *	CPU it must run on. priority is 0 to run at the workers' normal
+ *	priority, or a SCHED_FIFO priority to run it at (needs root).
+ *********************************************************************************
+ */
+
+int piPoolSubmit (void (*fn)(void *arg), void *arg, int cpu, int priority)
+{
+  struct worker *w ;
+  struct job *j ;
+  int job ;
+
+  if ((fn == NULL) || (priority < 0) || (priority > 99))
+    return -1 ;
+
+  pthread_once (&poolOnce, poolInit) ;
+
+  pthread_mutex_lock (&poolLock) ;
+
+  if (!running && (startWorkers (0) < 0))
+  {
+    pthread_mutex_unlock (&poolLock) ;
+    return -1 ;
+  }
+
+  if ((cpu != PI_POOL_ANY_CPU) && ((cpu < 0) || (cpu >= numWorkers) || (workers [cpu].cpu != cpu)))
+  {
+    pthread_mutex_unlock (&poolLock) ;
+    return -1 ;
+  }
+
+  if ((job = freeJobs) == -1)
+  {
+    pthread_mutex_unlock (&poolLock) ;
+    return wiringPiFailure (WPI_ALMOST, "piPool: No free jobs\n") ;
+  }
+  freeJobs = jobs [job].next ;
+
+  j = &jobs [job] ;
+  j->fn       = fn ;
+  j->arg      = arg ;
+  j->priority = priority ;
+  j->state    = JOB_QUEUED ;
+
+// On its deque before the count goes up, so whoever sees the count
+//	finds the job
+
+  if (cpu != PI_POOL_ANY_CPU)
+  {
+    w = &workers [cpu] ;
+    push (&w->pinned, job) ;
+    __atomic_fetch_add (&w->pinnedCount, 1, __ATOMIC_RELAXED) ;
+    pthread_cond_broadcast (&work) ;		// It has to be that one
+  }
+  else
+  {
+    w = (self != NULL) ? self : &workers [nextWorker++ % (unsigned int)numWorkers] ;
+    push (&w->shared, job) ;
+    __atomic_fetch_add (&stealable, 1, __ATOMIC_RELAXED) ;
+    pthread_cond_signal (&work) ;
+  }
+
+  pthread_mutex_unlock (&poolLock) ;
+
+  return (j->gen << INDEX_BITS) | job ;
+}
+
+
+/*
+ * piPoolJoin:
+ *	Wait for a job to finish. Returns 0 once it has (or was cancelled,
+ *	or had already), or -1 for a bad job number. Not from inside a job.
+ *********************************************************************************
+ */
+
+int piPoolJoin (int job)
+{
+  struct job *j ;
+  int i = job & INDEX_MASK ;
+
+  if (job < 0)
+    return -1 ;
+
+  j = &jobs [i] ;
+
+  pthread_mutex_lock (&poolLock) ;
+    ++joiners ;
+    while ((j->gen == (job >> INDEX_BITS)) && ((j->state == JOB_QUEUED) || (j->state == JOB_RUNNING)))
+      pthread_cond_wait (&finished, &poolLock) ;
+    --joiners ;
+  pthread_mutex_unlock (&poolLock) ;
+
+  return 0 ;
+}
+
+
+/*
+ * piPoolCancel:
+ *	Stop a job that hasn't started yet. Returns 0 if it won't now run,
+ *	or -1 if it's running or done.
+ *********************************************************************************
+ */
+
+int piPoolCancel (int job)
+{
+  struct job *j ;
+  int queued = JOB_QUEUED, res = -1 ;
+
+  if (job < 0)
+    return -1 ;
+
+  j = &jobs [job & INDEX_MASK] ;
+
+  pthread_mutex_lock (&poolLock) ;
+    if ((j->gen == (job >> INDEX_BITS)) &&
+	__atomic_compare_exchange_n (&j->state, &queued, JOB_CANCELLED, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      res = 0 ;
+      if (joiners > 0)
+	pthread_cond_broadcast (&finished) ;
+    }
+  pthread_mutex_unlock (&poolLock) ;
+
+  return res ;
+}
+
+
+/*
+ * piPoolStop:
+ *	Let the running jobs finish, drop the queued ones and stop the
+ *	workers. Not from inside a job.
+ *********************************************************************************
+ */
+
+void piPoolStop (void)
+{
+  struct worker *w ;
+  int i, job ;
+
+  pthread_once (&poolOnce, poolInit) ;
+
+  pthread_mutex_lock (&poolLock) ;
+  if (!running)
+  {
+    pthread_mutex_unlock (&poolLock) ;
+    return ;
+  }
+  running = FALSE ;
+  pthread_cond_broadcast (&work) ;
+  pthread_mutex_unlock (&poolLock) ;
+
+  for (i = 0 ; i < numWorkers ; ++i)
+    pthread_join (workers [i].thread, NULL) ;
+
+  for (i = 0 ; i < numWorkers ; ++i)
+  {
+    w = &workers [i] ;
+    while ((job = popTop (&w->shared)) != -1)
+      release (job) ;
+    while ((job = popTop (&w->pinned)) != -1)
+      release (job) ;
+    w->pinnedCount = 0 ;
+  }
+  stealable  = 0 ;
+  numWorkers = 0 ;
+}
@@ -0,0 +1,549 @@
+/*
+ * piSchedule.c:
+ *	Run pin writes and functions at given times, from one thread.
+ *
+ *	Jobs wait in a hierarchical timer wheel: 4 levels of 64 slots, the
+ *	bottom level a millisecond a slot, each level above 64 times coarser
+ *	than the one below, which covers about 4.6 hours. Adding or
+ *	cancelling a job is a list insert or unlink whatever the number
+ *	waiting. As time moves on, each coarse slot is tipped down a level
+ *	when it comes due, until its jobs reach the bottom.
+ *
+ *	A bitmap per level says which slots have anything in, so the thread
+ *	goes straight to the next slot that needs it rather than ticking
+ *	through empty milliseconds. Within a slot, jobs are run in time
+ *	order at their exact time with piSleepUntil.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piTimer.h"
+#include "../include/piSchedule.h"
+
+#define	TICK_NS		1000000		// Bottom level slot
+#define	LEVELS		4
+#define	SLOT_BITS	6
+#define	SLOTS		(1 << SLOT_BITS)
+#define	SPAN		((uint64_t)1 << (SLOT_BITS * LEVELS))	// Ticks the wheel covers
+
+#define	NEVER		UINT64_MAX
+
+// Job numbers are the index with a generation count above it, so an old
+//	number can't cancel whatever has since taken its place.
+
+#define	INDEX_BITS	12
+#define	INDEX_MASK	((1 << INDEX_BITS) - 1)
+#define	GEN_MASK	0x7FFFF
+
+#define	JOB_FREE	0
+#define	JOB_WAITING	1		// In the wheel
+#define	JOB_DUE		2		// Taken out to be run
+#define	JOB_RUNNING	3
+#define	JOB_CANCELLED	4		// Was due or running - drop it after
+
+#define	ACT_WRITE	0
+#define	ACT_CALL	1
+
+struct job
+{
+  int       state ;
+  int       gen ;
+  int       next, prev ;	// In the slot list, or next free
+  int       level, slot ;
+
+  uint64_t  when ;		// nS
+  uint64_t  tick ;		// when, in ticks - or now, if that's gone
+  uint64_t  period ;		// 0 for once only
+
+  int       action ;
+  int       pin, value ;
+  void    (*fn)(void *arg) ;
+  void     *arg ;
+} ;
+
+static struct job jobs  [PI_SCHEDULE_MAX] ;
+static int        heads [LEVELS][SLOTS] ;
+static uint64_t   masks [LEVELS] ;
+static int        freeJobs = -1 ;
+static int        numWaiting ;
+static uint64_t   cur ;				// The tick the wheel is at
+
+static int        runList [PI_SCHEDULE_MAX] ;	// Thread only
+
+static pthread_mutex_t scheduleLock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t  changed ;
+static pthread_once_t  scheduleOnce = PTHREAD_ONCE_INIT ;
+static pthread_t       executor ;
+static int             running ;
+static uint64_t        waitingFor = NEVER ;
+
+
+/*
+ * scheduleInit:
+ *	Empty wheel, all the jobs on the free list
+ *********************************************************************************
+ */
+
+static void scheduleInit (void)
+{
+  pthread_condattr_t attr ;
+  int i, j ;
+
+  for (i = 0 ; i < LEVELS ; ++i)
+    for (j = 0 ; j < SLOTS ; ++j)
+      heads [i][j] = -1 ;
+
+  for (i = PI_SCHEDULE_MAX - 1 ; i >= 0 ; --i)
+  {
+    jobs [i].next = freeJobs ;
+    freeJobs      = i ;
+  }
+
+  pthread_condattr_init     (&attr) ;
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC) ;
+  pthread_cond_init         (&changed, &attr) ;
+  pthread_condattr_destroy  (&attr) ;
+}
+
+
+/*
+ * place: takeOut:
+ *	Put a job in the slot its tick falls in, relative to where the wheel
+ *	is now - or take it out again.
+ *********************************************************************************
+ */
+
+static void place (int i)
+{
+  struct job *j = &jobs [i] ;
+  uint64_t tick, delta ;
+  int level ;
+
+  if (j->tick < cur)		// Late - do it now
+    j->tick = cur ;
+
+  tick  = j->tick ;
+  delta = tick - cur ;
+  if (delta >= SPAN)		// Beyond the top - park it at the far end and look again then
+    tick = cur + SPAN - 1 ;
+
+  for (level = 0 ; (level < LEVELS - 1) && (delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1)))) ; ++level)
+    ;
+
+  j->level = level ;
+  j->slot  = (int)((tick >> (SLOT_BITS * level)) & (SLOTS - 1)) ;
+  j->prev  = -1 ;
+  j->next  = heads [level][j->slot] ;
+  if (j->next != -1)
+    jobs [j->next].prev = i ;
+  heads [level][j->slot] = i ;
+  masks [level]         |= (uint64_t)1 << j->slot ;
+  j->state = JOB_WAITING ;
+}
+
+static void takeOut (int i)
+{
+  struct job *j = &jobs [i] ;
+
+  if (j->prev != -1)
+    jobs [j->prev].next = j->next ;
+  else
+  {
+    heads [j->level][j->slot] = j->next ;
+    if (j->next == -1)
+      masks [j->level] &= ~((uint64_t)1 << j->slot) ;
+  }
+  if (j->next != -1)
+    jobs [j->next].prev = j->prev ;
+}
+
+
+/*
+ * release:
+ *	Back on the free list
+ *********************************************************************************
+ */
+
+static void release (int i)
+{
+  jobs [i].state = JOB_FREE ;
+  jobs [i].gen   = (jobs [i].gen + 1) & GEN_MASK ;
+  jobs [i].next  = freeJobs ;
+  freeJobs       = i ;
+  --numWaiting ;
+}
+
+
+/*
+ * nextTick:
+ *	The next tick the thread has something to do at: a bottom level slot
+ *	with jobs in, or a slot further up to tip down a level.
+ *********************************************************************************
+ */
+
+static uint64_t rotate (uint64_t mask, unsigned int n)
+{
+  n &= SLOTS - 1 ;
+  return (n == 0) ? mask : (mask >> n) | (mask << (SLOTS - n)) ;
+}
+
+static uint64_t nextTick (void)
+{
+  uint64_t next = NEVER, t, base ;
+  int level ;
+
+  if (masks [0] != 0)
+    next = cur + (uint64_t)__builtin_ctzll (rotate (masks [0], (unsigned int)cur)) ;
+
+// The slot we're in on the upper levels has already been tipped down, so
+//	start looking from the one after.
+
+  for (level = 1 ; level < LEVELS ; ++level)
+    if (masks [level] != 0)
+    {
+      base = (cur >> (SLOT_BITS * level)) + 1 ;
+      t    = (base + (uint64_t)__builtin_ctzll (rotate (masks [level], (unsigned int)base))) << (SLOT_BITS * level) ;
+      if (t < next)
+	next = t ;
+    }
+
+  return next ;
+}
+
+
+/*
+ * advance:
+ *	Move the wheel on to the given tick, tipping down any slots that
+ *	start there - the top ones first, so their jobs can fall all the way.
+ *********************************************************************************
+ */
+
+static void advance (uint64_t tick)
+{
+  int level, slot, i, next ;
+
+  cur = tick ;
+
+  for (level = LEVELS - 1 ; level > 0 ; --level)
+  {
+    if ((tick & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) != 0)
+      continue ;
+
+    slot = (int)((tick >> (SLOT_BITS * level)) & (SLOTS - 1)) ;
+    i    = heads [level][slot] ;
+    heads [level][slot] = -1 ;
+    masks [level] &= ~((uint64_t)1 << slot) ;
+
+    for (; i != -1 ; i = next)
+    {
+      next = jobs [i].next ;
+      place (i) ;
+    }
+  }
+}
+
+
+/*
+ * runJob:
+ *	Wait for a job's time and do it, then put it back if it repeats.
+ *********************************************************************************
+ */
+
+static void runJob (int i)
+{
+  struct job *j = &jobs [i] ;
+  uint64_t now ;
+
+  piSleepUntil (j->when) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+  if (j->state == JOB_CANCELLED)
+  {
+    release (i) ;
+    pthread_mutex_unlock (&scheduleLock) ;
+    return ;
+  }
+  j->state = JOB_RUNNING ;
+  pthread_mutex_unlock (&scheduleLock) ;
+
+  if (j->action == ACT_WRITE)
+    digitalWrite (j->pin, j->value) ;
+  else
+    j->fn (j->arg) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+  if ((j->state == JOB_RUNNING) && (j->period != 0))
+  {
+
+// Next period. If we've missed some, skip them rather than run a burst.
+
+    j->when += j->period ;
+    now = piTimerNow () ;
+    if (j->when < now)
+      j->when += ((now - j->when) / j->period + 1) * j->period ;
+    j->tick = j->when / TICK_NS ;
+    place (i) ;
+  }
+  else
+    release (i) ;
+  pthread_mutex_unlock (&scheduleLock) ;
+}
+
+
+/*
+ * scheduleThread:
+ *	The one thread that runs all the jobs
+ *********************************************************************************
+ */
+
+static void *scheduleThread (UNU void *arg)
+{
+  uint64_t tick, deadline ;
+  int numRun, i, j, k ;
+
+  piRealtimeThread (PI_RT_SCHEDULE) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+
+  for (;;)
+  {
+    if (!running)
+      break ;
+
+    if (numWaiting == 0)		// Nothing at all - the wheel can start again from now
+    {
+      cur        = piTimerNow () / TICK_NS ;
+      waitingFor = NEVER ;
+      piClockCondWait (&changed, &scheduleLock, PI_CLOCK_NEVER) ;
+      continue ;
+    }
+
+    if ((tick = nextTick ()) == NEVER)	// Everything's due or running
+    {
+      waitingFor = NEVER ;
+      piClockCondWait (&changed, &scheduleLock, PI_CLOCK_NEVER) ;
+      continue ;
+    }
+
+    deadline = tick * TICK_NS ;
+    if (deadline > piTimerNow ())
+    {
+      waitingFor = tick ;
+      piClockCondWait (&changed, &scheduleLock, deadline) ;
+      waitingFor = NEVER ;
+      continue ;
+    }
+
+    if (tick > cur)
+      advance (tick) ;
+
+// Take out everything in this tick's slot and run it in time order
+
+    numRun = 0 ;
+    for (i = heads [0][cur & (SLOTS - 1)] ; i != -1 ; i = jobs [i].next)
+    {
+      jobs [i].state = JOB_DUE ;
+      for (j = numRun++ ; (j > 0) && (jobs [runList [j - 1]].when > jobs [i].when) ; --j)
+	runList [j] = runList [j - 1] ;
+      runList [j] = i ;
+    }
+    heads [0][cur & (SLOTS - 1)] = -1 ;
+    masks [0] &= ~((uint64_t)1 << (cur & (SLOTS - 1))) ;
+
+    pthread_mutex_unlock (&scheduleLock) ;
+      for (k = 0 ; k < numRun ; ++k)
+	runJob (runList [k]) ;
+    pthread_mutex_lock (&scheduleLock) ;
+  }
+
+  pthread_mutex_unlock (&scheduleLock) ;
+
+  return NULL ;
+}
+
+
+/*
+ * add:
+ *	Put a new job in the wheel, starting the thread if it's the first.
+ *********************************************************************************
+ */
+
+static int add (uint64_t when, uint64_t period, int action, int pin, int value, void (*fn)(void *), void *arg)
+{
+  struct job *j ;
+  int i ;
+
+  pthread_once (&scheduleOnce, scheduleInit) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+
+  if (!running)
+  {
+    cur     = piTimerNow () / TICK_NS ;
+    running = TRUE ;
+    if (piClockThreadCreate (&executor, scheduleThread, NULL) != 0)
+    {
+      running = FALSE ;
+      pthread_mutex_unlock (&scheduleLock) ;
+      return wiringPiFailure (WPI_ALMOST, "piSchedule: Unable to start thread\n") ;
+    }
+  }
+
+  if ((i = freeJobs) == -1)
+  {
+    pthread_mutex_unlock (&scheduleLock) ;
+    return wiringPiFailure (WPI_ALMOST, "piSchedule: No free jobs\n") ;
+  }
+  freeJobs = jobs [i].next ;
+  ++numWaiting ;
+
+  j = &jobs [i] ;
+  j->when   = when ;
+  j->tick   = when / TICK_NS ;
+  j->period = period ;
+  j->action = action ;
+  j->pin    = pin ;
+  j->value  = value ;
+  j->fn     = fn ;
+  j->arg    = arg ;
+  place (i) ;
+
+  if (j->tick < waitingFor)		// Sooner than the thread is waiting for
+    piClockCondSignal (&changed) ;
+
+  pthread_mutex_unlock (&scheduleLock) ;
+
+  return (j->gen << INDEX_BITS) | i ;
+}
+
+
+/*
+ * piScheduleWrite: piScheduleCall: piScheduleEvery:
+ *	digitalWrite a pin, or call a function, at the given time. A time
+ *	that has already gone is as soon as possible. piScheduleEvery calls
+ *	the function at first, then every period nS after.
+ *	Jobs are run one after the other, so they should be quick.
+ *********************************************************************************
+ */
+
+int piScheduleWrite (uint64_t when, int pin, int value)
+{
+  return add (when, 0, ACT_WRITE, pin, value, NULL, NULL) ;
+}
+
+int piScheduleCall (uint64_t when, void (*fn)(void *arg), void *arg)
+{
+  if (fn == NULL)
+    return -1 ;
+
+  return add (when, 0, ACT_CALL, 0, 0, fn, arg) ;
+}
+
+int piScheduleEvery (uint64_t first, uint64_t period, void (*fn)(void *arg), void *arg)
+{
+  if ((fn == NULL) || (period == 0))
+    return -1 ;
+
+  return add (first, period, ACT_CALL, 0, 0, fn, arg) ;
+}
+
+
+/*
+ * piScheduleCancel:
+ *	Cancel a job. Returns 0 if it won't now run (again), or -1 if it's
+ *	already run or is running - or there's no such job.
+ *********************************************************************************
+ */
+
+int piScheduleCancel (int job)
+{
+  struct job *j ;
+  int i = job & INDEX_MASK, res = -1 ;
+
+  if ((job < 0) || (i >= PI_SCHEDULE_MAX))
+    return -1 ;
+
+  pthread_once (&scheduleOnce, scheduleInit) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+
+  j = &jobs [i] ;
+  if ((j->state != JOB_FREE) && (j->gen == (job >> INDEX_BITS)))
+  {
+    /**/ if (j->state == JOB_WAITING)
+    {
+      takeOut (i) ;
+      release (i) ;
+      res = 0 ;
+    }
+    else if ((j->state == JOB_DUE) || ((j->state == JOB_RUNNING) && (j->period != 0)))
+    {
+      j->state = JOB_CANCELLED ;	// The thread has it - it'll drop it
+      res = 0 ;
+    }
+  }
+
+  pthread_mutex_unlock (&scheduleLock) ;
+
+  return res ;
+}
+
+
+/*
+ * piScheduleStop:
+ *	Cancel everything and stop the thread. Not from inside a job.
+ *********************************************************************************
+ */
+
+void piScheduleStop (void)
+{
+  int i ;
+
+  pthread_once (&scheduleOnce, scheduleInit) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+
+  if (!running)
+  {
+    pthread_mutex_unlock (&scheduleLock) ;
+    return ;
+  }
+
+  running = FALSE ;
+  piClockCondSignal (&changed) ;
+  pthread_mutex_unlock (&scheduleLock) ;
+
+  piClockJoin (executor, NULL) ;
+
+  pthread_mutex_lock (&scheduleLock) ;
+  for (i = 0 ; i < PI_SCHEDULE_MAX ; ++i)
+    if (jobs [i].state == JOB_WAITING)
+    {
+      takeOut (i) ;
+      release (i) ;
+    }
+  pthread_mutex_unlock (&scheduleLock) ;
+}
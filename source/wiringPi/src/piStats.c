@@ -0,0 +1,214 @@
+/*
+ * piStats.c:
+ *	Hot path counters, exported through shared memory for wpistat.
+ *
+ *	The counters live in /dev/shm/wiringPi.<pid>, created the first time
+ *	any thread counts something. Each thread claims a slot of its own,
+ *	so counting is a plain increment in memory only it writes to, and
+ *	hands it back when it exits, its counts going into a retired total. The
+ *	wpistat tool maps the segment read-only and prints the totals while
+ *	the program carries on. The segment is removed when the program
+ *	exits normally.
+ *
+ *	None of this is called unless the library is built with WPI_STATS.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piStats.h"
+
+__thread struct piStatsSlot *piStatsMySlot ;
+
+static struct piStats     *stats ;
+static struct piStatsSlot  fallbackSlot ;	// If we can't make the segment
+static pthread_once_t      statsOnce = PTHREAD_ONCE_INIT ;
+static pthread_key_t       statsKey ;
+static char                statsName [32] ;
+
+
+/*
+ * slotFree:
+ *	A thread with a slot has exited. Add its counts to the retired total
+ *	- other threads may be exiting too, so atomically - then give the
+ *	slot back. wpistat may count them twice for that moment.
+ *********************************************************************************
+ */
+
+static void add (uint64_t *to, uint64_t n)
+{
+  if (n != 0)
+    __atomic_fetch_add (to, n, __ATOMIC_RELAXED) ;
+}
+
+static void slotFree (void *arg)
+{
+  struct piStatsSlot *slot    = (struct piStatsSlot *)arg ;
+  struct piStatsSlot *retired = &stats->retired ;
+  int i, j ;
+
+  for (i = 0 ; i < PI_STAT_COUNTERS ; ++i)
+    add (&retired->counters [i], slot->counters [i]) ;
+
+  for (i = 0 ; i < PI_STATS_FDS ; ++i)
+  {
+    add (&retired->i2c [i].transactions, slot->i2c [i].transactions) ;
+    add (&retired->i2c [i].bytes,        slot->i2c [i].bytes) ;
+    add (&retired->spi [i].transactions, slot->spi [i].transactions) ;
+    add (&retired->spi [i].bytes,        slot->spi [i].bytes) ;
+  }
+
+  for (i = 0 ; i < PI_STAT_HISTOGRAMS ; ++i)
+    for (j = 0 ; j < PI_STATS_BUCKETS ; ++j)
+      add (&retired->histograms [i][j], slot->histograms [i][j]) ;
+
+  memset (slot->name, 0, sizeof (*slot) - offsetof (struct piStatsSlot, name)) ;
+  __atomic_store_n (&slot->tid, 0, __ATOMIC_RELEASE) ;
+
+  piStatsMySlot = NULL ;
+}
+
+
+/*
+ * statsRemove: statsCreate:
+ *	Make the shared memory segment, once per process.
+ *********************************************************************************
+ */
+
+static void statsRemove (void)
+{
+  shm_unlink (statsName) ;
+}
+
+static void statsCreate (void)
+{
+  struct piStats *s ;
+  void *map ;
+  int fd ;
+
+  pthread_key_create (&statsKey, slotFree) ;
+
+  snprintf (statsName, sizeof (statsName), PI_STATS_NAME, (int)getpid ()) ;
+
+  if ((fd = shm_open (statsName, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return ;
+
+  if (ftruncate (fd, sizeof (struct piStats)) < 0)
+  {
+    close (fd) ;
+    shm_unlink (statsName) ;
+    return ;
+  }
+
+  map = mmap (NULL, sizeof (struct piStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (map == MAP_FAILED)
+  {
+    shm_unlink (statsName) ;
+    return ;
+  }
+
+  s = (struct piStats *)map ;
+  s->version  = PI_STATS_VERSION ;
+  s->slots    = PI_STATS_SLOTS ;
+  s->slotSize = sizeof (struct piStatsSlot) ;
+  s->pid      = (int32_t)getpid () ;
+  s->retired.tid = -1 ;
+  strcpy (s->retired.name, "(exited)") ;
+  __atomic_store_n (&s->magic, PI_STATS_MAGIC, __ATOMIC_RELEASE) ;
+
+  stats = s ;
+  atexit (statsRemove) ;
+}
+
+
+/*
+ * piStatsClaim:
+ *	Find the calling thread a slot. If they've all gone, the last one is
+ *	shared - counts from there may lose the odd increment.
+ *********************************************************************************
+ */
+
+struct piStatsSlot *piStatsClaim (void)
+{
+  struct piStatsSlot *slot ;
+  int32_t tid, none ;
+  int i ;
+
+  pthread_once (&statsOnce, statsCreate) ;
+
+  if (stats == NULL)
+    return piStatsMySlot = &fallbackSlot ;
+
+  tid  = (int32_t)syscall (SYS_gettid) ;
+  slot = &stats->slot [PI_STATS_SLOTS - 1] ;
+
+  for (i = 0 ; i < PI_STATS_SLOTS - 1 ; ++i)
+  {
+    none = 0 ;
+    if (__atomic_compare_exchange_n (&stats->slot [i].tid, &none, tid, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+      slot = &stats->slot [i] ;
+      pthread_getname_np (pthread_self (), slot->name, sizeof (slot->name)) ;
+      pthread_setspecific (statsKey, slot) ;
+      break ;
+    }
+  }
+
+  if (slot == &stats->slot [PI_STATS_SLOTS - 1])
+  {
+    slot->tid = -1 ;
+    strcpy (slot->name, "(shared)") ;
+  }
+
+  return piStatsMySlot = slot ;
+}
+
+
+/*
+ * piStatsHist:
+ *	Add a time to one of the log2 histograms
+ *********************************************************************************
+ */
+
+void piStatsHist (int hist, uint64_t ns)
+{
+  struct piStatsSlot *slot = piStatsMySlot ;
+  int bucket ;
+
+  if (slot == NULL)
+    slot = piStatsClaim () ;
+
+  bucket = (ns == 0) ? 0 : 63 - __builtin_clzll (ns) ;
+  if (bucket >= PI_STATS_BUCKETS)
+    bucket = PI_STATS_BUCKETS - 1 ;
+
+  slot->histograms [hist][bucket]++ ;
+}
@@ -23,9 +23,47 @@
  ***********************************************************************
  */
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+
 #include "../include/wiringPi.h"
 
+#define	CACHE_LINE	64
+#define	MAX_RING_SLOTS	(1u << 30)
+
+// A ring. The producer and consumer ends are on cache lines of their own,
+//	so the two sides aren't fighting over one line every time they move.
+//	Each side also keeps a copy of where the other was last time it
+//	looked, and only goes to the shared one when that says it can't do
+//	what it wants.
+//
+//	An MPSC ring has a sequence number per slot: producers claim slots
+//	by moving head on with a compare and swap, then fill them in and set
+//	their sequence numbers. They can finish in any order, and the
+//	consumer stops at the first slot that isn't filled in yet.
+
+struct piRing
+{
+  unsigned int head __attribute__ ((aligned (CACHE_LINE))) ;
+  unsigned int tailSeen ;			// SPSC producer's copy of tail
+
+  unsigned int tail __attribute__ ((aligned (CACHE_LINE))) ;
+  unsigned int headSeen ;			// SPSC consumer's copy of head
+
+  int           flags __attribute__ ((aligned (CACHE_LINE))) ;
+  unsigned int  slots, mask ;
+  unsigned int  itemSize ;
+  int           fd ;				// eventfd, or -1
+  unsigned int *seq ;				// MPSC only
+  uint8_t      *items ;
+} ;
+
 static pthread_mutex_t piMutexes [4] ;
 
 
@@ -61,3 +99,289 @@ void piUnlock (int key)
   pthread_mutex_unlock (&piMutexes [key]) ;
 }
 
+
+
+/*
+ * piRingCreate:
+ *	Create a ring of at least slots items of itemSize bytes each.
+ *	PI_RING_SPSC is for one producer thread and one consumer thread,
+ *	PI_RING_MPSC for any number of producers and one consumer. Add
+ *	PI_RING_WAKE to be able to wait for items with piRingWait, or poll
+ *	on piRingFd. Returns NULL on error.
+ *********************************************************************************
+ */
+
+struct piRing *piRingCreate (int flags, unsigned int slots, unsigned int itemSize)
+{
+  struct piRing *ring ;
+  void *mem ;
+  unsigned int size = 2 ;
+
+  if ((itemSize == 0) || (slots > MAX_RING_SLOTS))
+    return NULL ;
+
+  while (size < slots)
+    size <<= 1 ;
+
+  if (posix_memalign (&mem, CACHE_LINE, sizeof (struct piRing)) != 0)
+    return NULL ;
+  ring = (struct piRing *)mem ;
+  memset (ring, 0, sizeof (struct piRing)) ;
+
+  ring->flags    = flags ;
+  ring->slots    = size ;
+  ring->mask     = size - 1 ;
+  ring->itemSize = itemSize ;
+  ring->fd       = -1 ;
+
+  if (posix_memalign (&mem, CACHE_LINE, (size_t)size * itemSize) != 0)
+    goto fail ;
+  ring->items = (uint8_t *)mem ;
+
+  if ((flags & PI_RING_MPSC) != 0)
+    if ((ring->seq = calloc (size, sizeof (unsigned int))) == NULL)
+      goto fail ;
+
+  if ((flags & PI_RING_WAKE) != 0)
+    if ((ring->fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+      goto fail ;
+
+  return ring ;
+
+fail:
+  piRingFree (ring) ;
+  return NULL ;
+}
+
+
+/*
+ * piRingFree:
+ *	Nothing may be using it.
+ *********************************************************************************
+ */
+
+void piRingFree (struct piRing *ring)
+{
+  if (ring == NULL)
+    return ;
+
+  if (ring->fd >= 0)
+    close (ring->fd) ;
+  free (ring->seq) ;
+  free (ring->items) ;
+  free (ring) ;
+}
+
+
+/*
+ * copyIn: copyOut:
+ *	count items to or from the ring starting at pos, which may wrap
+ *********************************************************************************
+ */
+
+static void copyIn (struct piRing *ring, unsigned int pos, const void *items, unsigned int count)
+{
+  unsigned int slot  = pos & ring->mask ;
+  unsigned int first = ring->slots - slot ;
+
+  if (first > count)
+    first = count ;
+
+  memcpy (ring->items + (size_t)slot * ring->itemSize, items, (size_t)first * ring->itemSize) ;
+  if (first < count)
+    memcpy (ring->items, (const uint8_t *)items + (size_t)first * ring->itemSize, (size_t)(count - first) * ring->itemSize) ;
+}
+
+static void copyOut (struct piRing *ring, unsigned int pos, void *items, unsigned int count)
+{
+  unsigned int slot  = pos & ring->mask ;
+  unsigned int first = ring->slots - slot ;
+
+  if (first > count)
+    first = count ;
+
+  memcpy (items, ring->items + (size_t)slot * ring->itemSize, (size_t)first * ring->itemSize) ;
+  if (first < count)
+    memcpy ((uint8_t *)items + (size_t)first * ring->itemSize, ring->items, (size_t)(count - first) * ring->itemSize) ;
+}
+
+
+/*
+ * wake:
+ *	Called by a producer that's just filled in count items from pos.
+ *	The consumer can only be waiting on us if it's got as far as them -
+ *	an MPSC consumer may have taken some before we'd done the rest - so
+ *	that's the only time we need the system call. The fence pairs with
+ *	the one in piRingPop: either we see where it's got to, or it sees
+ *	our items.
+ *********************************************************************************
+ */
+
+static void wake (struct piRing *ring, unsigned int pos, unsigned int count)
+{
+  uint64_t one = 1 ;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST) ;
+  if ((__atomic_load_n (&ring->tail, __ATOMIC_RELAXED) - pos) < count)
+    if (write (ring->fd, &one, sizeof (one)) < 0)
+      return ;				// Only fails if the count is full, which wakes it anyway
+}
+
+
+/*
+ * piRingPush:
+ *	Add up to count items. Returns how many there was room for.
+ *********************************************************************************
+ */
+
+int piRingPush (struct piRing *ring, const void *items, int count)
+{
+  unsigned int head, tail, room, n, i ;
+
+  if (count <= 0)
+    return 0 ;
+
+  if ((ring->flags & PI_RING_MPSC) == 0)
+  {
+    head = ring->head ;
+    room = ring->slots - (head - ring->tailSeen) ;
+    if (room < (unsigned int)count)
+    {
+      ring->tailSeen = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) ;
+      room = ring->slots - (head - ring->tailSeen) ;
+    }
+    if ((n = ((unsigned int)count < room) ? (unsigned int)count : room) == 0)
+      return 0 ;
+
+    copyIn (ring, head, items, n) ;
+    __atomic_store_n (&ring->head, head + n, __ATOMIC_RELEASE) ;
+  }
+  else
+  {
+
+// Claim the slots. tail is read first so head can't be behind it, but if
+//	we were held up in between, tail may have moved on so far that head
+//	looks more than full - so look again.
+
+    for (;;)
+    {
+      tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) ;
+      head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED) ;
+      if ((head - tail) > ring->slots)
+	continue ;
+      room = ring->slots - (head - tail) ;
+      if ((n = ((unsigned int)count < room) ? (unsigned int)count : room) == 0)
+	return 0 ;
+      if (__atomic_compare_exchange_n (&ring->head, &head, head + n, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break ;
+    }
+
+    copyIn (ring, head, items, n) ;
+    for (i = 0 ; i < n ; ++i)
+      __atomic_store_n (&ring->seq [(head + i) & ring->mask], head + i + 1, __ATOMIC_RELEASE) ;
+  }
+
+  if (ring->fd >= 0)
+    wake (ring, head, n) ;
+
+  return (int)n ;
+}
+
+
+/*
+ * piRingPop:
+ *	Take up to max items. Returns how many there were.
+ *********************************************************************************
+ */
+
+int piRingPop (struct piRing *ring, void *items, int max)
+{
+  unsigned int tail = ring->tail, n ;
+
+  if (max <= 0)
+    return 0 ;
+
+  if ((ring->flags & PI_RING_MPSC) == 0)
+  {
+    n = ring->headSeen - tail ;
+    if (n < (unsigned int)max)
+    {
+      ring->headSeen = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) ;
+      n = ring->headSeen - tail ;
+    }
+    if (n > (unsigned int)max)
+      n = (unsigned int)max ;
+  }
+  else
+    for (n = 0 ; n < (unsigned int)max ; ++n)
+      if (__atomic_load_n (&ring->seq [(tail + n) & ring->mask], __ATOMIC_ACQUIRE) != tail + n + 1)
+	break ;
+
+  if (n == 0)
+    return 0 ;
+
+  copyOut (ring, tail, items, n) ;
+  __atomic_store_n (&ring->tail, tail + n, __ATOMIC_RELEASE) ;
+
+  if (ring->fd >= 0)
+    __atomic_thread_fence (__ATOMIC_SEQ_CST) ;	// See wake
+
+  return (int)n ;
+}
+
+
+/*
+ * piRingWait:
+ *	Wait up to mS milliseconds (-1 for ever) for there to be something
+ *	to pop. Returns 1 if there is, 0 on timeout, or -1 if the ring wasn't
+ *	created with PI_RING_WAKE. Consumer only.
+ *********************************************************************************
+ */
+
+static int isEmpty (struct piRing *ring)
+{
+  if ((ring->flags & PI_RING_MPSC) == 0)
+    return __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) == ring->tail ;
+  else
+    return __atomic_load_n (&ring->seq [ring->tail & ring->mask], __ATOMIC_ACQUIRE) != ring->tail + 1 ;
+}
+
+int piRingWait (struct piRing *ring, int mS)
+{
+  struct pollfd pfd ;
+  uint64_t count ;
+  int res ;
+
+  if (ring->fd < 0)
+    return -1 ;
+
+  pfd.fd     = ring->fd ;
+  pfd.events = POLLIN ;
+
+  for (;;)
+  {
+    if (!isEmpty (ring))
+      return 1 ;
+
+    if ((res = poll (&pfd, 1, mS)) == 0)
+      return 0 ;
+    if ((res < 0) && (errno != EINTR))
+      return -1 ;
+
+    if (read (ring->fd, &count, sizeof (count)) < 0)	// Clear it, then look again
+      continue ;
+  }
+}
+
+
+/*
+ * piRingFd:
+ *	The eventfd that's readable when a producer has woken the consumer,
+ *	for poll or epoll. Read it to clear it, then pop until empty.
+ *********************************************************************************
+ */
+
+int piRingFd (struct piRing *ring)
+{
+  return ring->fd ;
+}
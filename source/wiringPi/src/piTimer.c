@@ -0,0 +1,908 @@
+/*
+ * piTimer.c:
+ *	Absolute deadline sleeps and drift-free periodic timers.
+ *
+ *	A relative nanosleep in a loop drifts: every period picks up the
+ *	time spent doing the work plus however late the kernel woke us.
+ *	Here everything is timed against an absolute deadline on
+ *	CLOCK_MONOTONIC, so lateness in one period doesn't carry into the next.
+ *
+ *	The kernel typically wakes us some tens of microseconds late, so we
+ *	ask to be woken that much early and spin the rest of the way. How
+ *	early is measured the first time we're used rather than guessed.
+ *
+ *	All of it can run on a virtual clock instead, for tests: time then
+ *	stands still until the thread that set it up sleeps or calls
+ *	piClockAdvance, and each step waits for the library's own threads
+ *	to finish what's due before time moves on again.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piTimer.h"
+
+// Calibration: sleep this long a few times and see how late we wake up.
+//	The spin tail is the worst of those plus a margin, kept within limits
+//	so a badly loaded system at startup can't leave us spinning forever.
+
+#define	CAL_SAMPLES	8
+#define	CAL_SLEEP	200000
+#define	SPIN_MIN	 10000
+#define	SPIN_MAX	100000
+
+static pthread_once_t  calibrateOnce  = PTHREAD_ONCE_INIT ;
+static pthread_mutex_t calibrateMutex = PTHREAD_MUTEX_INITIALIZER ;
+static int             calibrated     = FALSE ;
+static uint64_t        spinNs         = SPIN_MAX ;	// Read while it's being changed - use atomics
+
+// piTimer state. The timerfd is set to fire lead nS before each period
+//	is due, then we spin to the exact time.
+
+struct piTimer
+{
+  int      used ;
+  int      fd ;
+  uint64_t period ;
+  uint64_t due ;		// When the next period is due
+  uint64_t lead ;
+  int64_t  jitterSum ;
+  struct piTimerStats stats ;
+} ;
+
+static struct piTimer  timers [PI_TIMER_MAX] ;
+static pthread_mutex_t timerMutex = PTHREAD_MUTEX_INITIALIZER ;
+
+// The virtual clock. Every thread waiting on it has a sleeper on its
+//	stack, kept in the list in deadline order. Threads started with
+//	piClockThreadCreate are counted as busy unless they're waiting on
+//	the clock, and time only moves on when none of them are.
+
+#define	FIRED_TIME	1
+#define	FIRED_SIGNAL	2
+
+// If one of our threads is blocked on something other than the clock,
+//	don't wait for it forever: real nanoseconds.
+
+#define	SETTLE_MAX	100000000
+
+struct sleeper
+{
+  uint64_t         deadline ;
+  pthread_cond_t  *cond ;
+  pthread_mutex_t *mutex ;
+  int              counted ;	// One of ours, busy again once woken
+  int              fired ;
+  struct sleeper  *next ;
+} ;
+
+// A thread from piClockThreadCreate, kept until it's joined so
+//	piClockJoin can tell when it has finished.
+
+struct clockThread
+{
+  pthread_t           thread ;
+  void             *(*fn)(void *) ;
+  void               *arg ;
+  int                 exited ;
+  struct clockThread *next ;
+} ;
+
+int piClockVirtual = FALSE ;
+
+static pthread_once_t  clockOnce  = PTHREAD_ONCE_INIT ;
+static pthread_mutex_t clockLock  = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t  clockCond  = PTHREAD_COND_INITIALIZER ;
+static pthread_cond_t  quietCond ;
+static pthread_key_t   clockKey ;
+static pthread_t       driver ;
+static struct sleeper *sleepers ;
+static struct clockThread *threads ;
+static uint64_t        virtualNow ;
+static int             busy ;
+
+
+/*
+ * nsToTimespec:
+ *********************************************************************************
+ */
+
+static void nsToTimespec (uint64_t ns, struct timespec *ts)
+{
+  ts->tv_sec  = (time_t)(ns / 1000000000) ;
+  ts->tv_nsec = (long)  (ns % 1000000000) ;
+}
+
+
+/*
+ * realNow: piTimerNow:
+ *	Return CLOCK_MONOTONIC - or the virtual clock - in nanoseconds.
+ *********************************************************************************
+ */
+
+static uint64_t realNow (void)
+{
+  struct timespec ts ;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * (uint64_t)1000000000 + (uint64_t)ts.tv_nsec ;
+}
+
+uint64_t piTimerNow (void)
+{
+  if (piClockVirtual)
+    return __atomic_load_n (&virtualNow, __ATOMIC_ACQUIRE) ;
+
+  return realNow () ;
+}
+
+
+/*
+ * calibrate: piTimerCalibrate:
+ *	Work out how late clock_nanosleep wakes us up on this system. This
+ *	is done automatically on first use, but can be re-run (e.g. after
+ *	piHiPri) if things have changed. Returns the spin tail in uS.
+ *	Calibrations don't overlap, and a first use after piTimerCalibrate
+ *	doesn't do it again.
+ *********************************************************************************
+ */
+
+static void calibrate (void)
+{
+  struct timespec ts ;
+  uint64_t target, late, worst = 0 ;
+  int i ;
+
+  for (i = 0 ; i < CAL_SAMPLES ; ++i)
+  {
+    target = realNow () + CAL_SLEEP ;
+    nsToTimespec (target, &ts) ;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+    late = realNow () - target ;
+    if (late > worst)
+      worst = late ;
+  }
+
+  worst += worst / 4 ;
+
+  /**/ if (worst < SPIN_MIN)
+    worst = SPIN_MIN ;
+  else if (worst > SPIN_MAX)
+    worst = SPIN_MAX ;
+
+  __atomic_store_n (&spinNs, worst, __ATOMIC_RELAXED) ;
+  calibrated = TRUE ;
+}
+
+static void calibrateFirst (void)
+{
+  pthread_mutex_lock (&calibrateMutex) ;
+    if (!calibrated)
+      calibrate () ;
+  pthread_mutex_unlock (&calibrateMutex) ;
+}
+
+unsigned int piTimerCalibrate (void)
+{
+  pthread_mutex_lock (&calibrateMutex) ;
+    calibrate () ;
+  pthread_mutex_unlock (&calibrateMutex) ;
+
+  return (unsigned int)(__atomic_load_n (&spinNs, __ATOMIC_RELAXED) / 1000) ;
+}
+
+
+/*
+ * addSleeper: takeSleeper: fire:
+ *	Keep the sleepers in deadline order. Call with clockLock held.
+ *********************************************************************************
+ */
+
+static void addSleeper (struct sleeper *s)
+{
+  struct sleeper **p ;
+
+  for (p = &sleepers ; (*p != NULL) && ((*p)->deadline <= s->deadline) ; p = &(*p)->next)
+    ;
+  s->next = *p ;
+  *p      = s ;
+
+  if (s->counted && (--busy == 0))
+    pthread_cond_broadcast (&quietCond) ;
+}
+
+static int takeSleeper (struct sleeper *s)
+{
+  struct sleeper **p ;
+
+  for (p = &sleepers ; *p != NULL ; p = &(*p)->next)
+    if (*p == s)
+    {
+      *p = s->next ;
+      return TRUE ;
+    }
+
+  return FALSE ;
+}
+
+// The waker marks the thread busy rather than leave it to the thread, so
+//	time can't move on in the gap before it gets to run.
+
+static void fire (struct sleeper *s, int why)
+{
+  takeSleeper (s) ;
+  s->fired = why ;
+  if (s->counted)
+    ++busy ;
+}
+
+
+/*
+ * settle:
+ *	Wait for our threads to finish what they're doing and go back to
+ *	waiting on the clock. Call with clockLock held.
+ *********************************************************************************
+ */
+
+static void settle (void)
+{
+  struct timespec ts ;
+
+  nsToTimespec (realNow () + SETTLE_MAX, &ts) ;
+
+  while (busy > 0)
+    if (pthread_cond_timedwait (&quietCond, &clockLock, &ts) == ETIMEDOUT)
+      break ;
+}
+
+
+/*
+ * wakeFirst:
+ *	Fire the first sleeper and wake its thread. Call with clockLock held,
+ *	which is dropped while we take the sleeper's own mutex.
+ *********************************************************************************
+ */
+
+static void wakeFirst (int why)
+{
+  pthread_cond_t  *cond  = sleepers->cond ;
+  pthread_mutex_t *mutex = sleepers->mutex ;
+
+  fire (sleepers, why) ;
+
+  if (mutex == &clockLock)
+  {
+    pthread_cond_broadcast (&clockCond) ;
+    return ;
+  }
+
+  pthread_mutex_unlock (&clockLock) ;
+    pthread_mutex_lock     (mutex) ;
+    pthread_cond_broadcast (cond) ;
+    pthread_mutex_unlock   (mutex) ;
+  pthread_mutex_lock (&clockLock) ;
+}
+
+
+/*
+ * step:
+ *	Move the virtual clock on to the first sleeper's deadline and wake
+ *	it. Call with clockLock held.
+ *********************************************************************************
+ */
+
+static void step (void)
+{
+  if (sleepers->deadline > virtualNow)
+    __atomic_store_n (&virtualNow, sleepers->deadline, __ATOMIC_RELEASE) ;
+
+  wakeFirst (FIRED_TIME) ;
+}
+
+
+/*
+ * driveUntil:
+ *	The driving thread is waiting for another thread - to exit, or to
+ *	signal it. Time has to keep moving meanwhile, as it would for real.
+ *	Returns FALSE if nothing on the clock is left to make it happen.
+ *	Call with clockLock held.
+ *********************************************************************************
+ */
+
+static int driveUntil (const int *flag)
+{
+  for (;;)
+  {
+    settle () ;
+
+    if (*flag)
+      return TRUE ;
+
+    if ((sleepers == NULL) || (sleepers->deadline == PI_CLOCK_NEVER))
+      return FALSE ;
+
+    step () ;
+  }
+}
+
+
+/*
+ * advanceTo:
+ *	Move the virtual clock on to target, one deadline at a time, letting
+ *	everything due at each one run before going on to the next.
+ *********************************************************************************
+ */
+
+static void advanceTo (uint64_t target)
+{
+  pthread_mutex_lock (&clockLock) ;
+
+  for (;;)
+  {
+    settle () ;
+
+    if ((sleepers == NULL) || (sleepers->deadline > target))
+      break ;
+
+    step () ;
+  }
+
+  if (target > virtualNow)
+    __atomic_store_n (&virtualNow, target, __ATOMIC_RELEASE) ;
+
+  pthread_mutex_unlock (&clockLock) ;
+}
+
+
+/*
+ * virtualSleep:
+ *	piSleepUntil on the virtual clock. The thread that set the clock up
+ *	drives it, so sleeping there is what moves time on; anyone else waits
+ *	for it to get there.
+ *********************************************************************************
+ */
+
+static void virtualSleep (uint64_t deadline)
+{
+  struct sleeper s ;
+
+  if (pthread_equal (pthread_self (), driver))
+  {
+    advanceTo (deadline) ;
+    return ;
+  }
+
+  pthread_mutex_lock (&clockLock) ;
+
+  if (deadline > virtualNow)
+  {
+    s.deadline = deadline ;
+    s.cond     = &clockCond ;
+    s.mutex    = &clockLock ;
+    s.counted  = pthread_getspecific (clockKey) != NULL ;
+    s.fired    = 0 ;
+    addSleeper (&s) ;
+
+    while (s.fired == 0)
+      pthread_cond_wait (&clockCond, &clockLock) ;
+  }
+
+  pthread_mutex_unlock (&clockLock) ;
+}
+
+
+/*
+ * piSleepUntil:
+ *	Sleep until the given CLOCK_MONOTONIC time in nanoseconds. We let the
+ *	kernel have the bulk of the wait and spin for the last bit.
+ *********************************************************************************
+ */
+
+void piSleepUntil (uint64_t deadline)
+{
+  struct timespec ts ;
+  uint64_t spin ;
+
+  if (piClockVirtual)
+  {
+    virtualSleep (deadline) ;
+    return ;
+  }
+
+  pthread_once (&calibrateOnce, calibrateFirst) ;
+  spin = __atomic_load_n (&spinNs, __ATOMIC_RELAXED) ;
+
+  if ((deadline > spin) && (piTimerNow () < (deadline - spin)))
+  {
+    nsToTimespec (deadline - spin, &ts) ;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+  }
+
+  while (piTimerNow () < deadline)
+    ;
+}
+
+
+/*
+ * piTimerCreate:
+ *	Create a periodic timer. The first period is due one period from
+ *	now. Returns the timer number or -1 on error.
+ *********************************************************************************
+ */
+
+int piTimerCreate (unsigned int periodUs)
+{
+  struct itimerspec its ;
+  struct piTimer *t ;
+  uint64_t spin ;
+  int timer, fd ;
+
+  if (periodUs == 0)
+    return -1 ;
+
+  pthread_once (&calibrateOnce, calibrateFirst) ;
+  spin = __atomic_load_n (&spinNs, __ATOMIC_RELAXED) ;
+
+  if ((fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+    return wiringPiFailure (WPI_ALMOST, "piTimerCreate: Unable to create timer: %s\n", strerror (errno)) ;
+
+  pthread_mutex_lock (&timerMutex) ;
+    for (timer = 0 ; timer < PI_TIMER_MAX ; ++timer)
+      if (!timers [timer].used)
+	break ;
+
+    if (timer == PI_TIMER_MAX)
+    {
+      pthread_mutex_unlock (&timerMutex) ;
+      close (fd) ;
+      return wiringPiFailure (WPI_ALMOST, "piTimerCreate: No free timers\n") ;
+    }
+
+    t = &timers [timer] ;
+    memset (t, 0, sizeof (*t)) ;
+    t->used   = TRUE ;
+    t->fd     = fd ;
+    t->period = (uint64_t)periodUs * 1000 ;
+    t->lead   = (spin < t->period) ? spin : 0 ;
+    t->due    = piTimerNow () + t->period ;
+    t->stats.minJitter = INT64_MAX ;
+  pthread_mutex_unlock (&timerMutex) ;
+
+  nsToTimespec (t->due - t->lead, &its.it_value) ;
+  nsToTimespec (t->period,        &its.it_interval) ;
+
+  if (timerfd_settime (fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+  {
+    piTimerDestroy (timer) ;
+    return wiringPiFailure (WPI_ALMOST, "piTimerCreate: Unable to start timer: %s\n", strerror (errno)) ;
+  }
+
+  return timer ;
+}
+
+
+/*
+ * piTimerWait:
+ *	Wait for the next period. Returns the number of periods that have
+ *	gone by since the last call - normally 1 - or -1 on error.
+ *********************************************************************************
+ */
+
+int piTimerWait (int timer)
+{
+  struct piTimer *t ;
+  uint64_t expirations ;
+  int64_t  jitter ;
+
+  if ((timer < 0) || (timer >= PI_TIMER_MAX) || !timers [timer].used)
+    return -1 ;
+
+  t = &timers [timer] ;
+
+// The timerfd runs on real time, so on the virtual clock just sleep
+
+  if (piClockVirtual)
+  {
+    if (piTimerNow () < t->due)
+      piSleepUntil (t->due) ;
+    expirations = (piTimerNow () - t->due) / t->period + 1 ;
+  }
+  else
+    while (read (t->fd, &expirations, sizeof (expirations)) != sizeof (expirations))
+      if (errno != EINTR)
+	return -1 ;
+
+// Anything more than one expiration means we missed periods. Catch up
+//	to the latest one rather than try to replay them.
+
+  t->due += (expirations - 1) * t->period ;
+  t->stats.overruns += expirations - 1 ;
+
+  while (piTimerNow () < t->due)
+    ;
+
+  jitter = (int64_t)(piTimerNow () - t->due) ;
+  t->due += t->period ;
+
+  t->stats.ticks += 1 ;
+  t->jitterSum   += jitter ;
+  if (jitter < t->stats.minJitter) t->stats.minJitter = jitter ;
+  if (jitter > t->stats.maxJitter) t->stats.maxJitter = jitter ;
+  t->stats.meanJitter = t->jitterSum / (int64_t)t->stats.ticks ;
+
+  return (int)expirations ;
+}
+
+
+/*
+ * piTimerFd:
+ *	Return the underlying timerfd so a timer can be polled along with
+ *	other file descriptors. It runs on real time even when the clock
+ *	is virtual.
+ *********************************************************************************
+ */
+
+int piTimerFd (int timer)
+{
+  if ((timer < 0) || (timer >= PI_TIMER_MAX) || !timers [timer].used)
+    return -1 ;
+
+  return timers [timer].fd ;
+}
+
+
+/*
+ * piTimerGetStats:
+ *	Copy out the timing statistics for a timer.
+ *********************************************************************************
+ */
+
+void piTimerGetStats (int timer, struct piTimerStats *stats)
+{
+  memset (stats, 0, sizeof (*stats)) ;
+
+  if ((timer < 0) || (timer >= PI_TIMER_MAX) || !timers [timer].used)
+    return ;
+
+  *stats = timers [timer].stats ;
+  if (stats->ticks == 0)
+    stats->minJitter = 0 ;
+}
+
+
+/*
+ * piTimerDestroy:
+ *********************************************************************************
+ */
+
+void piTimerDestroy (int timer)
+{
+  if ((timer < 0) || (timer >= PI_TIMER_MAX))
+    return ;
+
+  pthread_mutex_lock (&timerMutex) ;
+    if (timers [timer].used)
+    {
+      close (timers [timer].fd) ;
+      timers [timer].used = FALSE ;
+    }
+  pthread_mutex_unlock (&timerMutex) ;
+}
+
+
+/*
+ * clockInit: threadDone:
+ *	A thread started by piClockThreadCreate is no longer busy once it
+ *	has gone.
+ *********************************************************************************
+ */
+
+static void threadDone (void *value)
+{
+  pthread_mutex_lock (&clockLock) ;
+    ((struct clockThread *)value)->exited = TRUE ;
+    if (--busy == 0)
+      pthread_cond_broadcast (&quietCond) ;
+  pthread_mutex_unlock (&clockLock) ;
+}
+
+static void clockInit (void)
+{
+  pthread_condattr_t attr ;
+
+  pthread_condattr_init     (&attr) ;
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC) ;
+  pthread_cond_init         (&quietCond, &attr) ;
+  pthread_condattr_destroy  (&attr) ;
+
+  pthread_key_create (&clockKey, threadDone) ;
+}
+
+
+/*
+ * piClockSetup:
+ *	Switch between the real and the virtual clock. The virtual clock
+ *	starts from the real time and the calling thread is the one that
+ *	drives it: its sleeps, delays and piClockAdvance move time on.
+ *	Do it before starting anything that keeps time - returns -1 if
+ *	anything is waiting on the clock or still running from last time.
+ *********************************************************************************
+ */
+
+int piClockSetup (int mode)
+{
+  if ((mode != PI_CLOCK_REAL) && (mode != PI_CLOCK_VIRTUAL))
+    return -1 ;
+
+  pthread_once (&clockOnce, clockInit) ;
+
+  pthread_mutex_lock (&clockLock) ;
+
+  if ((sleepers != NULL) || (busy != 0))
+  {
+    pthread_mutex_unlock (&clockLock) ;
+    return -1 ;
+  }
+
+  if (mode == PI_CLOCK_VIRTUAL)
+  {
+    if (!piClockVirtual)
+      __atomic_store_n (&virtualNow, realNow (), __ATOMIC_RELEASE) ;
+    driver = pthread_self () ;
+  }
+
+  __atomic_store_n (&piClockVirtual, mode == PI_CLOCK_VIRTUAL, __ATOMIC_RELEASE) ;
+
+  pthread_mutex_unlock (&clockLock) ;
+
+  return 0 ;
+}
+
+
+/*
+ * piClockAdvance:
+ *	Move the virtual clock on by nS, running everything that falls due
+ *	on the way. Same as a sleep from the driving thread.
+ *********************************************************************************
+ */
+
+void piClockAdvance (uint64_t nS)
+{
+  if (piClockVirtual)
+    advanceTo (piTimerNow () + nS) ;
+}
+
+
+/*
+ * clockThread: piClockThreadCreate:
+ *	pthread_create for the library's timing threads. On the virtual
+ *	clock the thread is counted from here on, so time won't move until
+ *	it has started and is waiting for something.
+ *********************************************************************************
+ */
+
+static void *clockThread (void *arg)
+{
+  struct clockThread *t = (struct clockThread *)arg ;
+
+  pthread_setspecific (clockKey, t) ;
+
+  return t->fn (t->arg) ;
+}
+
+int piClockThreadCreate (pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+  struct clockThread *t ;
+  int ret ;
+
+  if (!piClockVirtual)
+    return pthread_create (thread, NULL, fn, arg) ;
+
+  if ((t = calloc (1, sizeof (*t))) == NULL)
+    return ENOMEM ;
+
+  t->fn  = fn ;
+  t->arg = arg ;
+
+  pthread_mutex_lock (&clockLock) ;
+    ++busy ;
+  pthread_mutex_unlock (&clockLock) ;
+
+  if ((ret = pthread_create (thread, NULL, clockThread, t)) != 0)
+  {
+    free (t) ;
+    pthread_mutex_lock (&clockLock) ;
+      if (--busy == 0)
+	pthread_cond_broadcast (&quietCond) ;
+    pthread_mutex_unlock (&clockLock) ;
+    return ret ;
+  }
+
+  pthread_mutex_lock (&clockLock) ;
+    t->thread = *thread ;
+    t->next   = threads ;
+    threads   = t ;
+  pthread_mutex_unlock (&clockLock) ;
+
+  return 0 ;
+}
+
+
+/*
+ * piClockJoin:
+ *	pthread_join for a thread from piClockThreadCreate. From the thread
+ *	driving the virtual clock, time moves on while we wait - a thread
+ *	that's finishing off a pulse or a period needs it to.
+ *********************************************************************************
+ */
+
+int piClockJoin (pthread_t thread, void **retval)
+{
+  struct clockThread *t, **p ;
+  int ret ;
+
+  pthread_mutex_lock (&clockLock) ;
+
+  for (t = threads ; (t != NULL) && !pthread_equal (t->thread, thread) ; t = t->next)
+    ;
+
+  if ((t != NULL) && piClockVirtual && pthread_equal (pthread_self (), driver))
+    (void)driveUntil (&t->exited) ;
+
+  pthread_mutex_unlock (&clockLock) ;
+
+  ret = pthread_join (thread, retval) ;
+
+  if (t != NULL)
+  {
+    pthread_mutex_lock (&clockLock) ;
+      for (p = &threads ; *p != t ; p = &(*p)->next)
+	;
+      *p = t->next ;
+    pthread_mutex_unlock (&clockLock) ;
+    free (t) ;
+  }
+
+  return ret ;
+}
+
+
+/*
+ * piClockCondWait:
+ *	pthread_cond_timedwait against a piTimerNow () deadline, or
+ *	PI_CLOCK_NEVER for none. The condition must be on CLOCK_MONOTONIC.
+ *	Returns 0 when signalled (or spuriously woken), ETIMEDOUT at the
+ *	deadline. Signal it with piClockCondSignal, holding mutex.
+ *********************************************************************************
+ */
+
+int piClockCondWait (pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t deadline)
+{
+  struct timespec ts ;
+  struct sleeper  s ;
+  int fired ;
+
+  if (!piClockVirtual)
+  {
+    if (deadline == PI_CLOCK_NEVER)
+      return pthread_cond_wait (cond, mutex) ;
+
+    nsToTimespec (deadline, &ts) ;
+    return pthread_cond_timedwait (cond, mutex, &ts) ;
+  }
+
+  pthread_mutex_lock (&clockLock) ;
+
+  if (deadline <= virtualNow)
+  {
+    pthread_mutex_unlock (&clockLock) ;
+    return ETIMEDOUT ;
+  }
+
+  s.deadline = deadline ;
+  s.cond     = cond ;
+  s.mutex    = mutex ;
+  s.counted  = pthread_getspecific (clockKey) != NULL ;
+  s.fired    = 0 ;
+  addSleeper (&s) ;
+
+// The driving thread can't just wait: whatever it's waiting for may
+//	need time to move. Let go of mutex, as the wait would, and move time
+//	on until we're signalled or reach the deadline. Only if nothing on
+//	the clock can do that do we wait for real.
+
+  if (pthread_equal (pthread_self (), driver))
+  {
+    pthread_mutex_unlock (mutex) ;
+
+    if (driveUntil (&s.fired))
+    {
+      pthread_mutex_unlock (&clockLock) ;
+      pthread_mutex_lock   (mutex) ;
+    }
+    else
+    {
+      pthread_mutex_unlock (&clockLock) ;
+      pthread_mutex_lock   (mutex) ;
+      pthread_mutex_lock   (&clockLock) ;
+	fired = s.fired ;
+      pthread_mutex_unlock (&clockLock) ;
+      if (fired == 0)
+	pthread_cond_wait (cond, mutex) ;
+    }
+  }
+  else
+  {
+    pthread_mutex_unlock (&clockLock) ;
+    pthread_cond_wait (cond, mutex) ;
+  }
+
+// Woken by something other than the clock or piClockCondSignal
+
+  pthread_mutex_lock (&clockLock) ;
+    if ((s.fired == 0) && takeSleeper (&s) && s.counted)
+      ++busy ;
+  pthread_mutex_unlock (&clockLock) ;
+
+  return (s.fired == FIRED_TIME) ? ETIMEDOUT : 0 ;
+}
+
+
+/*
+ * piClockCondSignal:
+ *	Wake everything waiting on a condition with piClockCondWait - it's a
+ *	broadcast, so a waiter can't be left behind when there's more than
+ *	one. On the virtual clock it marks the waiters busy before they're
+ *	woken, so time doesn't move on before they've seen what they were told.
+ *********************************************************************************
+ */
+
+void piClockCondSignal (pthread_cond_t *cond)
+{
+  struct sleeper *s, *next ;
+
+  if (!piClockVirtual)
+  {
+    pthread_cond_broadcast (cond) ;
+    return ;
+  }
+
+  pthread_mutex_lock (&clockLock) ;
+    for (s = sleepers ; s != NULL ; s = next)
+    {
+      next = s->next ;
+      if (s->cond == cond)
+	fire (s, FIRED_SIGNAL) ;
+    }
+  pthread_mutex_unlock (&clockLock) ;
+
+  pthread_cond_broadcast (cond) ;
+}
@@ -0,0 +1,390 @@
+/*
+ * piWave.c:
+ *	Precomputed multi-pin waveforms, replayed by a single thread.
+ *
+ *	The caller describes a waveform as a list of steps, each setting
+ *	some pins, clearing some others and then waiting. We compile that
+ *	into the actual GPSET/GPCLR words for each bank and the time of each
+ *	step relative to the start of the wave, so replaying it is nothing
+ *	more than wait-until, store, store. Steps are timed from the start
+ *	of the wave, not from the previous step, so errors don't accumulate.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piWave.h"
+#include "../include/piTimer.h"
+
+// WAVE_SPIN:
+//	We wait for each step on waveCond, so a stop is seen at once, until
+//	this long before it's due, then let piSleepUntil spin the rest.
+
+#define	WAVE_SPIN	100000		// nS
+
+// waveWord:
+//	One compiled step
+
+struct waveWord
+{
+  uint64_t at ;			// nS from the start of the wave
+  uint32_t set [2] ;
+  uint32_t clr [2] ;
+} ;
+
+struct wave
+{
+  int              used ;
+  int              numWords ;
+  struct waveWord *words ;
+  uint64_t         length ;	// nS
+  int              repeat ;	// 0 is forever
+  int              next ;	// Wave to chain to, or -1
+} ;
+
+static struct wave waves [PI_WAVE_MAX] ;
+
+static pthread_mutex_t waveMutex = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t  waveCond ;
+static pthread_once_t  waveOnce  = PTHREAD_ONCE_INIT ;
+static pthread_t       waveThread ;
+static int             threadRunning = FALSE ;
+static volatile int    current = -1 ;	// Wave being played
+static volatile int    stopping = FALSE ;
+
+
+/*
+ * waveInit:
+ *	The steps are timed on waveCond against CLOCK_MONOTONIC, the same as
+ *	piTimerNow.
+ *********************************************************************************
+ */
+
+static void waveInit (void)
+{
+  pthread_condattr_t attr ;
+
+  pthread_condattr_init     (&attr) ;
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC) ;
+  pthread_cond_init         (&waveCond, &attr) ;
+  pthread_condattr_destroy  (&attr) ;
+}
+
+
+/*
+ * waitStep:
+ *	Wait until a step is due. Returns FALSE if we've been told to stop.
+ *********************************************************************************
+ */
+
+static int waitStep (uint64_t due)
+{
+  int stop ;
+
+  if (due > WAVE_SPIN)
+  {
+    pthread_mutex_lock (&waveMutex) ;
+      while (!stopping && (piClockCondWait (&waveCond, &waveMutex, due - WAVE_SPIN) != ETIMEDOUT))
+	;
+      stop = stopping ;
+    pthread_mutex_unlock (&waveMutex) ;
+
+    if (stop)
+      return FALSE ;
+  }
+
+  piSleepUntil (due) ;
+
+  return !stopping ;
+}
+
+
+/*
+ * playWave:
+ *	Play one pass of a wave starting at the given time.
+ *	Returns FALSE if we've been told to stop.
+ *********************************************************************************
+ */
+
+static int playWave (const struct wave *w, uint64_t start)
+{
+  const struct waveWord *word ;
+  int i ;
+
+  for (i = 0 ; i < w->numWords ; ++i)
+  {
+    word = &w->words [i] ;
+
+    if (!waitStep (start + word->at))
+      return FALSE ;
+
+    if ((word->set [0] | word->clr [0]) != 0)
+      digitalWriteBank (0, word->set [0], word->clr [0]) ;
+    if ((word->set [1] | word->clr [1]) != 0)
+      digitalWriteBank (1, word->set [1], word->clr [1]) ;
+  }
+
+  return TRUE ;
+}
+
+
+/*
+ * waveThreadFn:
+ *	Wait for something to play, then play it, its repeats and anything
+ *	chained on to it.
+ *********************************************************************************
+ */
+
+static PI_THREAD (waveThreadFn)
+{
+  struct wave *w ;
+  uint64_t start ;
+  int wave, pass, ok ;
+
+  (void)piRealtimeThread (PI_RT_WAVE) ;	// Only effective if we run as root
+
+  for (;;)
+  {
+    pthread_mutex_lock (&waveMutex) ;
+      while (current == -1)
+	piClockCondWait (&waveCond, &waveMutex, PI_CLOCK_NEVER) ;
+      wave = current ;
+    pthread_mutex_unlock (&waveMutex) ;
+
+    start = piTimerNow () ;
+    ok    = TRUE ;
+
+    while (ok && (wave != -1))
+    {
+      w = &waves [wave] ;
+      for (pass = 0 ; ok && ((w->repeat == PI_WAVE_FOREVER) || (pass < w->repeat)) ; ++pass)
+      {
+	ok     = playWave (w, start) ;
+	start += w->length ;
+      }
+
+// Wait out the end of the last step before moving on
+
+      if (ok)
+	ok = waitStep (start) ;
+
+      wave = w->next ;
+    }
+
+    pthread_mutex_lock (&waveMutex) ;
+      current  = -1 ;
+      stopping = FALSE ;
+      piClockCondSignal (&waveCond) ;
+    pthread_mutex_unlock (&waveMutex) ;
+  }
+
+  return NULL ;
+}
+
+
+/*
+ * piWaveCreate:
+ *	Compile an array of steps into a wave. Returns the wave number
+ *	or -1 on error.
+ *********************************************************************************
+ */
+
+int piWaveCreate (const struct piWaveStep *steps, int numSteps)
+{
+  struct waveWord *words ;
+  uint64_t at = 0 ;
+  int wave, i ;
+
+  if ((steps == NULL) || (numSteps <= 0))
+    return -1 ;
+
+  for (wave = 0 ; wave < PI_WAVE_MAX ; ++wave)
+    if (!waves [wave].used)
+      break ;
+
+  if (wave == PI_WAVE_MAX)
+    return wiringPiFailure (WPI_ALMOST, "piWaveCreate: No free waves\n") ;
+
+  if ((words = calloc ((size_t)numSteps, sizeof (struct waveWord))) == NULL)
+    return wiringPiFailure (WPI_ALMOST, "piWaveCreate: Out of memory\n") ;
+
+  for (i = 0 ; i < numSteps ; ++i)
+  {
+    words [i].at      = at ;
+    words [i].set [0] = (uint32_t)(steps [i].on) ;
+    words [i].set [1] = (uint32_t)(steps [i].on >> 32) ;
+    words [i].clr [0] = (uint32_t)(steps [i].off       & ~steps [i].on) ;
+    words [i].clr [1] = (uint32_t)((steps [i].off >> 32) & ~(steps [i].on >> 32)) ;
+    at += (uint64_t)steps [i].delay * 1000 ;
+  }
+
+  waves [wave].words    = words ;
+  waves [wave].numWords = numSteps ;
+  waves [wave].length   = at ;
+  waves [wave].repeat   = 1 ;
+  waves [wave].next     = -1 ;
+  waves [wave].used     = TRUE ;
+
+  return wave ;
+}
+
+
+/*
+ * piWaveRepeat:
+ *	Play the wave count times. PI_WAVE_FOREVER (0) means until stopped.
+ *********************************************************************************
+ */
+
+int piWaveRepeat (int wave, int count)
+{
+  if ((wave < 0) || (wave >= PI_WAVE_MAX) || !waves [wave].used || (count < 0))
+    return -1 ;
+
+  if ((count == PI_WAVE_FOREVER) && (waves [wave].length == 0))
+    return -1 ;	// Would never sleep
+
+  waves [wave].repeat = count ;
+  return 0 ;
+}
+
+
+/*
+ * piWaveChain:
+ *	When the wave (and all its repeats) have finished, play next.
+ *	-1 breaks the chain.
+ *********************************************************************************
+ */
+
+int piWaveChain (int wave, int next)
+{
+  if ((wave < 0) || (wave >= PI_WAVE_MAX) || !waves [wave].used)
+    return -1 ;
+
+  if ((next != -1) && ((next < 0) || (next >= PI_WAVE_MAX) || !waves [next].used))
+    return -1 ;
+
+  waves [wave].next = next ;
+  return 0 ;
+}
+
+
+/*
+ * piWaveSend:
+ *	Start playing a wave. Anything already playing is stopped first.
+ *********************************************************************************
+ */
+
+int piWaveSend (int wave)
+{
+  if ((wave < 0) || (wave >= PI_WAVE_MAX) || !waves [wave].used)
+    return -1 ;
+
+  piWaveStop () ;		// Sets up waveCond too
+
+  pthread_mutex_lock (&waveMutex) ;
+    if (!threadRunning)
+    {
+      if (piClockThreadCreate (&waveThread, waveThreadFn, NULL) != 0)
+      {
+	pthread_mutex_unlock (&waveMutex) ;
+	return wiringPiFailure (WPI_ALMOST, "piWaveSend: Unable to start wave thread\n") ;
+      }
+      threadRunning = TRUE ;
+    }
+
+    current = wave ;
+    piClockCondSignal (&waveCond) ;
+  pthread_mutex_unlock (&waveMutex) ;
+
+  return 0 ;
+}
+
+
+/*
+ * piWaveBusy:
+ *	Return TRUE if a wave is still playing.
+ *********************************************************************************
+ */
+
+int piWaveBusy (void)
+{
+  return current != -1 ;
+}
+
+
+/*
+ * piWaveStop:
+ *	Stop whatever is playing and wait for the thread to notice.
+ *********************************************************************************
+ */
+
+void piWaveStop (void)
+{
+  pthread_once (&waveOnce, waveInit) ;
+
+  pthread_mutex_lock (&waveMutex) ;
+    if (current != -1)
+    {
+      stopping = TRUE ;
+      piClockCondSignal (&waveCond) ;		// Cut short the step it's waiting for
+      while (current != -1)
+	piClockCondWait (&waveCond, &waveMutex, PI_CLOCK_NEVER) ;
+    }
+  pthread_mutex_unlock (&waveMutex) ;
+}
+
+
+/*
+ * piWaveDelete:
+ *	Free up a wave. It's an error to delete a wave that's playing.
+ *********************************************************************************
+ */
+
+int piWaveDelete (int wave)
+{
+  int i ;
+
+  if ((wave < 0) || (wave >= PI_WAVE_MAX) || !waves [wave].used)
+    return -1 ;
+
+  pthread_mutex_lock (&waveMutex) ;
+    if (current != -1)
+    {
+      pthread_mutex_unlock (&waveMutex) ;
+      return -1 ;
+    }
+
+    for (i = 0 ; i < PI_WAVE_MAX ; ++i)
+      if (waves [i].used && (waves [i].next == wave))
+	waves [i].next = -1 ;
+
+    free (waves [wave].words) ;
+    waves [wave].words = NULL ;
+    waves [wave].used  = FALSE ;
+  pthread_mutex_unlock (&waveMutex) ;
+
+  return 0 ;
+}
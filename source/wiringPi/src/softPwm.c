@@ -1,6 +1,9 @@
 /*
  * softPwm.c:
  *	Provide many channels of software driven PWM.
+ *	One thread drives every channel: it keeps the channels sorted by
+ *	when their next edge is due, sleeps until the first, then makes all
+ *	the edges that are due with one GPSET and one GPCLR store per bank.
  *	Copyright (c) 2012-2017 Gordon Henderson
  ***********************************************************************
  * This file is part of wiringPi:
@@ -23,11 +26,15 @@
  */
 
 #include <stdio.h>
-#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "../include/wiringPi.h"
 #include "../include/softPwm.h"
+#include "../include/piTimer.h"
+#include "../include/piStats.h"
+#include "../include/piJournal.h"
 
 // MAX_PINS:
 //	This is more than the number of Pi pins because we can actually softPwm.
@@ -42,56 +49,219 @@
 //	of 100 and a range of 100 gives a period of 100 * 100 = 10,000 µS
 //	which is a frequency of 100Hz.
 //
-//	It's possible to get a higher frequency by lowering the pulse time,
-//	however CPU uage will skyrocket as wiringPi uses a hard-loop to time
-//	periods under 100µS - this is because the Linux timer calls are just
-//	not accurate at all, and have an overhead.
+//	softPwmCreateFreq sets the frequency directly instead, and each pin
+//	can have its own frequency and range.
 //
-//	Another way to increase the frequency is to reduce the range - however
-//	that reduces the overall output accuracy...
+//	It's possible to get a higher frequency by lowering the pulse time,
+//	however CPU uage will climb as more of each period falls inside the
+//	spin tail that piSleepUntil uses to get past the inaccuracy of the
+//	Linux timer calls.
 
 #define	PULSE_TIME	100
 
-static volatile int marks         [MAX_PINS] ;
-static volatile int range         [MAX_PINS] ;
-static volatile pthread_t threads [MAX_PINS] ;
-static volatile int newPin = -1 ;
+// Edges due within this long of each other go out together
+
+#define	EDGE_MERGE	1000
+
+struct channel
+{
+  volatile int  mark ;		// As last written
+  int           range ;
+  uint64_t      pulse ;		// nS per step of the range
+  int           active ;
+
+  int           level ;		// What to write at the next edge
+  int           periodMark ;	// mark for the period we're in
+  uint64_t      periodStart ;
+  uint64_t      next ;		// When the next edge is due
+
+  int                      fast ;
+  struct wiringPiPinHandle handle ;
+} ;
+
+// One store per register per batch
+
+struct regWrite
+{
+  volatile unsigned int *reg ;
+  unsigned int           mask ;
+} ;
+
+static struct channel channels [MAX_PINS] ;
+static int            order    [MAX_PINS] ;	// Active pins, soonest edge first
+static int            numActive ;
+
+static pthread_mutex_t dataLock    = PTHREAD_MUTEX_INITIALIZER ;	// The above
+static pthread_mutex_t controlLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP ;	// Create/stop - pinMode calls softPwmStop
+static pthread_t       engine ;
+static int             running ;
+static uint64_t        sleepingUntil ;
+
+static struct softPwmStats stats ;
+static uint64_t            totalLate ;
 
 
 /*
- * softPwmThread:
- *	Thread to do the actual PWM output
+ * addWrite:
+ *	Merge a pin into the stores for this batch
+ *********************************************************************************
+ */
+
+static void addWrite (struct regWrite *writes, int *n, volatile unsigned int *reg, unsigned int mask)
+{
+  int i ;
+
+  for (i = 0 ; i < *n ; ++i)
+    if (writes [i].reg == reg)
+    {
+      writes [i].mask |= mask ;
+      return ;
+    }
+
+  writes [*n].reg  = reg ;
+  writes [*n].mask = mask ;
+  ++*n ;
+}
+
+
+/*
+ * edge:
+ *	Make the edge that's due on a channel and work out the next one.
+ *	The mark is picked up at the start of each period, so a write never
+ *	gives a short or long pulse in the middle of one.
+ *********************************************************************************
+ */
+
+static void edge (int pin, uint64_t now, struct regWrite *sets, int *numSets, struct regWrite *clrs, int *numClrs)
+{
+  struct channel *c = &channels [pin] ;
+  uint64_t period = (uint64_t)c->range * c->pulse ;
+  int level = c->level ;
+
+  if (level == HIGH)		// Start of a period
+  {
+    c->periodMark = c->mark ;
+    if (c->periodMark == 0)
+      level = LOW ;
+
+    if ((c->periodMark == 0) || (c->periodMark == c->range))
+    {
+      c->periodStart += period ;
+      c->next         = c->periodStart ;
+    }
+    else
+    {
+      c->level = LOW ;
+      c->next  = c->periodStart + (uint64_t)c->periodMark * c->pulse ;
+    }
+  }
+  else
+  {
+    c->level        = HIGH ;
+    c->periodStart += period ;
+    c->next         = c->periodStart ;
+  }
+
+// If we've fallen more than a whole period behind, start again from now
+//	rather than rush out a burst of short periods to catch up.
+
+  if (now > c->next + period)
+  {
+    PI_STAT_INC (PI_STAT_SOFT_PWM_OVERRUN) ;
+    ++stats.overruns ;
+    c->level       = HIGH ;
+    c->periodStart = now ;
+    c->next        = now ;
+  }
+
+  ++stats.edges ;
+
+  if (c->fast && piJournalActive)		// digitalWrite logs its own
+    piJournalLog (PI_JOURNAL_DIGITAL_WRITE, pin, level) ;
+
+  /**/ if (!c->fast)
+    digitalWrite (pin, level) ;
+  else if (level == HIGH)
+    addWrite (sets, numSets, c->handle.set, c->handle.mask) ;
+  else
+    addWrite (clrs, numClrs, c->handle.clr, c->handle.mask) ;
+}
+
+
+/*
+ * sortOrder:
+ *	Insertion sort on the next edge time. Only the channels we've just
+ *	moved are out of place, so this is close to linear.
  *********************************************************************************
  */
 
-static void *softPwmThread (void *arg)
+static void sortOrder (void)
 {
-  int pin, mark, space ;
-  struct sched_param param ;
+  int i, j, pin ;
+
+  for (i = 1 ; i < numActive ; ++i)
+  {
+    pin = order [i] ;
+    for (j = i ; (j > 0) && (channels [order [j - 1]].next > channels [pin].next) ; --j)
+      order [j] = order [j - 1] ;
+    order [j] = pin ;
+  }
+}
 
-  param.sched_priority = sched_get_priority_max (SCHED_RR) ;
-  pthread_setschedparam (pthread_self (), SCHED_RR, &param) ;
 
-  pin = *((int *)arg) ;
-  free (arg) ;
+/*
+ * softPwmThread:
+ *	Thread to do the actual PWM output, for all the pins.
+ *********************************************************************************
+ */
 
-  pin    = newPin ;
-  newPin = -1 ;
+static void *softPwmThread (UNU void *arg)
+{
+  struct regWrite sets [4], clrs [4] ;
+  int numSets, numClrs, i ;
+  uint64_t now, due ;
 
-  piHiPri (90) ;
+  piRealtimeThread (PI_RT_PWM) ;
 
   for (;;)
   {
-    mark  = marks [pin] ;
-    space = range [pin] - mark ;
+    pthread_mutex_lock (&dataLock) ;
+
+    if (!running)
+    {
+      pthread_mutex_unlock (&dataLock) ;
+      break ;
+    }
+
+    now = piTimerNow () ;
+    due = (numActive == 0) ? now + 1000000 : channels [order [0]].next ;
 
-    if (mark != 0)
-      digitalWrite (pin, HIGH) ;
-    delayMicroseconds (mark * 100) ;
+    if (due > now)
+    {
+      sleepingUntil = due ;
+      pthread_mutex_unlock (&dataLock) ;
+      piSleepUntil (due) ;
+      continue ;
+    }
 
-    if (space != 0)
-      digitalWrite (pin, LOW) ;
-    delayMicroseconds (space * 100) ;
+    ++stats.wakeups ;
+    totalLate += now - due ;
+    if (now - due > stats.maxLate)
+      stats.maxLate = now - due ;
+
+// Everything due now (or within EDGE_MERGE) goes in this batch
+
+    numSets = numClrs = 0 ;
+    for (i = 0 ; (i < numActive) && (channels [order [i]].next <= now + EDGE_MERGE) ; ++i)
+      edge (order [i], now, sets, &numSets, clrs, &numClrs) ;
+
+    for (i = 0 ; i < numClrs ; ++i)
+      *clrs [i].reg = clrs [i].mask ;
+    for (i = 0 ; i < numSets ; ++i)
+      *sets [i].reg = sets [i].mask ;
+
+    sortOrder () ;
+    pthread_mutex_unlock (&dataLock) ;
   }
 
   return NULL ;
@@ -106,81 +276,159 @@ static void *softPwmThread (void *arg)
 
 void softPwmWrite (int pin, int value)
 {
-  if (pin < MAX_PINS)
+  if ((pin >= 0) && (pin < MAX_PINS))
   {
     /**/ if (value < 0)
       value = 0 ;
-    else if (value > range [pin])
-      value = range [pin] ;
+    else if (value > channels [pin].range)
+      value = channels [pin].range ;
 
-    marks [pin] = value ;
+    channels [pin].mark = value ;
   }
 }
 
 
 /*
- * softPwmCreate:
- *	Create a new softPWM thread.
+ * create:
+ *	Start PWM on a pin with pulse nS per step of the range. The pin
+ *	joins the others at the next edge the thread wakes up for.
  *********************************************************************************
  */
 
-int softPwmCreate (int pin, int initialValue, int pwmRange)
+static int create (int pin, int initialValue, int pwmRange, uint64_t pulse)
 {
-  int res ;
-  pthread_t myThread ;
-  int *passPin ;
+  struct channel *c ;
+  int res = 0 ;
 
-  if (pin >= MAX_PINS)
+  if ((pin < 0) || (pin >= MAX_PINS) || (pwmRange <= 0) || (pulse == 0))
     return -1 ;
 
-  if (range [pin] != 0)	// Already running on this pin
-    return -1 ;
+  pthread_mutex_lock (&controlLock) ;
 
-  if (pwmRange <= 0)
-    return -1 ;
-
-  passPin = malloc (sizeof (*passPin)) ;
-  if (passPin == NULL)
+  if (channels [pin].active)	// Already running on this pin
+  {
+    pthread_mutex_unlock (&controlLock) ;
     return -1 ;
+  }
 
   digitalWrite (pin, LOW) ;
   pinMode      (pin, OUTPUT) ;
 
-  marks [pin] = initialValue ;
-  range [pin] = pwmRange ;
+  if (initialValue < 0)
+    initialValue = 0 ;
+  else if (initialValue > pwmRange)
+    initialValue = pwmRange ;
+
+  pthread_mutex_lock (&dataLock) ;
 
-  *passPin = pin ;
-  newPin   = pin ;
-  res      = pthread_create (&myThread, NULL, softPwmThread, (void *)passPin) ;
+  c = &channels [pin] ;
+  memset (c, 0, sizeof (*c)) ;
+  c->mark   = initialValue ;
+  c->range  = pwmRange ;
+  c->pulse  = pulse ;
+  c->active = TRUE ;
+  c->level  = HIGH ;
+  c->fast   = wiringPiGetPinHandle (pin, &c->handle) == 0 ;
+  c->next   = piTimerNow () ;
+  if (running && (sleepingUntil > c->next))
+    c->next = sleepingUntil ;
+  c->periodStart = c->next ;
 
-  if (res != 0)
-    return res ;
-  
-  while (newPin != -1)
-    delay (1) ;
+  order [numActive++] = pin ;
+  sortOrder () ;
+
+  pthread_mutex_unlock (&dataLock) ;
+
+  if (!running)
+  {
+    running = TRUE ;
+    if ((res = piClockThreadCreate (&engine, softPwmThread, NULL)) != 0)
+    {
+      running        = FALSE ;
+      numActive      = 0 ;
+      channels [pin].active = FALSE ;
+    }
+  }
 
-  threads [pin] = myThread ;
+  pthread_mutex_unlock (&controlLock) ;
 
   return res ;
 }
 
 
+/*
+ * softPwmCreate: softPwmCreateFreq:
+ *	Start PWM on a pin. The period is either range * PULSE_TIME, as it
+ *	always was, or set from the frequency in Hz.
+ *********************************************************************************
+ */
+
+int softPwmCreate (int pin, int initialValue, int pwmRange)
+{
+  return create (pin, initialValue, pwmRange, (uint64_t)PULSE_TIME * 1000) ;
+}
+
+int softPwmCreateFreq (int pin, int initialValue, int pwmRange, int frequency)
+{
+  if ((pwmRange <= 0) || (frequency <= 0))
+    return -1 ;
+
+  return create (pin, initialValue, pwmRange, (uint64_t)1000000000 / ((uint64_t)frequency * pwmRange)) ;
+}
+
+
 /*
  * softPwmStop:
- *	Stop an existing softPWM thread
+ *	Stop PWM on a pin. When the last one goes, so does the thread.
  *********************************************************************************
  */
 
 void softPwmStop (int pin)
 {
-  if (pin < MAX_PINS)
+  int i, j ;
+
+  if ((pin < 0) || (pin >= MAX_PINS))
+    return ;
+
+  pthread_mutex_lock (&controlLock) ;
+
+  if (channels [pin].active)
   {
-    if (range [pin] != 0)
-    {
-      pthread_cancel (threads [pin]) ;
-      pthread_join   (threads [pin], NULL) ;
-      range [pin] = 0 ;
-      digitalWrite (pin, LOW) ;
-    }
+    pthread_mutex_lock (&dataLock) ;
+
+    for (i = j = 0 ; i < numActive ; ++i)
+      if (order [i] != pin)
+	order [j++] = order [i] ;
+    numActive = j ;
+    channels [pin].active = FALSE ;
+    channels [pin].range  = 0 ;
+
+    if (numActive == 0)
+      running = FALSE ;
+
+    pthread_mutex_unlock (&dataLock) ;
+
+    digitalWrite (pin, LOW) ;
+
+    if (!running)
+      piClockJoin (engine, NULL) ;
   }
+
+  pthread_mutex_unlock (&controlLock) ;
+}
+
+
+/*
+ * softPwmGetStats:
+ *	How well the thread is keeping up. Late is how long after an edge
+ *	was due the thread woke up for it, in nS.
+ *********************************************************************************
+ */
+
+void softPwmGetStats (struct softPwmStats *s)
+{
+  pthread_mutex_lock (&dataLock) ;
+  *s = stats ;
+  s->meanLate = (stats.wakeups == 0) ? 0 : totalLate / stats.wakeups ;
+  pthread_mutex_unlock (&dataLock) ;
 }
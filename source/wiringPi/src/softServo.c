@@ -2,6 +2,11 @@
  * softServo.c:
  *	Provide N channels of software driven PWM suitable for RC
  *	servo motors.
+ *	One thread drives every servo. The pulses all start together at the
+ *	top of each frame and end in order of width, from a schedule that is
+ *	kept sorted as the widths change rather than sorted every frame.
+ *	Servos can also be given a speed and acceleration, and the thread
+ *	moves them to where they've been told to go at the frame rate.
  *	Copyright (c) 2012 Gordon Henderson
  ***********************************************************************
  * This file is part of wiringPi:
@@ -24,15 +29,17 @@
  */
 
 //#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
-#include <time.h>
-#include <sys/time.h>
+#include <math.h>
 #include <pthread.h>
 
 #include "../include/wiringPi.h"
 #include "../include/softServo.h"
+#include "../include/piTimer.h"
+#include "../include/piJournal.h"
 
-// RC Servo motors are a bit of an oddity - designed in the days when 
+// RC Servo motors are a bit of an oddity - designed in the days when
 //	radio control was experimental and people were tryin to make
 //	things as simple as possible as it was all very expensive...
 //
@@ -64,89 +71,349 @@
 //	If you want servo control for the Pi, then use the servoblaster kernel
 //	module.
 
-#define	MAX_SERVOS	8
+// One servo per on-board pin
 
-static int pinMap     [MAX_SERVOS] ;	// Keep track of our pins
-static int pulseWidth [MAX_SERVOS] ;	// microseconds
+#define	MAX_SERVOS	64
+
+// The frame is 8mS from the start of one set of pulses to the next, as it
+//	always has been.
+
+#define	FRAME_NS	8000000
+#define	FRAME_S		0.008
+
+// Pulse ends within this long of each other go out together
+
+#define	EDGE_MERGE	1000
+
+#define	MIN_VALUE	-250
+#define	MAX_VALUE	1250
+
+struct servo
+{
+  int      active ;
+  int      pulse ;		// uS, as it'll go out in the next frame
+
+// Motion - all in uS of pulse width (and per second, per second squared)
+
+  int      profile ;
+  double   target ;
+  double   position ;
+  double   velocity ;
+  double   accel ;
+  double   maxVelocity ;
+  double   maxAccel ;
+
+// S-curve: a quintic from where we were to the target, over duration
+//	seconds, with elapsed gone.
+
+  double   coef [6] ;
+  double   duration ;
+  double   elapsed ;
+  int      planned ;
+
+  int                      fast ;
+  struct wiringPiPinHandle handle ;
+} ;
+
+struct regWrite
+{
+  volatile unsigned int *reg ;
+  unsigned int           mask ;
+} ;
+
+static struct servo servos [MAX_SERVOS] ;
+static int          order  [MAX_SERVOS] ;	// Active servos, narrowest pulse first
+static int          numActive ;
+
+static pthread_mutex_t dataLock    = PTHREAD_MUTEX_INITIALIZER ;	// The above
+static pthread_mutex_t controlLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP ;	// Create/stop
+static pthread_t       engine ;
+static int             running ;
 
 
 /*
- * softServoThread:
- *	Thread to do the actual Servo PWM output
+ * addWrite:
+ *	Merge a pin into the stores for this batch
+ *********************************************************************************
+ */
+
+static void addWrite (struct regWrite *writes, int *n, volatile unsigned int *reg, unsigned int mask)
+{
+  int i ;
+
+  for (i = 0 ; i < *n ; ++i)
+    if (writes [i].reg == reg)
+    {
+      writes [i].mask |= mask ;
+      return ;
+    }
+
+  writes [*n].reg  = reg ;
+  writes [*n].mask = mask ;
+  ++*n ;
+}
+
+
+/*
+ * reorder:
+ *	A servo's pulse has changed - move it to its new place in the
+ *	schedule. Everything else is still in order, so it's one pass.
+ *********************************************************************************
+ */
+
+static void reorder (int pin)
+{
+  int i, j ;
+
+  for (i = 0 ; (i < numActive) && (order [i] != pin) ; ++i)
+    ;
+  if (i == numActive)
+    return ;
+
+  for (j = i ; (j > 0) && (servos [order [j - 1]].pulse > servos [pin].pulse) ; --j)
+    order [j] = order [j - 1] ;
+  for (     ; (j < numActive - 1) && (servos [order [j + 1]].pulse < servos [pin].pulse) ; ++j)
+    order [j] = order [j + 1] ;
+  order [j] = pin ;
+}
+
+
+/*
+ * sortOrder:
+ *	Put the whole schedule back in pulse order after several servos have
+ *	moved at once. Most will still be in place, so an insertion sort.
+ *********************************************************************************
+ */
+
+static void sortOrder (void)
+{
+  int i, j, pin ;
+
+  for (i = 1 ; i < numActive ; ++i)
+  {
+    pin = order [i] ;
+    for (j = i ; (j > 0) && (servos [order [j - 1]].pulse > servos [pin].pulse) ; --j)
+      order [j] = order [j - 1] ;
+    order [j] = pin ;
+  }
+}
+
+
+/*
+ * plan:
+ *	Work out an S-curve from where a servo is now to its target. It's a
+ *	quintic, so position, speed and acceleration all join up smoothly
+ *	with however it was moving before. The time is picked so that a move
+ *	from rest peaks at the maximum speed and acceleration, and a servo
+ *	that was already moving has time to slow down.
+ *********************************************************************************
+ */
+
+static void plan (struct servo *s)
+{
+  double d  = s->target - s->position ;
+  double v0 = s->velocity ;
+  double a0 = s->accel ;
+  double t, ta ;
+
+  t  = 1.875 * fabs (d) / s->maxVelocity ;
+  ta = sqrt (5.7735 * fabs (d) / s->maxAccel) ;
+  if (ta > t)
+    t = ta ;
+  ta = 2.0 * fabs (v0) / s->maxAccel ;	// Time to turn round if it was going fast
+  if (ta > t)
+    t = ta ;
+  if (t < FRAME_S)
+    t = FRAME_S ;
+
+  s->coef [0] = s->position ;
+  s->coef [1] = v0 * t ;
+  s->coef [2] = a0 * t * t / 2.0 ;
+  s->coef [3] =  10.0 * d - 6.0 * v0 * t - 1.5 * a0 * t * t ;
+  s->coef [4] = -15.0 * d + 8.0 * v0 * t + 1.5 * a0 * t * t ;
+  s->coef [5] =   6.0 * d - 3.0 * v0 * t - 0.5 * a0 * t * t ;
+
+  s->duration = t ;
+  s->elapsed  = 0.0 ;
+  s->planned  = TRUE ;
+}
+
+
+/*
+ * move:
+ *	Move a servo on by one frame
  *********************************************************************************
  */
 
-static PI_THREAD (softServoThread)
+static void move (struct servo *s)
 {
-  register int i, j, k, m, tmp ;
-  int lastDelay, pin, servo ;
+  double d, dir, stopping, x, *c ;
+
+  d = s->target - s->position ;
+
+  if (s->profile == SERVO_PROFILE_SCURVE)
+  {
+    if (!s->planned)
+      plan (s) ;
+
+    s->elapsed += FRAME_S ;
+    if (s->elapsed >= s->duration)
+    {
+      s->position = s->target ;
+      s->velocity = s->accel = 0.0 ;
+      s->planned  = FALSE ;
+      return ;
+    }
+
+    x = s->elapsed / s->duration ;
+    c = s->coef ;
+    s->position = c [0] + x * (c [1] + x * (c [2] + x * (c [3] + x * (c [4] + x * c [5])))) ;
+    s->velocity = (c [1] + x * (2.0 * c [2] + x * (3.0 * c [3] + x * (4.0 * c [4] + x * 5.0 * c [5])))) / s->duration ;
+    s->accel    = (2.0 * c [2] + x * (6.0 * c [3] + x * (12.0 * c [4] + x * 20.0 * c [5]))) / (s->duration * s->duration) ;
+    return ;
+  }
 
-  int myDelays [MAX_SERVOS] ;
-  int myPins   [MAX_SERVOS] ;
+// Trapezoid: speed up to the limit, cruise, then slow down in time to stop
+//	on the target.
 
-  struct timeval  tNow, tStart, tPeriod, tGap, tTotal ;
-  struct timespec tNs ;
+  if ((fabs (d) < 0.5) && (fabs (s->velocity) <= s->maxAccel * FRAME_S))
+  {
+    s->position = s->target ;
+    s->velocity = s->accel = 0.0 ;
+    return ;
+  }
+
+  dir      = (d > 0.0) ? 1.0 : -1.0 ;
+  stopping = s->velocity * s->velocity / (2.0 * s->maxAccel) ;
 
-  tTotal.tv_sec  =    0 ;
-  tTotal.tv_usec = 8000 ;
+  if ((s->velocity * dir < 0.0) || (stopping < fabs (d)))
+    s->accel =  dir * s->maxAccel ;	// Wrong way, or not there yet
+  else
+    s->accel = -dir * s->maxAccel ;	// Time to slow down
 
-  piHiPri (50) ;
+  s->velocity += s->accel * FRAME_S ;
+  if (s->velocity >  s->maxVelocity) s->velocity =  s->maxVelocity ;
+  if (s->velocity < -s->maxVelocity) s->velocity = -s->maxVelocity ;
+
+  s->position += s->velocity * FRAME_S ;
+
+  if ((s->target - s->position) * dir < 0.0)	// Went past - it's close enough to stop
+  {
+    s->position = s->target ;
+    s->velocity = s->accel = 0.0 ;
+  }
+}
+
+
+/*
+ * softServoThread:
+ *	Thread to do the actual Servo PWM output
+ *********************************************************************************
+ */
+
+static void *softServoThread (UNU void *arg)
+{
+  struct regWrite writes [4] ;
+  int pins   [MAX_SERVOS] ;
+  int pulses [MAX_SERVOS] ;
+  int num, numWrites, pin, pulse, changed, i, j, k ;
+  uint64_t frame ;
+
+  piRealtimeThread (PI_RT_SERVO) ;
+
+  frame = piTimerNow () ;
 
   for (;;)
   {
-    gettimeofday (&tStart, NULL) ;
 
-    memcpy (myDelays, pulseWidth, sizeof (myDelays)) ;
-    memcpy (myPins,   pinMap,     sizeof (myPins)) ;
+// Take a copy of the schedule, so we can let go of the lock while the
+//	pulses are going out.
 
-// Sort the delays (& pins), shortest first
+    pthread_mutex_lock (&dataLock) ;
 
-    for (m = MAX_SERVOS / 2 ; m > 0 ; m /= 2 )
-      for (j = m ; j < MAX_SERVOS ; ++j)
-	for (i = j - m ; i >= 0 ; i -= m)
-	{
-	  k = i + m ;
-	  if (myDelays [k] >= myDelays [i])
-	    break ;
-	  else // Swap
-	  {
-	    tmp = myDelays [i] ; myDelays [i] = myDelays [k] ; myDelays [k] = tmp ;
-	    tmp = myPins   [i] ; myPins   [i] = myPins   [k] ; myPins   [k] = tmp ;
-	  }
-	}
+    if (!running)
+    {
+      pthread_mutex_unlock (&dataLock) ;
+      break ;
+    }
+
+    for (num = 0 ; num < numActive ; ++num)
+    {
+      pins   [num] = order [num] ;
+      pulses [num] = servos [order [num]].pulse ;
+    }
+
+    pthread_mutex_unlock (&dataLock) ;
 
 // All on
 
-    lastDelay = 0 ;
-    for (servo = 0 ; servo < MAX_SERVOS ; ++servo)
+    piSleepUntil (frame) ;
+
+    numWrites = 0 ;
+    for (i = 0 ; i < num ; ++i)
+      if (servos [pins [i]].fast)
+      {
+	if (piJournalActive)		// digitalWrite logs its own
+	  piJournalLog (PI_JOURNAL_DIGITAL_WRITE, pins [i], HIGH) ;
+	addWrite (writes, &numWrites, servos [pins [i]].handle.set, servos [pins [i]].handle.mask) ;
+      }
+      else
+	digitalWrite (pins [i], HIGH) ;
+    for (i = 0 ; i < numWrites ; ++i)
+      *writes [i].reg = writes [i].mask ;
+
+// Now turn them off in order, together when they're close enough
+
+    for (i = 0 ; i < num ; i = j)
     {
-      if ((pin = myPins [servo]) == -1)
-	continue ;
+      piSleepUntil (frame + (uint64_t)pulses [i] * 1000) ;
 
-      digitalWrite (pin, HIGH) ;
-      myDelays [servo] = myDelays [servo] - lastDelay ;
-      lastDelay += myDelays [servo] ;
+      numWrites = 0 ;
+      for (j = i ; (j < num) && ((uint64_t)pulses [j] * 1000 <= (uint64_t)pulses [i] * 1000 + EDGE_MERGE) ; ++j)
+	if (servos [pins [j]].fast)
+	{
+	  if (piJournalActive)
+	    piJournalLog (PI_JOURNAL_DIGITAL_WRITE, pins [j], LOW) ;
+	  addWrite (writes, &numWrites, servos [pins [j]].handle.clr, servos [pins [j]].handle.mask) ;
+	}
+	else
+	  digitalWrite (pins [j], LOW) ;
+      for (k = 0 ; k < numWrites ; ++k)
+	*writes [k].reg = writes [k].mask ;
     }
 
-// Now loop, turning them all off as required
+// In the gap: move everything on for the next frame, then sort the
+//	schedule once. Re-sorting as we go would shift servos past i and
+//	skip them for a frame.
+
+    pthread_mutex_lock (&dataLock) ;
 
-    for (servo = 0 ; servo < MAX_SERVOS ; ++servo)
+    changed = FALSE ;
+    for (i = 0 ; i < numActive ; ++i)
     {
-      if ((pin = myPins [servo]) == -1)
+      pin = order [i] ;
+      if (servos [pin].position == servos [pin].target)
 	continue ;
 
-      delayMicroseconds (myDelays [servo]) ;
-      digitalWrite (pin, LOW) ;
+      move (&servos [pin]) ;
+      pulse = (int)lround (servos [pin].position) ;
+      if (pulse != servos [pin].pulse)
+      {
+	servos [pin].pulse = pulse ;
+	changed = TRUE ;
+      }
     }
 
-// Wait until the end of an 8mS time-slot
+    if (changed)
+      sortOrder () ;
+
+    pthread_mutex_unlock (&dataLock) ;
 
-    gettimeofday (&tNow, NULL) ;
-    timersub (&tNow, &tStart, &tPeriod) ;
-    timersub (&tTotal, &tPeriod, &tGap) ;
-    tNs.tv_sec  = tGap.tv_sec ;
-    tNs.tv_nsec = tGap.tv_usec * 1000 ;
-    nanosleep (&tNs, NULL) ;
+// If we've fallen more than a whole frame behind, start again from now
+
+    frame += FRAME_NS ;
+    if (piTimerNow () > frame)
+      frame = piTimerNow () ;
   }
 
   return NULL ;
@@ -155,57 +422,240 @@ static PI_THREAD (softServoThread)
 
 /*
  * softServoWrite:
- *	Write a Servo value to the given pin
+ *	Write a Servo value to the given pin. The value is the pulse width
+ *	less 1000uS, so 0 to 1000 is the usual range. With a profile set,
+ *	this is where the servo goes to - the thread moves it there.
  *********************************************************************************
  */
 
 void softServoWrite (int servoPin, int value)
 {
-  int servo ;
+  struct servo *s ;
+
+  if ((servoPin < 0) || (servoPin >= MAX_SERVOS))
+    return ;
+
+  /**/ if (value < MIN_VALUE)
+    value = MIN_VALUE ;
+  else if (value > MAX_VALUE)
+    value = MAX_VALUE ;
 
-  servoPin &= 63 ;
+  pthread_mutex_lock (&dataLock) ;
 
-  /**/ if (value < -250)
-    value = -250 ;
-  else if (value > 1250)
-    value = 1250 ;
+  s = &servos [servoPin] ;
+  if (s->active)
+  {
+    s->target  = value + 1000 ; // uS
+    s->planned = FALSE ;
+
+    if (s->profile == SERVO_PROFILE_STEP)
+    {
+      s->position = s->target ;
+      s->pulse    = value + 1000 ;
+      reorder (servoPin) ;
+    }
+  }
 
-  for (servo = 0 ; servo < MAX_SERVOS ; ++servo)
-    if (pinMap [servo] == servoPin)
-      pulseWidth [servo] = value + 1000 ; // uS
+  pthread_mutex_unlock (&dataLock) ;
+}
+
+
+/*
+ * softServoProfile:
+ *	How a servo gets to a new value: SERVO_PROFILE_STEP goes straight
+ *	there, as it always did. SERVO_PROFILE_TRAPEZOID and _SCURVE move at
+ *	up to velocity units per second, speeding up and slowing down at
+ *	accel units per second per second.
+ *********************************************************************************
+ */
+
+int softServoProfile (int servoPin, int profile, int velocity, int accel)
+{
+  struct servo *s ;
+
+  if ((servoPin < 0) || (servoPin >= MAX_SERVOS))
+    return -1 ;
+
+  if ((profile != SERVO_PROFILE_STEP) && (profile != SERVO_PROFILE_TRAPEZOID) && (profile != SERVO_PROFILE_SCURVE))
+    return -1 ;
+
+  if ((profile != SERVO_PROFILE_STEP) && ((velocity <= 0) || (accel <= 0)))
+    return -1 ;
+
+  pthread_mutex_lock (&dataLock) ;
+
+  s = &servos [servoPin] ;
+  s->profile     = profile ;
+  s->maxVelocity = velocity ;
+  s->maxAccel    = accel ;
+  s->planned     = FALSE ;
+
+  if (s->active && (profile == SERVO_PROFILE_STEP))	// Finish any move now
+  {
+    s->position = s->target ;
+    s->velocity = s->accel = 0.0 ;
+    s->pulse    = (int)lround (s->target) ;
+    reorder (servoPin) ;
+  }
+
+  pthread_mutex_unlock (&dataLock) ;
+
+  return 0 ;
+}
+
+
+/*
+ * softServoPosition:
+ *	Where a servo is now, in the same units as softServoWrite. With a
+ *	profile set this lags the value written while it moves.
+ *********************************************************************************
+ */
+
+int softServoPosition (int servoPin)
+{
+  int value ;
+
+  if ((servoPin < 0) || (servoPin >= MAX_SERVOS))
+    return 0 ;
+
+  pthread_mutex_lock (&dataLock) ;
+  value = servos [servoPin].pulse - 1000 ;
+  pthread_mutex_unlock (&dataLock) ;
+
+  return value ;
+}
+
+
+/*
+ * softServoCreate:
+ *	Add a servo on a pin, starting at the given value. It joins the
+ *	others in the servo thread, which is started with the first one.
+ *********************************************************************************
+ */
+
+int softServoCreate (int servoPin, int value)
+{
+  struct servo *s ;
+  int res = 0, profile ;
+  double maxVelocity, maxAccel ;
+
+  if ((servoPin < 0) || (servoPin >= MAX_SERVOS))
+    return -1 ;
+
+  /**/ if (value < MIN_VALUE)
+    value = MIN_VALUE ;
+  else if (value > MAX_VALUE)
+    value = MAX_VALUE ;
+
+  pthread_mutex_lock (&controlLock) ;
+
+  if (servos [servoPin].active)	// Already running on this pin
+  {
+    pthread_mutex_unlock (&controlLock) ;
+    return -1 ;
+  }
+
+  pinMode      (servoPin, OUTPUT) ;
+  digitalWrite (servoPin, LOW) ;
+
+  pthread_mutex_lock (&dataLock) ;
+
+// A profile set before the servo was created is kept
+
+  s           = &servos [servoPin] ;
+  profile     = s->profile ;
+  maxVelocity = s->maxVelocity ;
+  maxAccel    = s->maxAccel ;
+
+  memset (s, 0, sizeof (*s)) ;
+  s->active      = TRUE ;
+  s->profile     = profile ;
+  s->maxVelocity = maxVelocity ;
+  s->maxAccel    = maxAccel ;
+  s->pulse       = value + 1000 ;
+  s->target      = s->position = s->pulse ;
+  s->fast        = wiringPiGetPinHandle (servoPin, &s->handle) == 0 ;
+
+  order [numActive++] = servoPin ;
+  reorder (servoPin) ;
+
+  pthread_mutex_unlock (&dataLock) ;
+
+  if (!running)
+  {
+    running = TRUE ;
+    if ((res = piClockThreadCreate (&engine, softServoThread, NULL)) != 0)
+    {
+      running   = FALSE ;
+      numActive = 0 ;
+      servos [servoPin].active = FALSE ;
+    }
+  }
+
+  pthread_mutex_unlock (&controlLock) ;
+
+  return res ;
+}
+
+
+/*
+ * softServoStop:
+ *	Stop driving a servo. When the last one goes, so does the thread.
+ *********************************************************************************
+ */
+
+void softServoStop (int servoPin)
+{
+  int i, j ;
+
+  if ((servoPin < 0) || (servoPin >= MAX_SERVOS))
+    return ;
+
+  pthread_mutex_lock (&controlLock) ;
+
+  if (servos [servoPin].active)
+  {
+    pthread_mutex_lock (&dataLock) ;
+
+    for (i = j = 0 ; i < numActive ; ++i)
+      if (order [i] != servoPin)
+	order [j++] = order [i] ;
+    numActive = j ;
+    servos [servoPin].active = FALSE ;
+
+    if (numActive == 0)
+      running = FALSE ;
+
+    pthread_mutex_unlock (&dataLock) ;
+
+    if (!running)
+      piClockJoin (engine, NULL) ;
+
+    digitalWrite (servoPin, LOW) ;
+  }
+
+  pthread_mutex_unlock (&controlLock) ;
 }
 
 
 /*
  * softServoSetup:
- *	Setup the software servo system
+ *	Setup the software servo system. The original 8 servo interface -
+ *	any of the pins can be -1 for none.
  *********************************************************************************
  */
 
 int softServoSetup (int p0, int p1, int p2, int p3, int p4, int p5, int p6, int p7)
 {
-  int servo ;
-
-  if (p0 != -1) { pinMode (p0, OUTPUT) ; digitalWrite (p0, LOW) ; }
-  if (p1 != -1) { pinMode (p1, OUTPUT) ; digitalWrite (p1, LOW) ; }
-  if (p2 != -1) { pinMode (p2, OUTPUT) ; digitalWrite (p2, LOW) ; }
-  if (p3 != -1) { pinMode (p3, OUTPUT) ; digitalWrite (p3, LOW) ; }
-  if (p4 != -1) { pinMode (p4, OUTPUT) ; digitalWrite (p4, LOW) ; }
-  if (p5 != -1) { pinMode (p5, OUTPUT) ; digitalWrite (p5, LOW) ; }
-  if (p6 != -1) { pinMode (p6, OUTPUT) ; digitalWrite (p6, LOW) ; }
-  if (p7 != -1) { pinMode (p7, OUTPUT) ; digitalWrite (p7, LOW) ; }
-
-  pinMap [0] = p0 ;
-  pinMap [1] = p1 ;
-  pinMap [2] = p2 ;
-  pinMap [3] = p3 ;
-  pinMap [4] = p4 ;
-  pinMap [5] = p5 ;
-  pinMap [6] = p6 ;
-  pinMap [7] = p7 ;
-
-  for (servo = 0 ; servo < MAX_SERVOS ; ++servo)
-    pulseWidth [servo] = 1500 ;		// Mid point
-  
-  return piThreadCreate (softServoThread) ;
+  int pins [8] ;
+  int i ;
+
+  pins [0] = p0 ; pins [1] = p1 ; pins [2] = p2 ; pins [3] = p3 ;
+  pins [4] = p4 ; pins [5] = p5 ; pins [6] = p6 ; pins [7] = p7 ;
+
+  for (i = 0 ; i < 8 ; ++i)
+    if ((pins [i] != -1) && (softServoCreate (pins [i], 500) != 0))	// Mid point
+      return -1 ;
+
+  return 0 ;
 }
@@ -5,6 +5,10 @@
  *	one (or 2) GPIO pins and a piezeo "speaker" element.
  *	(Or a high impedance speaker, but don'y blame me if you blow-up
  *	the GPIO pins!)
+ *	One thread drives every tone pin, and can play a whole tune on each
+ *	from a list of notes while the caller gets on with something else.
+ *	Pins that can do hardware PWM get their tone from that instead, and
+ *	the thread only has to change the note.
  *	Copyright (c) 2012 Gordon Henderson
  ***********************************************************************
  * This file is part of wiringPi:
@@ -27,55 +31,300 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "../include/wiringPi.h"
 #include "../include/softTone.h"
+#include "../include/piTimer.h"
+#include "../include/piStats.h"
+#include "../include/piJournal.h"
 
 #define	MAX_PINS	64
 
-#define	PULSE_TIME	100
+#define	MAX_FREQ	5000
 
-static int freqs         [MAX_PINS] ;
-static pthread_t threads [MAX_PINS] ;
+// Events due within this long of each other are handled together
 
-static int newPin = -1 ;
+#define	EDGE_MERGE	1000
+
+#define	NEVER		UINT64_MAX
+
+// Further off than this, the thread waits on a condition and can be woken
+//	early - nearer, it uses piSleepUntil for the accuracy.
+
+#define	LONG_WAIT	2000000
+
+struct tone
+{
+  volatile int freq ;		// As last written, or from the current note
+  int          active ;
+  int          hw ;		// PWM channel playing it, or -1 if we are
+  int          level ;
+  uint64_t     edge ;		// When the next edge is due, NEVER if silent
+  uint64_t     next ;		// Next thing to do - edge or end of note
+
+// Sequence being played, if any
+
+  struct softToneNote *notes ;
+  int                  numNotes ;
+  int                  note ;
+  uint64_t             noteEnd ;
+  void               (*done)(int pin, void *arg) ;
+  void                *arg ;
+
+  int                      fast ;
+  struct wiringPiPinHandle handle ;
+} ;
+
+struct finished
+{
+  int    pin ;
+  void (*done)(int pin, void *arg) ;
+  void  *arg ;
+} ;
+
+static struct tone tones [MAX_PINS] ;
+static int         order [MAX_PINS] ;	// Active pins, soonest first
+static int         numActive ;
+
+static pthread_mutex_t dataLock    = PTHREAD_MUTEX_INITIALIZER ;	// The above
+static pthread_mutex_t controlLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP ;	// Create/stop - pinMode calls softToneStop
+static pthread_cond_t  changed ;
+static pthread_once_t  changedOnce = PTHREAD_ONCE_INIT ;
+static pthread_t       engine ;
+static int             running ;
+static uint64_t        sleepingUntil ;
 
 
 /*
- * softToneThread:
- *	Thread to do the actual PWM output
+ * sortOrder:
+ *	Insertion sort on the next event time, as softPwm does.
  *********************************************************************************
  */
 
-static PI_THREAD (softToneThread)
+static void sortOrder (void)
 {
-  int pin, freq, halfPeriod ;
-  struct sched_param param ;
+  int i, j, pin ;
 
-  param.sched_priority = sched_get_priority_max (SCHED_RR) ;
-  pthread_setschedparam (pthread_self (), SCHED_RR, &param) ;
+  for (i = 1 ; i < numActive ; ++i)
+  {
+    pin = order [i] ;
+    for (j = i ; (j > 0) && (tones [order [j - 1]].next > tones [pin].next) ; --j)
+      order [j] = order [j - 1] ;
+    order [j] = pin ;
+  }
+}
 
-  pin    = newPin ;
-  newPin = -1 ;
 
-  piHiPri (50) ;
+/*
+ * setNext:
+ *	Work out when a pin next needs us
+ *********************************************************************************
+ */
 
-  for (;;)
+static void setNext (struct tone *t)
+{
+  t->next = t->edge ;
+  if ((t->notes != NULL) && (t->noteEnd < t->next))
+    t->next = t->noteEnd ;
+}
+
+
+/*
+ * wakeAt:
+ *	The earliest a pin can have its next edge if we're changing it from
+ *	outside the thread - which might be asleep until then.
+ *********************************************************************************
+ */
+
+static uint64_t wakeAt (void)
+{
+  uint64_t now = piTimerNow () ;
+
+  return (running && (sleepingUntil > now)) ? sleepingUntil : now ;
+}
+
+
+/*
+ * changedInit:
+ *	The condition the thread waits on is timed against CLOCK_MONOTONIC,
+ *	the same as piTimerNow.
+ *********************************************************************************
+ */
+
+static void changedInit (void)
+{
+  pthread_condattr_t attr ;
+
+  pthread_condattr_init     (&attr) ;
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC) ;
+  pthread_cond_init         (&changed, &attr) ;
+  pthread_condattr_destroy  (&attr) ;
+}
+
+
+/*
+ * endSequence:
+ *	Drop the notes a pin was playing. The callback isn't made here.
+ *********************************************************************************
+ */
+
+static void endSequence (struct tone *t)
+{
+  free (t->notes) ;
+  t->notes    = NULL ;
+  t->numNotes = 0 ;
+  t->done     = NULL ;
+  t->arg      = NULL ;
+}
+
+
+/*
+ * service:
+ *	Do whatever is due on a pin. A change of frequency - written or from
+ *	the next note - takes effect at the next edge, so the waveform never
+ *	gets a runt half cycle.
+ *********************************************************************************
+ */
+
+static void service (int pin, uint64_t now, struct finished *fin, int *numFin)
+{
+  struct tone *t = &tones [pin] ;
+  uint64_t halfPeriod ;
+  int freq ;
+
+// Move on through the notes. Zero length notes are skipped.
+
+  while ((t->notes != NULL) && (t->noteEnd <= now + EDGE_MERGE))
+  {
+    if (++t->note >= t->numNotes)
+    {
+      t->freq = 0 ;
+      fin [*numFin].pin  = pin ;
+      fin [*numFin].done = t->done ;
+      fin [*numFin].arg  = t->arg ;
+      ++*numFin ;
+      endSequence (t) ;
+      break ;
+    }
+    t->freq     = t->notes [t->note].freq ;
+    t->noteEnd += (uint64_t)t->notes [t->note].durationMs * 1000000 ;
+    if (t->hw >= 0)
+      pwmToneWrite (pin, t->freq) ;
+    else if ((t->freq != 0) && (t->edge == NEVER))
+      t->edge = now ;
+  }
+
+  if ((t->hw >= 0) && (t->notes == NULL))
+    pwmToneWrite (pin, 0) ;
+
+  if (t->edge <= now + EDGE_MERGE)
   {
-    freq = freqs [pin] ;
-    if (freq == 0)
-      delay (1) ;
+    freq = t->freq ;
+    if (freq == 0)			// Silent - leave the pin low until it's wanted again
+    {
+      t->edge = NEVER ;
+      if (t->level == LOW)
+      {
+	setNext (t) ;
+	return ;
+      }
+      t->level = LOW ;
+    }
     else
     {
-      halfPeriod = 500000 / freq ;
+      halfPeriod = (uint64_t)500000000 / (uint64_t)freq ;
+
+      if (now > t->edge + 2 * halfPeriod)	// Fell behind - don't try to catch up
+      {
+	PI_STAT_INC (PI_STAT_SOFT_TONE_OVERRUN) ;
+	t->edge = now ;
+      }
+
+      t->level  = !t->level ;
+      t->edge  += halfPeriod ;
+    }
+
+    if (t->fast && piJournalActive)		// digitalWrite logs its own
+      piJournalLog (PI_JOURNAL_DIGITAL_WRITE, pin, t->level) ;
+
+    /**/ if (!t->fast)
+      digitalWrite (pin, t->level) ;
+    else if (t->level == HIGH)
+      *t->handle.set = t->handle.mask ;
+    else
+      *t->handle.clr = t->handle.mask ;
+  }
+
+  setNext (t) ;
+}
+
+
+/*
+ * softToneThread:
+ *	Thread to do the actual tone output, for all the pins.
+ *********************************************************************************
+ */
+
+static void *softToneThread (UNU void *arg)
+{
+  struct finished fin [MAX_PINS] ;
+  int numFin, i ;
+  uint64_t now, due ;
+
+  piRealtimeThread (PI_RT_TONE) ;
+
+  for (;;)
+  {
+    pthread_mutex_lock (&dataLock) ;
+
+    if (!running)
+    {
+      pthread_mutex_unlock (&dataLock) ;
+      break ;
+    }
+
+    now = piTimerNow () ;
+    due = (numActive == 0) ? NEVER : tones [order [0]].next ;
 
-      digitalWrite (pin, HIGH) ;
-      delayMicroseconds (halfPeriod) ;
+// A long way off, wait to be told about any change before then. Close to,
+//	nothing can be brought forward of sleepingUntil, so just sleep.
 
-      digitalWrite (pin, LOW) ;
-      delayMicroseconds (halfPeriod) ;
+    if (due > now + LONG_WAIT)
+    {
+      sleepingUntil = 0 ;
+      if (due == NEVER)
+	piClockCondWait (&changed, &dataLock, PI_CLOCK_NEVER) ;
+      else
+	piClockCondWait (&changed, &dataLock, due - LONG_WAIT / 2) ;
+      pthread_mutex_unlock (&dataLock) ;
+      continue ;
     }
+
+    if (due > now)
+    {
+      sleepingUntil = due ;
+      pthread_mutex_unlock (&dataLock) ;
+      piSleepUntil (due) ;
+      continue ;
+    }
+
+    numFin = 0 ;
+    for (i = 0 ; (i < numActive) && (tones [order [i]].next <= now + EDGE_MERGE) ; ++i)
+      service (order [i], now, fin, &numFin) ;
+
+    sortOrder () ;
+    pthread_mutex_unlock (&dataLock) ;
+
+// Callbacks are made without the lock, so they can start the next tune
+
+    for (i = 0 ; i < numFin ; ++i)
+      if (fin [i].done != NULL)
+	fin [i].done (fin [i].pin, fin [i].arg) ;
   }
 
   return NULL ;
@@ -84,49 +333,209 @@ static PI_THREAD (softToneThread)
 
 /*
  * softToneWrite:
- *	Write a frequency value to the given pin
+ *	Write a frequency value to the given pin. This stops any sequence
+ *	the pin is playing, without calling its callback.
  *********************************************************************************
  */
 
 void softToneWrite (int pin, int freq)
 {
-  pin &= 63 ;
+  struct tone *t ;
+
+  if ((pin < 0) || (pin >= MAX_PINS))
+    return ;
 
   /**/ if (freq < 0)
     freq = 0 ;
-  else if (freq > 5000)	// Max 5KHz
-    freq = 5000 ;
+  else if (freq > MAX_FREQ)	// Max 5KHz
+    freq = MAX_FREQ ;
+
+  pthread_mutex_lock (&dataLock) ;
+
+  t = &tones [pin] ;
+  t->freq = freq ;
+  if (t->active)
+  {
+    if (t->notes != NULL)
+      endSequence (t) ;
+    if (t->hw >= 0)
+      pwmToneWrite (pin, freq) ;
+    else if ((freq != 0) && (t->edge == NEVER))
+      t->edge = wakeAt () ;
+    setNext   (t) ;
+    sortOrder () ;
+    piClockCondSignal (&changed) ;
+  }
 
-  freqs [pin] = freq ;
+  pthread_mutex_unlock (&dataLock) ;
+}
+
+
+/*
+ * softToneSequence:
+ *	Play a list of notes on a pin and return straight away. The notes
+ *	are copied. When the last one has finished the pin goes quiet and
+ *	done, if given, is called from the tone thread - it may start
+ *	another sequence, but mustn't call softToneStop. A new sequence
+ *	replaces any the pin is already playing.
+ *********************************************************************************
+ */
+
+int softToneSequence (int pin, const struct softToneNote *notes, int count, void (*done)(int pin, void *arg), void *arg)
+{
+  struct softToneNote *copy ;
+  struct tone *t ;
+  uint64_t start ;
+  int i ;
+
+  if ((pin < 0) || (pin >= MAX_PINS) || (notes == NULL) || (count <= 0))
+    return -1 ;
+
+  if (!tones [pin].active && (softToneCreate (pin) != 0))
+    return -1 ;
+
+  if ((copy = malloc (sizeof (*copy) * (size_t)count)) == NULL)
+    return -1 ;
+
+  for (i = 0 ; i < count ; ++i)
+  {
+    copy [i] = notes [i] ;
+    /**/ if (copy [i].freq < 0)
+      copy [i].freq = 0 ;
+    else if (copy [i].freq > MAX_FREQ)
+      copy [i].freq = MAX_FREQ ;
+  }
+
+  pthread_mutex_lock (&dataLock) ;
+
+  t = &tones [pin] ;
+  if (t->notes != NULL)
+    endSequence (t) ;
+
+  t->notes    = copy ;
+  t->numNotes = count ;
+  t->note     = 0 ;
+  t->done     = done ;
+  t->arg      = arg ;
+  t->freq     = copy [0].freq ;
+  start       = wakeAt () ;
+  t->noteEnd  = start + (uint64_t)copy [0].durationMs * 1000000 ;
+  if (t->hw >= 0)
+    pwmToneWrite (pin, t->freq) ;
+  else if ((t->freq != 0) && (t->edge == NEVER))
+    t->edge = start ;
+  setNext   (t) ;
+  sortOrder () ;
+  piClockCondSignal (&changed) ;
+
+  pthread_mutex_unlock (&dataLock) ;
+
+  return 0 ;
+}
+
+
+/*
+ * hardwareChannel:
+ *	The PWM channel to play a pin's tone on, or -1 to do it ourselves.
+ *	Each channel can only play one tone. Setting WIRINGPI_SOFT_TONE in
+ *	the environment keeps us off the PWM hardware altogether, for
+ *	programs that use it for something else.
+ *********************************************************************************
+ */
+
+static int hardwareChannel (int pin)
+{
+  int channel, i ;
+
+  if (getenv ("WIRINGPI_SOFT_TONE") != NULL)
+    return -1 ;
+
+  if ((channel = pwmToneChannel (pin)) < 0)
+    return -1 ;
+
+  for (i = 0 ; i < numActive ; ++i)
+    if (tones [order [i]].hw == channel)
+      return -1 ;
+
+  return channel ;
 }
 
 
 /*
  * softToneCreate:
- *	Create a new tone thread.
+ *	Make a pin a tone pin. It joins the others in the tone thread,
+ *	which is started with the first one.
  *********************************************************************************
  */
 
 int softToneCreate (int pin)
 {
-  int res ;
-  pthread_t myThread ;
+  struct tone *t ;
+  int res = 0, hw, i ;
+
+  if ((pin < 0) || (pin >= MAX_PINS))
+    return -1 ;
+
+  pthread_once (&changedOnce, changedInit) ;
 
-  pinMode      (pin, OUTPUT) ;
-  digitalWrite (pin, LOW) ;
+  pthread_mutex_lock (&controlLock) ;
 
-  if (threads [pin] != 0)
+  if (tones [pin].active)	// Already running on this pin
+  {
+    pthread_mutex_unlock (&controlLock) ;
     return -1 ;
+  }
+
+  pthread_mutex_lock (&dataLock) ;
+  hw = hardwareChannel (pin) ;
+  pthread_mutex_unlock (&dataLock) ;
+
+  if (hw >= 0)
+  {
+    pinMode      (pin, PWM_TONE_OUTPUT) ;
+    pwmToneWrite (pin, 0) ;
+  }
+  else
+  {
+    pinMode      (pin, OUTPUT) ;
+    digitalWrite (pin, LOW) ;
+  }
+
+  pthread_mutex_lock (&dataLock) ;
+
+// Setting up PWM resets both channels, so put back the tone on the other
+
+  if (hw >= 0)
+    for (i = 0 ; i < numActive ; ++i)
+      if (tones [order [i]].hw >= 0)
+	pwmToneWrite (order [i], tones [order [i]].freq) ;
+
+  t = &tones [pin] ;
+  memset (t, 0, sizeof (*t)) ;
+  t->active = TRUE ;
+  t->hw     = hw ;
+  t->level  = LOW ;
+  t->edge   = NEVER ;
+  t->fast   = wiringPiGetPinHandle (pin, &t->handle) == 0 ;
+  setNext (t) ;
 
-  freqs [pin] = 0 ;
+  order [numActive++] = pin ;
+  sortOrder () ;
 
-  newPin = pin ;
-  res    = pthread_create (&myThread, NULL, softToneThread, NULL) ;
+  pthread_mutex_unlock (&dataLock) ;
 
-  while (newPin != -1)
-    delay (1) ;
+  if (!running)
+  {
+    running = TRUE ;
+    if ((res = piClockThreadCreate (&engine, softToneThread, NULL)) != 0)
+    {
+      running   = FALSE ;
+      numActive = 0 ;
+      tones [pin].active = FALSE ;
+    }
+  }
 
-  threads [pin] = myThread ;
+  pthread_mutex_unlock (&controlLock) ;
 
   return res ;
 }
@@ -134,17 +543,48 @@ int softToneCreate (int pin)
 
 /*
  * softToneStop:
- *	Stop an existing softTone thread
+ *	Stop tone output on a pin. When the last one goes, so does the
+ *	thread.
  *********************************************************************************
  */
 
 void softToneStop (int pin)
 {
-  if (threads [pin] != 0)
+  int i, j ;
+
+  if ((pin < 0) || (pin >= MAX_PINS))
+    return ;
+
+  pthread_mutex_lock (&controlLock) ;
+
+  if (tones [pin].active)
   {
-    pthread_cancel (threads [pin]) ;
-    pthread_join   (threads [pin], NULL) ;
-    threads [pin] = 0 ;
+    pthread_mutex_lock (&dataLock) ;
+
+    for (i = j = 0 ; i < numActive ; ++i)
+      if (order [i] != pin)
+	order [j++] = order [i] ;
+    numActive = j ;
+    tones [pin].active = FALSE ;
+    tones [pin].freq   = 0 ;
+    endSequence (&tones [pin]) ;
+
+    if (numActive == 0)
+      running = FALSE ;
+
+    piClockCondSignal (&changed) ;
+    pthread_mutex_unlock (&dataLock) ;
+
+    if (tones [pin].hw >= 0)		// Back to a plain output
+    {
+      pwmToneWrite (pin, 0) ;
+      pinMode      (pin, OUTPUT) ;
+    }
     digitalWrite (pin, LOW) ;
+
+    if (!running)
+      piClockJoin (engine, NULL) ;
   }
+
+  pthread_mutex_unlock (&controlLock) ;
 }
@@ -3,8 +3,11 @@
  *	Extend wiringPi with the 74x595 shift register as a GPIO
  *	expander chip.
  *	Note that the code can cope with a number of 595's
- *	daisy-chained together - up to 4 for now as we're storing
- *	the output "register" in a single unsigned int.
+ *	daisy-chained together - up to SR595_MAX_PINS outputs.
+ *	The chain is either bit-banged on any 3 pins, or clocked out
+ *	in one transfer on the SPI bus with sr595SPISetup.
+ *	Use wiringPiBegin ()/wiringPiCommit () around a group of writes
+ *	to shift the chain out once rather than once per write.
  *
  *	Copyright (c) 2013 Gordon Henderson
  ***********************************************************************
@@ -29,50 +32,130 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../include/wiringPi.h"
+#include "../include/wiringPiSPI.h"
+#include "../include/wiringShift.h"
 
 #include "../include/sr595.h"
 
+#define	SR595_BB_SPEED	1000000
+#define	SR595_SPI_SPEED	4000000
+
+// sr595State:
+//	The output register is kept as it's shifted out - the first byte goes
+//	out first and ends up at the far end of the chain, so pin 0 is the
+//	bottom bit of the last byte. If the pin count isn't a multiple of 8
+//	the spare bits are at the top of the first byte and fall off the end.
+
+struct sr595State
+{
+  int              bytes ;
+  int              latchPin ;	// -1 when SPI CE is wired to the latch
+  int              spiChannel ;	// -1 when bit-banging
+  struct shiftBus  bus ;
+  uint8_t         *spiBuf ;
+  uint8_t          output [] ;
+} ;
+
+
+/*
+ * shiftChain:
+ *	Send the output register to the chain of shift registers
+ *********************************************************************************
+ */
+
+static void shiftChain (struct wiringPiNodeStruct *node)
+{
+  struct sr595State *sr = (struct sr595State *)node->dataPtr ;
+
+// A low -> high latch transition copies the latch to the output pins
+
+  if (sr->latchPin >= 0)
+    digitalWrite (sr->latchPin, LOW) ;
+
+  if (sr->spiChannel >= 0)
+  {
+    memcpy (sr->spiBuf, sr->output, sr->bytes) ;	// wiringPiSPIDataRW overwrites it
+    wiringPiSPIDataRW (sr->spiChannel, sr->spiBuf, sr->bytes) ;
+  }
+  else
+    shiftBusTransfer (&sr->bus, sr->output, NULL, sr->bytes) ;
+
+  if (sr->latchPin >= 0)
+    digitalWrite (sr->latchPin, HIGH) ;
+}
+
 
 /*
  * myDigitalWrite:
+ *	Between wiringPiBegin () and wiringPiCommit () this just updates the
+ *	output register, and it's all shifted out once at the commit.
  *********************************************************************************
  */
 
 static void myDigitalWrite (struct wiringPiNodeStruct *node, int pin, int value)
 {
-  unsigned int mask ;
-  int  dataPin, clockPin, latchPin ;
-  int  bit, bits, output ;
+  struct sr595State *sr = (struct sr595State *)node->dataPtr ;
+  uint8_t *byte ;
+  uint8_t  mask ;
 
-  pin     -= node->pinBase ;				// Normalise pin number
-  bits     = node->pinMax - node->pinBase + 1 ;		// ie. number of clock pulses
-  dataPin  = node->data0 ;
-  clockPin = node->data1 ;
-  latchPin = node->data2 ;
-  output   = node->data3 ;
+  pin -= node->pinBase ;				// Normalise pin number
 
-  mask = 1 << pin ;
+  byte = &sr->output [sr->bytes - 1 - pin / 8] ;
+  mask = 1 << (pin & 7) ;
 
   if (value == LOW)
-    output &= (~mask) ;
+    *byte &= ~mask ;
   else
-    output |=   mask ;
+    *byte |=  mask ;
 
-  node->data3 = output ;
+  if (wiringPiBatching)
+    node->dirty = 1 ;
+  else
+    shiftChain (node) ;
+}
 
-// A low -> high latch transition copies the latch to the output pins
 
-  digitalWrite (latchPin, LOW) ; delayMicroseconds (1) ;
-    for (bit = bits - 1 ; bit >= 0 ; --bit)
-    {
-      digitalWrite (dataPin, output & (1 << bit)) ;
+/*
+ * newChain:
+ *	Allocate the state and the node for a chain of numPins outputs
+ *********************************************************************************
+ */
 
-      digitalWrite (clockPin, HIGH) ; delayMicroseconds (1) ;
-      digitalWrite (clockPin, LOW) ;  delayMicroseconds (1) ;
-    }
-  digitalWrite (latchPin, HIGH) ; delayMicroseconds (1) ;
+static struct wiringPiNodeStruct *newChain (const int pinBase, const int numPins, const int latchPin, const int spiChannel)
+{
+  struct wiringPiNodeStruct *node ;
+  struct sr595State *sr ;
+  int bytes ;
+
+  if ((numPins < 1) || (numPins > SR595_MAX_PINS))
+    return NULL ;
+
+  bytes = (numPins + 7) / 8 ;
+
+  if ((sr = calloc (sizeof (struct sr595State) + bytes, 1)) == NULL)
+    return NULL ;
+
+  if ((spiChannel >= 0) && ((sr->spiBuf = malloc (bytes)) == NULL))
+  {
+    free (sr) ;
+    return NULL ;
+  }
+
+  sr->bytes      = bytes ;
+  sr->latchPin   = latchPin ;
+  sr->spiChannel = spiChannel ;
+
+  node = wiringPiNewNode (pinBase, numPins) ;
+
+  node->dataPtr         = sr ;
+  node->digitalWrite    = myDigitalWrite ;
+  node->flush           = shiftChain ;
+
+  return node ;
 }
 
 
@@ -86,14 +169,12 @@ int sr595Setup (const int pinBase, const int numPins,
 	const int dataPin, const int clockPin, const int latchPin) 
 {
   struct wiringPiNodeStruct *node ;
+  struct sr595State *sr ;
 
-  node = wiringPiNewNode (pinBase, numPins) ;
+  if ((node = newChain (pinBase, numPins, latchPin, -1)) == NULL)
+    return FALSE ;
 
-  node->data0           = dataPin ;
-  node->data1           = clockPin ;
-  node->data2           = latchPin ;
-  node->data3           = 0 ;		// Output register
-  node->digitalWrite    = myDigitalWrite ;
+  sr = (struct sr595State *)node->dataPtr ;
 
 // Initialise the underlying hardware
 
@@ -105,5 +186,34 @@ int sr595Setup (const int pinBase, const int numPins,
   pinMode (clockPin, OUTPUT) ;
   pinMode (latchPin, OUTPUT) ;
 
+  shiftBusSetup (&sr->bus, dataPin, -1, clockPin, SHIFT_MODE_0, MSBFIRST, SR595_BB_SPEED) ;
+
+  return TRUE ;
+}
+
+
+/*
+ * sr595SPISetup:
+ *	As above, but with the chain on the SPI bus: MOSI to the data in of
+ *	the first 595 and SCLK to the shift clocks. latchPin may be -1 if the
+ *	SPI chip enable is wired to the latch - it goes high at the end of
+ *	the transfer, which is just what the latch wants.
+ *********************************************************************************
+ */
+
+int sr595SPISetup (const int pinBase, const int numPins, const int spiChannel, const int latchPin)
+{
+  if (wiringPiSPISetup (spiChannel, SR595_SPI_SPEED) < 0)
+    return FALSE ;
+
+  if (latchPin >= 0)
+  {
+    digitalWrite (latchPin, HIGH) ;
+    pinMode      (latchPin, OUTPUT) ;
+  }
+
+  if (newChain (pinBase, numPins, latchPin, spiChannel) == NULL)
+    return FALSE ;
+
   return TRUE ;
 }
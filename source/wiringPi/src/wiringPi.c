@@ -73,6 +73,9 @@
 
 #include "../include/softPwm.h"
 #include "../include/softTone.h"
+#include "../include/piTimer.h"
+#include "../include/piJournal.h"
+#include "../include/piStats.h"
 
 #include "../include/wiringPi.h"
 #include "../version.h"
@@ -82,6 +85,8 @@
 #define	ENV_DEBUG	"WIRINGPI_DEBUG"
 #define	ENV_CODES	"WIRINGPI_CODES"
 #define	ENV_GPIOMEM	"WIRINGPI_GPIOMEM"
+#define	ENV_JOURNAL	"WIRINGPI_JOURNAL"
+#define	ENV_JOURNAL_SIZE "WIRINGPI_JOURNAL_SIZE"
 
 
 // Extend wiringPi with other pin-based devices and keep track of
@@ -89,6 +94,10 @@
 
 struct wiringPiNodeStruct *wiringPiNodes = NULL ;
 
+// Non-zero while inside wiringPiBegin () / wiringPiCommit ()
+
+int wiringPiBatching = 0 ;
+
 // BCM Magic
 
 #define	BCM_PASSWORD		0x5A000000
@@ -134,12 +143,14 @@ static volatile unsigned int GPIO_PADS ;
 static volatile unsigned int GPIO_CLOCK_BASE ;
 static volatile unsigned int GPIO_BASE ;
 static volatile unsigned int GPIO_TIMER ;
+static volatile unsigned int GPIO_SYSTIMER ;
 static volatile unsigned int GPIO_PWM ;
 
 #define	PAGE_SIZE		(4*1024)
 #define	BLOCK_SIZE		(4*1024)
 
 static unsigned int usingGpioMem    = FALSE ;
+static          int memFd           = -1 ;
 static          int wiringPiSetuped = FALSE ;
 
 // PWM
@@ -186,6 +197,12 @@ static          int wiringPiSetuped = FALSE ;
 #define	TIMER_PRE_DIV	(0x41C >> 2)
 #define	TIMER_COUNTER	(0x420 >> 2)
 
+// System Timer
+//	A free-running 64-bit 1MHz counter, not affected by the core clock
+
+#define	SYSTIMER_CLO	(0x04 >> 2)
+#define	SYSTIMER_CHI	(0x08 >> 2)
+
 // Locals to hold pointers to the hardware
 
 static volatile unsigned int *gpio ;
@@ -194,6 +211,7 @@ static volatile unsigned int *clk ;
 static volatile unsigned int *pads ;
 static volatile unsigned int *timer ;
 static volatile unsigned int *timerIrqRaw ;
+static volatile unsigned int *sysTimer ;
 
 // Export variables for the hardware pointers
 
@@ -298,7 +316,7 @@ const int piMemorySize [8] =
 
 // Time for easy calculations
 
-static uint64_t epochMilli, epochMicro ;
+static uint64_t epochNanos, epochSysTimer ;
 
 // Misc
 
@@ -709,6 +727,62 @@ static void usingGpioMemCheck (const char *what)
 }
 
 
+/*
+ * mapPeripheral:
+ *	The PWM, clock and pads blocks are only mapped the first time
+ *	something needs them. Most programs never go near them, and it
+ *	saves wiringPiSetup three mmap () calls.
+ *********************************************************************************
+ */
+
+static pthread_mutex_t mapMutex = PTHREAD_MUTEX_INITIALIZER ;
+
+static void mapPeripheral (volatile unsigned int **block, volatile unsigned int **exported, unsigned int base, const char *what)
+{
+  void *map ;
+
+  pthread_mutex_lock (&mapMutex) ;
+    if (*block == NULL)
+    {
+      if (memFd < 0)
+      {
+	pthread_mutex_unlock (&mapMutex) ;
+	(void)wiringPiFailure (WPI_FATAL, "wiringPi: %s used before wiringPiSetup\n", what) ;
+	return ;
+      }
+
+      map = mmap (0, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, memFd, base) ;
+      if (map == MAP_FAILED)
+      {
+	pthread_mutex_unlock (&mapMutex) ;
+	(void)wiringPiFailure (WPI_FATAL, "wiringPi: mmap (%s) failed: %s\n", what, strerror (errno)) ;
+	return ;
+      }
+
+      *exported = *block = (volatile unsigned int *)map ;
+    }
+  pthread_mutex_unlock (&mapMutex) ;
+}
+
+static inline void mapPwm (void)
+{
+  if (pwm == NULL)
+    mapPeripheral (&pwm, &_wiringPiPwm, GPIO_PWM, "PWM") ;
+}
+
+static inline void mapClk (void)
+{
+  if (clk == NULL)
+    mapPeripheral (&clk, &_wiringPiClk, GPIO_CLOCK_BASE, "CLOCK") ;
+}
+
+static inline void mapPads (void)
+{
+  if (pads == NULL)
+    mapPeripheral (&pads, &_wiringPiPads, GPIO_PADS, "PADS") ;
+}
+
+
 
 /*
  * piGpioLayout:
@@ -744,15 +818,42 @@ static void piGpioLayoutOops (const char *why)
   exit (EXIT_FAILURE) ;
 }
 
-int piGpioLayout (void)
+/*
+ * piRevision: readRevision:
+ *	Return the board revision code as the hex string that appears on the
+ *	Revision line of /proc/cpuinfo. It's read once, under pthread_once, and kept.
+ *
+ *	The device tree has it as a single big-endian 32-bit number, which is
+ *	much quicker to get at than reading through /proc/cpuinfo - so we try
+ *	there first and only fall back to cpuinfo if it's not there.
+ *********************************************************************************
+ */
+
+static pthread_once_t revisionOnce = PTHREAD_ONCE_INIT ;
+static char           revision [20] ;
+
+static void readRevision (void)
 {
   FILE *cpuFd ;
   char line [120] ;
   char *c ;
-  static int  gpioLayout = -1 ;
+  uint8_t dtRev [4] ;
+  int fd ;
 
-  if (gpioLayout != -1)	// No point checking twice
-    return gpioLayout ;
+  if ((fd = open ("/proc/device-tree/system/linux,revision", O_RDONLY | O_CLOEXEC)) >= 0)
+  {
+    if (read (fd, dtRev, 4) == 4)
+      snprintf (revision, sizeof (revision), "%04x",
+	((unsigned int)dtRev [0] << 24) | ((unsigned int)dtRev [1] << 16) | ((unsigned int)dtRev [2] << 8) | (unsigned int)dtRev [3]) ;
+    close (fd) ;
+
+    if (revision [0] != 0)
+    {
+      if (wiringPiDebug)
+	printf ("piRevision: Device tree revision: %s\n", revision) ;
+      return ;
+    }
+  }
 
   if ((cpuFd = fopen ("/proc/cpuinfo", "r")) == NULL)
     piGpioLayoutOops ("Unable to open /proc/cpuinfo") ;
@@ -769,7 +870,7 @@ int piGpioLayout (void)
     piGpioLayoutOops ("No \"Hardware\" line") ;
 
   if (wiringPiDebug)
-    printf ("piGpioLayout: Hardware: %s\n", line) ;
+    printf ("piRevision: Hardware: %s\n", line) ;
 
 // See if it's BCM2708 or BCM2709 or the new BCM2835.
 
@@ -830,7 +931,7 @@ int piGpioLayout (void)
     *c = 0 ;
 
   if (wiringPiDebug)
-    printf ("piGpioLayout: Revision string: %s\n", line) ;
+    printf ("piRevision: Revision string: %s\n", line) ;
 
 // Scan to the first character of the revision number
 
@@ -855,6 +956,25 @@ int piGpioLayout (void)
   if (strlen (c) < 4)
     piGpioLayoutOops ("Bogus revision line (too small)") ;
 
+  snprintf (revision, sizeof (revision), "%s", c) ;
+}
+
+static const char *piRevision (void)
+{
+  pthread_once (&revisionOnce, readRevision) ;
+  return revision ;
+}
+
+int piGpioLayout (void)
+{
+  const char *c ;
+  static int  gpioLayout = -1 ;
+
+  if (gpioLayout != -1)	// No point checking twice
+    return gpioLayout ;
+
+  c = piRevision () ;
+
 // Isolate  last 4 characters: (in-case of overvolting or new encoding scheme)
 
   c = c + strlen (c) - 4 ;
@@ -953,11 +1073,9 @@ int piBoardRev (void)
  *********************************************************************************
  */
 
-void piBoardId (int *model, int *rev, int *mem, int *maker, int *warranty)
+static void readBoardId (int *model, int *rev, int *mem, int *maker, int *warranty)
 {
-  FILE *cpuFd ;
-  char line [120] ;
-  char *c ;
+  const char *c ;
   unsigned int revision ;
   int bRev, bType, bProc, bMfg, bMem, bWarranty ;
 
@@ -966,46 +1084,13 @@ void piBoardId (int *model, int *rev, int *mem, int *maker, int *warranty)
 
   (void)piGpioLayout () ;	// Call this first to make sure all's OK. Don't care about the result.
 
-  if ((cpuFd = fopen ("/proc/cpuinfo", "r")) == NULL)
-    piGpioLayoutOops ("Unable to open /proc/cpuinfo") ;
-
-  while (fgets (line, 120, cpuFd) != NULL)
-    if (strncmp (line, "Revision", 8) == 0)
-      break ;
-
-  fclose (cpuFd) ;
-
-  if (strncmp (line, "Revision", 8) != 0)
-    piGpioLayoutOops ("No \"Revision\" line") ;
-
-// Chomp trailing CR/NL
-
-  for (c = &line [strlen (line) - 1] ; (*c == '\n') || (*c == '\r') ; --c)
-    *c = 0 ;
+  c = piRevision () ;
 
   if (wiringPiDebug)
-    printf ("piBoardId: Revision string: %s\n", line) ;
+    printf ("piBoardId: Revision string: %s\n", c) ;
 
 // Need to work out if it's using the new or old encoding scheme:
 
-// Scan to the first character of the revision number
-
-  for (c = line ; *c ; ++c)
-    if (*c == ':')
-      break ;
-
-  if (*c != ':')
-    piGpioLayoutOops ("Bogus \"Revision\" line (no colon)") ;
-
-// Chomp spaces
-
-  ++c ;
-  while (isspace (*c))
-    ++c ;
-
-  if (!isxdigit (*c))
-    piGpioLayoutOops ("Bogus \"Revision\" line (no hex digit at start of revision)") ;
-
   revision = (unsigned int)strtol (c, NULL, 16) ; // Hex number with no leading 0x
 
 // Check for new way:
@@ -1090,6 +1175,31 @@ void piBoardId (int *model, int *rev, int *mem, int *maker, int *warranty)
 }
 
 
+// piBoardId:
+//	The real work is done once and the answers kept - it's called on
+//	every wiringPiSetup. pthread_once, so threads racing to be first
+//	all wait for the one answer.
+
+static pthread_once_t boardOnce = PTHREAD_ONCE_INIT ;
+static int bModel, bRev, bMem, bMaker, bWarranty ;
+
+static void boardIdInit (void)
+{
+  readBoardId (&bModel, &bRev, &bMem, &bMaker, &bWarranty) ;
+}
+
+void piBoardId (int *model, int *rev, int *mem, int *maker, int *warranty)
+{
+  pthread_once (&boardOnce, boardIdInit) ;
+
+  *model    = bModel ;
+  *rev      = bRev ;
+  *mem      = bMem ;
+  *maker    = bMaker ;
+  *warranty = bWarranty ;
+}
+
+
 
 /*
  * wpiPinToGpio:
@@ -1132,6 +1242,8 @@ void setPadDrive (int group, int value)
     if ((group < 0) || (group > 2))
       return ;
 
+    mapPads () ;
+
     wrVal = BCM_PASSWORD | 0x18 | (value & 7) ;
     *(pads + group + 11) = wrVal ;
 
@@ -1183,6 +1295,8 @@ void pwmSetMode (int mode)
 {
   if ((wiringPiMode == WPI_MODE_PINS) || (wiringPiMode == WPI_MODE_PHYS) || (wiringPiMode == WPI_MODE_GPIO))
   {
+    mapPwm () ;
+
     if (mode == PWM_MODE_MS)
       *(pwm + PWM_CONTROL) = PWM0_ENABLE | PWM1_ENABLE | PWM0_MS_MODE | PWM1_MS_MODE ;
     else
@@ -1202,6 +1316,8 @@ void pwmSetRange (unsigned int range)
 {
   if ((wiringPiMode == WPI_MODE_PINS) || (wiringPiMode == WPI_MODE_PHYS) || (wiringPiMode == WPI_MODE_GPIO))
   {
+    mapPwm () ;
+
     *(pwm + PWM0_RANGE) = range ; delayMicroseconds (10) ;
     *(pwm + PWM1_RANGE) = range ; delayMicroseconds (10) ;
   }
@@ -1228,6 +1344,9 @@ void pwmSetClock (int divisor)
 
   if ((wiringPiMode == WPI_MODE_PINS) || (wiringPiMode == WPI_MODE_PHYS) || (wiringPiMode == WPI_MODE_GPIO))
   {
+    mapPwm () ;
+    mapClk () ;
+
     if (wiringPiDebug)
       printf ("Setting to: %d. Current: 0x%08X\n", divisor, *(clk + PWMCLK_DIV)) ;
 
@@ -1287,6 +1406,8 @@ void gpioClockSet (int pin, int freq)
   if (divi > 4095)
     divi = 4095 ;
 
+  mapClk () ;
+
   *(clk + gpioToClkCon [pin]) = BCM_PASSWORD | GPIO_CLOCK_SOURCE ;		// Stop GPIO Clock
   while ((*(clk + gpioToClkCon [pin]) & 0x80) != 0)				// ... and wait
     ;
@@ -1370,6 +1491,46 @@ struct wiringPiNodeStruct *wiringPiNewNode (int pinBase, int numPins)
 }
 
 
+/*
+ * wiringPiBegin: wiringPiCommit:
+ *	Group writes to expander nodes. In between, digitalWrite () to a
+ *	node that has a flush hook just updates its shadow copy of the
+ *	output registers; the commit then writes each changed register once,
+ *	so setting 16 pins on an MCP23017 is one I2C transaction, not 16.
+ *	On-board pins aren't affected - they're written straight away.
+ *	Calls may be nested; only the outermost commit flushes.
+ *	Reads still go to the device, so won't see writes that are pending.
+ *	Like the rest of the node handling, this is not thread-safe.
+ *********************************************************************************
+ */
+
+void wiringPiBegin (void)
+{
+  ++wiringPiBatching ;
+}
+
+void wiringPiCommit (void)
+{
+  struct wiringPiNodeStruct *node ;
+
+  if (wiringPiBatching == 0)
+    return ;
+
+  if (--wiringPiBatching != 0)
+    return ;
+
+// Batching is off now, so a node built on top of another (e.g. a 74x595
+//	driven through an MCP23017) writes through as it flushes.
+
+  for (node = wiringPiNodes ; node != NULL ; node = node->next)
+    if ((node->dirty != 0) && (node->flush != NULL))
+    {
+      node->flush (node) ;
+      node->dirty = 0 ;
+    }
+}
+
+
 #ifdef notYetReady
 /*
  * pinED01:
@@ -1435,6 +1596,11 @@ void pinMode (int pin, int mode)
 
   setupCheck ("pinMode") ;
 
+  PI_STAT_INC (PI_STAT_PIN_MODE) ;
+
+  if (piJournalActive)
+    piJournalLog (PI_JOURNAL_PIN_MODE, pin, mode) ;
+
   if ((pin & PI_GPIO_MASK) == 0)		// On-board pin
   {
     /**/ if (wiringPiMode == WPI_MODE_PINS)
@@ -1496,7 +1662,7 @@ void pinMode (int pin, int mode)
   else
   {
     if ((node = wiringPiFindNode (pin)) != NULL)
-      node->pinMode (node, pin, mode) ;
+      PI_STAT_TIME (PI_STAT_HIST_NODE, node->pinMode (node, pin, mode)) ;
     return ;
   }
 }
@@ -1514,6 +1680,8 @@ void pullUpDnControl (int pin, int pud)
 
   setupCheck ("pullUpDnControl") ;
 
+  PI_STAT_INC (PI_STAT_PULL_UP_DN) ;
+
   if ((pin & PI_GPIO_MASK) == 0)		// On-Board Pin
   {
     /**/ if (wiringPiMode == WPI_MODE_PINS)
@@ -1557,51 +1725,299 @@ void pullUpDnControl (int pin, int pud)
   else						// Extension module
   {
     if ((node = wiringPiFindNode (pin)) != NULL)
-      node->pullUpDnControl (node, pin, pud) ;
+      PI_STAT_TIME (PI_STAT_HIST_NODE, node->pullUpDnControl (node, pin, pud)) ;
     return ;
   }
 }
 
 
 /*
- * digitalRead:
- *	Read the value of a given Pin, returning HIGH or LOW
+ * pinConfigureMany:
+ *	Set the mode and pull-up/down of a whole table of pins at once.
+ *	A mode or pud of -1 leaves that setting alone.
+ *
+ *	On-board pins going to INPUT or OUTPUT are gathered up so each GPFSEL
+ *	register gets one read-modify-write, and the pulls are done with one
+ *	clocked GPPUD sequence per pull value covering both banks (or one
+ *	read-modify-write per GPPUPPDN register on the Pi 4) rather than a
+ *	sequence per pin. Anything else - other modes, extension pins, the
+ *	sys modes - goes through pinMode and pullUpDnControl one at a time.
  *********************************************************************************
  */
 
-int digitalRead (int pin)
+static int pinConfigBatchable (const struct pinConfig *cfg)
 {
-  char c ;
-  struct wiringPiNodeStruct *node = wiringPiNodes ;
-  if ((pin & PI_GPIO_MASK) == 0)		// On-Board Pin
+  return ((cfg->pin & PI_GPIO_MASK) == 0) && (gpio != NULL) &&
+	 ((wiringPiMode == WPI_MODE_PINS) || (wiringPiMode == WPI_MODE_PHYS) || (wiringPiMode == WPI_MODE_GPIO)) &&
+	 ((cfg->mode == -1) || (cfg->mode == INPUT) || (cfg->mode == OUTPUT)) &&
+	 ((cfg->pud >= -1) && (cfg->pud <= PUD_UP)) ;
+}
+
+int pinConfigureMany (const struct pinConfig *cfg, int n)
+{
+  uint32_t fselMask [6], fselBits [6] ;
+  uint32_t pullMask [3][2] ;		// Legacy: by pud value and bank
+  uint32_t pupMask  [4], pupBits [4] ;	// Pi 4: by GPPUPPDN register
+  uint32_t bit ;
+  int i, pin, mode, pud, reg, shift, bank, pull ;
+
+  setupCheck ("pinConfigureMany") ;
+
+  memset (fselMask, 0, sizeof (fselMask)) ;
+  memset (fselBits, 0, sizeof (fselBits)) ;
+  memset (pullMask, 0, sizeof (pullMask)) ;
+  memset (pupMask,  0, sizeof (pupMask)) ;
+  memset (pupBits,  0, sizeof (pupBits)) ;
+
+  for (i = 0 ; i < n ; ++i)
   {
-    /**/ if (wiringPiMode == WPI_MODE_GPIO_SYS)	// Sys mode
-    {
-      if (sysFds [pin] == -1)
-	return LOW ;
+    pin  = cfg [i].pin ;
+    mode = cfg [i].mode ;
+    pud  = cfg [i].pud ;
 
-      lseek  (sysFds [pin], 0L, SEEK_SET) ;
-      read   (sysFds [pin], &c, 1) ;
-      return (c == '0') ? LOW : HIGH ;
-    }
-    else if (wiringPiMode == WPI_MODE_PINS)
+    if (!pinConfigBatchable (&cfg [i]))
+      continue ;	// Done the slow way below
+
+// Count them as pinMode and pullUpDnControl would have
+
+    if (mode != -1)
+      PI_STAT_INC (PI_STAT_PIN_MODE) ;
+    if (pud != -1)
+      PI_STAT_INC (PI_STAT_PULL_UP_DN) ;
+
+    if (wiringPiMode == WPI_MODE_PINS)
       pin = pinToGpio [pin] ;
     else if (wiringPiMode == WPI_MODE_PHYS)
       pin = physToGpio [pin] ;
-    else if (wiringPiMode != WPI_MODE_GPIO)
-      return LOW ;
 
-    if ((*(gpio + gpioToGPLEV [pin]) & (1 << (pin & 31))) != 0)
-      return HIGH ;
+    if (pin < 0)
+      continue ;
+
+    if (mode != -1)
+    {
+      if (piJournalActive)
+	piJournalLog (PI_JOURNAL_PIN_MODE, cfg [i].pin, mode) ;
+
+      softPwmStop  (cfg [i].pin) ;
+      softToneStop (cfg [i].pin) ;
+
+      reg   = gpioToGPFSEL [pin] ;
+      shift = gpioToShift  [pin] ;
+      fselMask [reg] |= 7u << shift ;
+      fselBits [reg]  = (fselBits [reg] & ~(7u << shift)) | ((mode == OUTPUT ? 1u : 0u) << shift) ;
+    }
+
+    if (pud != -1)
+    {
+      if (piGpioPupOffset == GPPUPPDN0)
+      {
+	/**/ if (pud == PUD_UP)   pull = 1 ;
+	else if (pud == PUD_DOWN) pull = 2 ;
+	else                      pull = 0 ;
+
+	reg   = pin >> 4 ;
+	shift = (pin & 0xF) << 1 ;
+	pupMask [reg] |= 3u << shift ;
+	pupBits [reg]  = (pupBits [reg] & ~(3u << shift)) | ((uint32_t)pull << shift) ;
+      }
+      else
+      {
+	bank = pin >> 5 ;
+	bit  = 1u << (pin & 31) ;
+	pullMask [PUD_OFF][bank] &= ~bit ;
+	pullMask [PUD_DOWN][bank] &= ~bit ;
+	pullMask [PUD_UP][bank] &= ~bit ;
+	pullMask [pud][bank] |= bit ;
+      }
+    }
+  }
+
+// Function select
+
+  for (reg = 0 ; reg < 6 ; ++reg)
+    if (fselMask [reg] != 0)
+      *(gpio + reg) = (*(gpio + reg) & ~fselMask [reg]) | fselBits [reg] ;
+
+// Pulls
+
+  if (piGpioPupOffset == GPPUPPDN0)
+  {
+    for (reg = 0 ; reg < 4 ; ++reg)
+      if (pupMask [reg] != 0)
+	*(gpio + GPPUPPDN0 + reg) = (*(gpio + GPPUPPDN0 + reg) & ~pupMask [reg]) | pupBits [reg] ;
+  }
+  else
+  {
+    for (pud = PUD_OFF ; pud <= PUD_UP ; ++pud)
+    {
+      if ((pullMask [pud][0] | pullMask [pud][1]) == 0)
+	continue ;
+
+      *(gpio + GPPUD)              = pud ;			delayMicroseconds (5) ;
+      *(gpio + gpioToPUDCLK [ 0])  = pullMask [pud][0] ;
+      *(gpio + gpioToPUDCLK [32])  = pullMask [pud][1] ;	delayMicroseconds (5) ;
+
+      *(gpio + GPPUD)              = 0 ;			delayMicroseconds (5) ;
+      *(gpio + gpioToPUDCLK [ 0])  = 0 ;
+      *(gpio + gpioToPUDCLK [32])  = 0 ;			delayMicroseconds (5) ;
+    }
+  }
+
+// Everything else, one at a time
+
+  for (i = 0 ; i < n ; ++i)
+  {
+    if (pinConfigBatchable (&cfg [i]))
+      continue ;	// Done above
+
+    if (cfg [i].mode != -1)
+      pinMode (cfg [i].pin, cfg [i].mode) ;
+    if (cfg [i].pud != -1)
+      pullUpDnControl (cfg [i].pin, cfg [i].pud) ;
+  }
+
+  return 0 ;
+}
+
+
+/*
+ * On-board digitalRead/digitalWrite:
+ *	One of each per pin mode. setWiringPiMode () points onBoardRead and
+ *	onBoardWrite at the right pair when wiringPiSetup* is called, so
+ *	digitalRead/digitalWrite don't have to work it out on every call.
+ *********************************************************************************
+ */
+
+static int digitalReadNone (UNU int pin)
+{
+  return LOW ;
+}
+
+static int digitalReadSys (int pin)
+{
+  char c ;
+
+  if (sysFds [pin] == -1)
+    return LOW ;
+
+  lseek  (sysFds [pin], 0L, SEEK_SET) ;
+  read   (sysFds [pin], &c, 1) ;
+  return (c == '0') ? LOW : HIGH ;
+}
+
+static int digitalReadGpio (int pin)
+{
+  return ((*(gpio + gpioToGPLEV [pin]) & (1 << (pin & 31))) != 0) ? HIGH : LOW ;
+}
+
+static int digitalReadPins (int pin)
+{
+  return digitalReadGpio (pinToGpio [pin]) ;
+}
+
+static int digitalReadPhys (int pin)
+{
+  return digitalReadGpio (physToGpio [pin]) ;
+}
+
+static void digitalWriteNone (UNU int pin, UNU int value)
+{
+  return ;
+}
+
+static void digitalWriteSys (int pin, int value)
+{
+  if (sysFds [pin] != -1)
+  {
+    if (value == LOW)
+      write (sysFds [pin], "0\n", 2) ;
     else
-      return LOW ;
+      write (sysFds [pin], "1\n", 2) ;
   }
+}
+
+static void digitalWriteGpio (int pin, int value)
+{
+  if (value == LOW)
+    *(gpio + gpioToGPCLR [pin]) = 1 << (pin & 31) ;
+  else
+    *(gpio + gpioToGPSET [pin]) = 1 << (pin & 31) ;
+}
+
+static void digitalWritePins (int pin, int value)
+{
+  digitalWriteGpio (pinToGpio [pin], value) ;
+}
+
+static void digitalWritePhys (int pin, int value)
+{
+  digitalWriteGpio (physToGpio [pin], value) ;
+}
+
+static int  (*onBoardRead)  (int pin)            = digitalReadNone ;
+static void (*onBoardWrite) (int pin, int value) = digitalWriteNone ;
+
+static void setWiringPiMode (int mode)
+{
+  wiringPiMode = mode ;
+
+  switch (mode)
+  {
+    case WPI_MODE_GPIO_SYS:
+      onBoardRead  = digitalReadSys ;
+      onBoardWrite = digitalWriteSys ;
+      break ;
+
+    case WPI_MODE_PINS:
+      onBoardRead  = digitalReadPins ;
+      onBoardWrite = digitalWritePins ;
+      break ;
+
+    case WPI_MODE_PHYS:
+      onBoardRead  = digitalReadPhys ;
+      onBoardWrite = digitalWritePhys ;
+      break ;
+
+    case WPI_MODE_GPIO:
+      onBoardRead  = digitalReadGpio ;
+      onBoardWrite = digitalWriteGpio ;
+      break ;
+
+    default:
+      onBoardRead  = digitalReadNone ;
+      onBoardWrite = digitalWriteNone ;
+      break ;
+  }
+}
+
+
+/*
+ * digitalRead:
+ *	Read the value of a given Pin, returning HIGH or LOW
+ *********************************************************************************
+ */
+
+int digitalRead (int pin)
+{
+  struct wiringPiNodeStruct *node = wiringPiNodes ;
+  int value ;
+
+  PI_STAT_INC (PI_STAT_DIGITAL_READ) ;
+
+  if ((pin & PI_GPIO_MASK) == 0)		// On-Board Pin
+    value = onBoardRead (pin) ;
   else
   {
     if ((node = wiringPiFindNode (pin)) == NULL)
-      return LOW ;
-    return node->digitalRead (node, pin) ;
+      value = LOW ;
+    else
+      PI_STAT_TIME (PI_STAT_HIST_NODE, value = node->digitalRead (node, pin)) ;
   }
+
+  if (piJournalActive)
+    piJournalLog (PI_JOURNAL_DIGITAL_READ, pin, value) ;
+
+  return value ;
 }
 
 
@@ -1636,39 +2052,53 @@ void digitalWrite (int pin, int value)
 {
   struct wiringPiNodeStruct *node = wiringPiNodes ;
 
-  if ((pin & PI_GPIO_MASK) == 0)		// On-Board Pin
-  {
-    /**/ if (wiringPiMode == WPI_MODE_GPIO_SYS)	// Sys mode
-    {
-      if (sysFds [pin] != -1)
-      {
-	if (value == LOW)
-	  write (sysFds [pin], "0\n", 2) ;
-	else
-	  write (sysFds [pin], "1\n", 2) ;
-      }
-      return ;
-    }
-    else if (wiringPiMode == WPI_MODE_PINS)
-      pin = pinToGpio [pin] ;
-    else if (wiringPiMode == WPI_MODE_PHYS)
-      pin = physToGpio [pin] ;
-    else if (wiringPiMode != WPI_MODE_GPIO)
-      return ;
+  PI_STAT_INC (PI_STAT_DIGITAL_WRITE) ;
 
-    if (value == LOW)
-      *(gpio + gpioToGPCLR [pin]) = 1 << (pin & 31) ;
-    else
-      *(gpio + gpioToGPSET [pin]) = 1 << (pin & 31) ;
-  }
+  if (piJournalActive)
+    piJournalLog (PI_JOURNAL_DIGITAL_WRITE, pin, value) ;
+
+  if ((pin & PI_GPIO_MASK) == 0)		// On-Board Pin
+    onBoardWrite (pin, value) ;
   else
   {
     if ((node = wiringPiFindNode (pin)) != NULL)
-      node->digitalWrite (node, pin, value) ;
+      PI_STAT_TIME (PI_STAT_HIST_NODE, node->digitalWrite (node, pin, value)) ;
   }
 }
 
 
+/*
+ * wiringPiGetPinHandle:
+ *	Work out the registers and bit for an on-board pin once, so the
+ *	caller can use digitalWriteFast/digitalReadFast on it afterwards.
+ *	Only available when we're using the memory mapped hardware.
+ *********************************************************************************
+ */
+
+int wiringPiGetPinHandle (int pin, struct wiringPiPinHandle *handle)
+{
+  if (((pin & PI_GPIO_MASK) != 0) || (gpio == NULL))
+    return -1 ;
+
+  /**/ if (wiringPiMode == WPI_MODE_PINS)
+    pin = pinToGpio [pin] ;
+  else if (wiringPiMode == WPI_MODE_PHYS)
+    pin = physToGpio [pin] ;
+  else if (wiringPiMode != WPI_MODE_GPIO)
+    return -1 ;
+
+  if (pin < 0)
+    return -1 ;
+
+  handle->set  = gpio + gpioToGPSET [pin] ;
+  handle->clr  = gpio + gpioToGPCLR [pin] ;
+  handle->lev  = gpio + gpioToGPLEV [pin] ;
+  handle->mask = 1 << (pin & 31) ;
+
+  return 0 ;
+}
+
+
 /*
  * digitalWrite8:
  *	Set an output 8-bit byte on the device from the given pin number
@@ -1701,6 +2131,11 @@ void pwmWrite (int pin, int value)
 
   setupCheck ("pwmWrite") ;
 
+  PI_STAT_INC (PI_STAT_PWM_WRITE) ;
+
+  if (piJournalActive)
+    piJournalLog (PI_JOURNAL_PWM_WRITE, pin, value) ;
+
   if ((pin & PI_GPIO_MASK) == 0)		// On-Board Pin
   {
     /**/ if (wiringPiMode == WPI_MODE_PINS)
@@ -1711,12 +2146,13 @@ void pwmWrite (int pin, int value)
       return ;
 
     usingGpioMemCheck ("pwmWrite") ;
+    mapPwm () ;
     *(pwm + gpioToPwmPort [pin]) = value ;
   }
   else
   {
     if ((node = wiringPiFindNode (pin)) != NULL)
-      node->pwmWrite (node, pin, value) ;
+      PI_STAT_TIME (PI_STAT_HIST_NODE, node->pwmWrite (node, pin, value)) ;
   }
 }
 
@@ -1732,11 +2168,19 @@ void pwmWrite (int pin, int value)
 int analogRead (int pin)
 {
   struct wiringPiNodeStruct *node = wiringPiNodes ;
+  int value ;
+
+  PI_STAT_INC (PI_STAT_ANALOG_READ) ;
 
   if ((node = wiringPiFindNode (pin)) == NULL)
-    return 0 ;
+    value = 0 ;
   else
-    return node->analogRead (node, pin) ;
+    PI_STAT_TIME (PI_STAT_HIST_NODE, value = node->analogRead (node, pin)) ;
+
+  if (piJournalActive)
+    piJournalLog (PI_JOURNAL_ANALOG_READ, pin, value) ;
+
+  return value ;
 }
 
 
@@ -1752,33 +2196,70 @@ void analogWrite (int pin, int value)
 {
   struct wiringPiNodeStruct *node = wiringPiNodes ;
 
+  PI_STAT_INC (PI_STAT_ANALOG_WRITE) ;
+
   if ((node = wiringPiFindNode (pin)) == NULL)
     return ;
 
-  node->analogWrite (node, pin, value) ;
+  PI_STAT_TIME (PI_STAT_HIST_NODE, node->analogWrite (node, pin, value)) ;
+}
+
+
+/*
+ * pwmToneChannel:
+ *	Pi Specific.
+ *	Which PWM channel a pin would play a tone on, or -1 if it can't - it's
+ *	not a hardware PWM pin, or we've only got /dev/gpiomem.
+ *********************************************************************************
+ */
+
+int pwmToneChannel (int pin)
+{
+  setupCheck ("pwmToneChannel") ;
+
+  if (((pin & PI_GPIO_MASK) != 0) || usingGpioMem)
+    return -1 ;
+
+  /**/ if (wiringPiMode == WPI_MODE_PINS)
+    pin = pinToGpio [pin] ;
+  else if (wiringPiMode == WPI_MODE_PHYS)
+    pin = physToGpio [pin] ;
+  else if (wiringPiMode != WPI_MODE_GPIO)
+    return -1 ;
+
+  if ((pin < 0) || (gpioToPwmALT [pin] == 0))
+    return -1 ;
+
+  return (gpioToPwmPort [pin] == PWM0_DATA) ? 0 : 1 ;
 }
 
 
 /*
  * pwmToneWrite:
  *	Pi Specific.
- *      Output the given frequency on the Pi's PWM pin
+ *      Output the given frequency on the Pi's PWM pin. The pin needs to be
+ *	in PWM_TONE_OUTPUT mode. Only the range of this pin's channel is
+ *	changed, so the two channels can play different notes.
  *********************************************************************************
  */
 
 void pwmToneWrite (int pin, int freq)
 {
-  int range ;
+  int range, channel ;
 
   setupCheck ("pwmToneWrite") ;
 
-  if (freq == 0)
+  if (freq <= 0)
     pwmWrite (pin, 0) ;             // Off
-  else
+  else if ((channel = pwmToneChannel (pin)) >= 0)
   {
-    range = 600000 / freq ;
-    pwmSetRange (range) ;
-    pwmWrite    (pin, freq / 2) ;
+    range = 600000 / freq ;		// The PWM clock is 600KHz in PWM_TONE_OUTPUT mode
+    if (range < 2)
+      range = 2 ;
+
+    mapPwm () ;
+    *(pwm + ((channel == 0) ? PWM0_RANGE : PWM1_RANGE)) = range ; delayMicroseconds (10) ;
+    pwmWrite (pin, range / 2) ;
   }
 }
 
@@ -1911,6 +2392,55 @@ unsigned int digitalReadByte2 (void)
 }
 
 
+/*
+ * digitalWriteBank:
+ *	Pi Specific
+ *	Set and clear any number of BCM_GPIO pins in one bank (bank 0 is
+ *	BCM_GPIO 0-31, bank 1 is BCM_GPIO 32-53) with one store to the clear
+ *	register and one to the set register. Pins in both masks end up set.
+ *	The masks are always BCM_GPIO bits, regardless of the wiringPi mode.
+ *********************************************************************************
+ */
+
+void digitalWriteBank (int bank, unsigned int set, unsigned int clear)
+{
+  int pin ;
+
+  bank &= 1 ;
+
+  if (piJournalActive)			// Clear first, as the hardware does
+  {
+    if (clear != 0)
+      piJournalLog (PI_JOURNAL_BANK_CLEAR, bank, (int)clear) ;
+    if (set != 0)
+      piJournalLog (PI_JOURNAL_BANK_SET,   bank, (int)set) ;
+  }
+
+  if (wiringPiMode == WPI_MODE_GPIO_SYS)
+  {
+    for (pin = 0 ; pin < 32 ; ++pin)
+    {
+      if (sysFds [bank * 32 + pin] == -1)
+	continue ;
+
+      /**/ if ((set & (1u << pin)) != 0)
+	write (sysFds [bank * 32 + pin], "1\n", 2) ;
+      else if ((clear & (1u << pin)) != 0)
+	write (sysFds [bank * 32 + pin], "0\n", 2) ;
+    }
+    return ;
+  }
+
+  if (gpio == NULL)
+    return ;
+
+  if (clear != 0)
+    *(gpio + gpioToGPCLR [bank * 32]) = clear ;
+  if (set != 0)
+    *(gpio + gpioToGPSET [bank * 32]) = set ;
+}
+
+
 /*
  * waitForInterrupt:
  *	Pi Specific.
@@ -1969,43 +2499,47 @@ static void *interruptHandler (UNU void *arg)
 {
   int myPin ;
 
-  (void)piHiPri (55) ;	// Only effective if we run as root
+  (void)piRealtimeThread (PI_RT_ISR) ;	// Only effective if we run as root
 
   myPin   = pinPass ;
   pinPass = -1 ;
 
   for (;;)
     if (waitForInterrupt (myPin, -1) > 0)
-      isrFunctions [myPin] () ;
+    {
+      PI_STAT_INC (PI_STAT_ISR_DISPATCH) ;
+      PI_STAT_TIME (PI_STAT_HIST_ISR, isrFunctions [myPin] ()) ;
+    }
 
   return NULL ;
 }
 
 
 /*
- * wiringPiISR:
+ * wiringPiEdgeSetup:
  *	Pi Specific.
- *	Take the details and create an interrupt handler that will do a call-
- *	back to the user supplied function.
+ *	Export the pin, set the edge it triggers on and pre-open its
+ *	/sys/class/gpio value file. Returns the file descriptor which can then
+ *	be poll()'d (or epoll()'d) for POLLPRI by anyone who wants to know
+ *	about edges on that pin - wiringPiISR and the edge capture code for now.
  *********************************************************************************
  */
 
-int wiringPiISR (int pin, int mode, void (*function)(void))
+int wiringPiEdgeSetup (int pin, int mode)
 {
-  pthread_t threadId ;
   const char *modeS ;
   char fName   [64] ;
-  char  pinS [8] ;
+  char  pinS [12] ;
   pid_t pid ;
   int   count, i ;
   char  c ;
   int   bcmGpioPin ;
 
   if ((pin < 0) || (pin > 63))
-    return wiringPiFailure (WPI_FATAL, "wiringPiISR: pin must be 0-63 (%d)\n", pin) ;
+    return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: pin must be 0-63 (%d)\n", pin) ;
 
   /**/ if (wiringPiMode == WPI_MODE_UNINITIALISED)
-    return wiringPiFailure (WPI_FATAL, "wiringPiISR: wiringPi has not been initialised. Unable to continue.\n") ;
+    return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: wiringPi has not been initialised. Unable to continue.\n") ;
   else if (wiringPiMode == WPI_MODE_PINS)
     bcmGpioPin = pinToGpio [pin] ;
   else if (wiringPiMode == WPI_MODE_PHYS)
@@ -2013,6 +2547,9 @@ int wiringPiISR (int pin, int mode, void (*function)(void))
   else
     bcmGpioPin = pin ;
 
+  if (bcmGpioPin < 0)
+    return wiringPiFailure (WPI_ALMOST, "wiringPiEdgeSetup: pin %d has no GPIO\n", pin) ;
+
 // Now export the pin and set the right edge
 //	We're going to use the gpio program to do this, so it assumes
 //	a full installation of wiringPi. It's a bit 'clunky', but it
@@ -2028,25 +2565,25 @@ int wiringPiISR (int pin, int mode, void (*function)(void))
     else
       modeS = "both" ;
 
-    sprintf (pinS, "%d", bcmGpioPin) ;
+    snprintf (pinS, sizeof (pinS), "%d", bcmGpioPin) ;
 
     if ((pid = fork ()) < 0)	// Fail
-      return wiringPiFailure (WPI_FATAL, "wiringPiISR: fork failed: %s\n", strerror (errno)) ;
+      return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: fork failed: %s\n", strerror (errno)) ;
 
     if (pid == 0)	// Child, exec
     {
       /**/ if (access ("/usr/local/bin/gpio", X_OK) == 0)
       {
 	execl ("/usr/local/bin/gpio", "gpio", "edge", pinS, modeS, (char *)NULL) ;
-	return wiringPiFailure (WPI_FATAL, "wiringPiISR: execl failed: %s\n", strerror (errno)) ;
+	return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: execl failed: %s\n", strerror (errno)) ;
       }
       else if (access ("/usr/bin/gpio", X_OK) == 0)
       {
 	execl ("/usr/bin/gpio", "gpio", "edge", pinS, modeS, (char *)NULL) ;
-	return wiringPiFailure (WPI_FATAL, "wiringPiISR: execl failed: %s\n", strerror (errno)) ;
+	return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: execl failed: %s\n", strerror (errno)) ;
       }
       else
-	return wiringPiFailure (WPI_FATAL, "wiringPiISR: Can't find gpio program\n") ;
+	return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: Can't find gpio program\n") ;
     }
     else		// Parent, wait
       waitpid (pid, NULL, 0) ;
@@ -2059,7 +2596,7 @@ int wiringPiISR (int pin, int mode, void (*function)(void))
   {
     sprintf (fName, "/sys/class/gpio/gpio%d/value", bcmGpioPin) ;
     if ((sysFds [bcmGpioPin] = open (fName, O_RDWR)) < 0)
-      return wiringPiFailure (WPI_FATAL, "wiringPiISR: unable to open %s: %s\n", fName, strerror (errno)) ;
+      return wiringPiFailure (WPI_FATAL, "wiringPiEdgeSetup: unable to open %s: %s\n", fName, strerror (errno)) ;
   }
 
 // Clear any initial pending interrupt
@@ -2068,6 +2605,58 @@ int wiringPiISR (int pin, int mode, void (*function)(void))
   for (i = 0 ; i < count ; ++i)
     read (sysFds [bcmGpioPin], &c, 1) ;
 
+  return sysFds [bcmGpioPin] ;
+}
+
+
+/*
+ * wiringPiEdgeRelease:
+ *	Close the value file wiringPiEdgeSetup opened, for when the caller
+ *	couldn't use it after all. Under wiringPiSetupSys it stays open -
+ *	the pin's reads and writes go through it as well.
+ *********************************************************************************
+ */
+
+void wiringPiEdgeRelease (int pin)
+{
+  int bcmGpioPin ;
+
+  if ((pin < 0) || (pin > 63))
+    return ;
+
+  /**/ if (wiringPiMode == WPI_MODE_PINS)
+    bcmGpioPin = pinToGpio [pin] ;
+  else if (wiringPiMode == WPI_MODE_PHYS)
+    bcmGpioPin = physToGpio [pin] ;
+  else if (wiringPiMode == WPI_MODE_GPIO)
+    bcmGpioPin = pin ;
+  else
+    return ;
+
+  if ((bcmGpioPin < 0) || (sysFds [bcmGpioPin] == -1))
+    return ;
+
+  close (sysFds [bcmGpioPin]) ;
+  sysFds [bcmGpioPin] = -1 ;
+}
+
+
+/*
+ * wiringPiISR:
+ *	Pi Specific.
+ *	Take the details and create an interrupt handler that will do a call-
+ *	back to the user supplied function.
+ *********************************************************************************
+ */
+
+int wiringPiISR (int pin, int mode, void (*function)(void))
+{
+  pthread_t threadId ;
+  int fd ;
+
+  if ((fd = wiringPiEdgeSetup (pin, mode)) < 0)
+    return fd ;
+
   isrFunctions [pin] = function ;
 
   pthread_mutex_lock (&pinMutex) ;
@@ -2081,45 +2670,68 @@ int wiringPiISR (int pin, int mode, void (*function)(void))
 }
 
 
+/*
+ * sysTimerRead:
+ *	Read the 64-bit system timer. The two halves can't be read together,
+ *	so if the top half changed while we read the bottom, read it again.
+ *********************************************************************************
+ */
+
+static inline uint64_t sysTimerRead (void)
+{
+  uint32_t hi, lo ;
+
+  do
+  {
+    hi = *(sysTimer + SYSTIMER_CHI) ;
+    lo = *(sysTimer + SYSTIMER_CLO) ;
+  } while (hi != *(sysTimer + SYSTIMER_CHI)) ;
+
+  return ((uint64_t)hi << 32) | (uint64_t)lo ;
+}
+
+
 /*
  * initialiseEpoch:
- *	Initialise our start-of-time variable to be the current unix
- *	time in milliseconds and microseconds.
+ *	Initialise our start-of-time variables. We use CLOCK_MONOTONIC
+ *	rather than CLOCK_MONOTONIC_RAW as the latter isn't handled by the
+ *	vDSO on many kernels and so is a real system call every time.
+ *	On the virtual clock (piClockSetup) the epoch is virtual too.
  *********************************************************************************
  */
 
 static void initialiseEpoch (void)
 {
-#ifdef	OLD_WAY
-  struct timeval tv ;
-
-  gettimeofday (&tv, NULL) ;
-  epochMilli = (uint64_t)tv.tv_sec * (uint64_t)1000    + (uint64_t)(tv.tv_usec / 1000) ;
-  epochMicro = (uint64_t)tv.tv_sec * (uint64_t)1000000 + (uint64_t)(tv.tv_usec) ;
-#else
-  struct timespec ts ;
+  epochNanos = piTimerNow () ;
 
-  clock_gettime (CLOCK_MONOTONIC_RAW, &ts) ;
-  epochMilli = (uint64_t)ts.tv_sec * (uint64_t)1000    + (uint64_t)(ts.tv_nsec / 1000000L) ;
-  epochMicro = (uint64_t)ts.tv_sec * (uint64_t)1000000 + (uint64_t)(ts.tv_nsec /    1000L) ;
-#endif
+  if (sysTimer != NULL)
+    epochSysTimer = sysTimerRead () ;
 }
 
 
 /*
  * delay:
- *	Wait for some number of milliseconds
+ *	Wait for some number of milliseconds.
+ *	This is an absolute sleep so a signal doesn't cut it short.
  *********************************************************************************
  */
 
 void delay (unsigned int howLong)
 {
-  struct timespec sleeper, dummy ;
+  struct timespec sleeper ;
+  uint64_t deadline = piTimerNow () + (uint64_t)howLong * (uint64_t)1000000 ;
 
-  sleeper.tv_sec  = (time_t)(howLong / 1000) ;
-  sleeper.tv_nsec = (long)(howLong % 1000) * 1000000 ;
+  if (piClockVirtual)
+  {
+    piSleepUntil (deadline) ;
+    return ;
+  }
+
+  sleeper.tv_sec  = (time_t)(deadline / 1000000000) ;
+  sleeper.tv_nsec = (long)  (deadline % 1000000000) ;
 
-  nanosleep (&sleeper, &dummy) ;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &sleeper, NULL) == EINTR)
+    ;
 }
 
 
@@ -2130,74 +2742,85 @@ void delay (unsigned int howLong)
  *	obeying the standards (may take longer), it's not always what we
  *	want!
  *
- *	So what I'll do now is if the delay is less than 100uS we'll do it
- *	in a hard loop, watching a built-in counter on the ARM chip. This is
- *	somewhat sub-optimal in that it uses 100% CPU, something not an issue
- *	in a microcontroller, but under a multi-tasking, multi-user OS, it's
- *	wastefull, however we've no real choice )-:
+ *	So what we do now is sleep until a little before the deadline and
+ *	spin for the rest - see piTimer.c. How little is measured at run
+ *	time, so we only burn CPU for the last few tens of microseconds
+ *	rather than for anything under 100uS.
  *
- *      Plan B: It seems all might not be well with that plan, so changing it
- *      to use gettimeofday () and poll on that instead...
+ *	delayMicrosecondsHard always spins - except on the virtual clock,
+ *	where spinning would wait forever.
  *********************************************************************************
  */
 
 void delayMicrosecondsHard (unsigned int howLong)
 {
-  struct timeval tNow, tLong, tEnd ;
+  uint64_t deadline = piTimerNow () + (uint64_t)howLong * (uint64_t)1000 ;
 
-  gettimeofday (&tNow, NULL) ;
-  tLong.tv_sec  = howLong / 1000000 ;
-  tLong.tv_usec = howLong % 1000000 ;
-  timeradd (&tNow, &tLong, &tEnd) ;
+  if (piClockVirtual)
+  {
+    piSleepUntil (deadline) ;
+    return ;
+  }
 
-  while (timercmp (&tNow, &tEnd, <))
-    gettimeofday (&tNow, NULL) ;
+  while (piTimerNow () < deadline)
+    ;
 }
 
 void delayMicroseconds (unsigned int howLong)
 {
-  struct timespec sleeper ;
-  unsigned int uSecs = howLong % 1000000 ;
-  unsigned int wSecs = howLong / 1000000 ;
-
-  /**/ if (howLong ==   0)
+  if (howLong == 0)
     return ;
-  else if (howLong  < 100)
-    delayMicrosecondsHard (howLong) ;
-  else
-  {
-    sleeper.tv_sec  = wSecs ;
-    sleeper.tv_nsec = (long)(uSecs * 1000L) ;
-    nanosleep (&sleeper, NULL) ;
-  }
+
+  piSleepUntil (piTimerNow () + (uint64_t)howLong * (uint64_t)1000) ;
 }
 
 
 /*
- * millis:
- *	Return a number of milliseconds as an unsigned int.
- *	Wraps at 49 days.
+ * nanos: micros64:
+ *	Return the time since wiringPiSetup as a 64-bit number of nanoseconds
+ *	or microseconds. These won't wrap in our lifetime.
+ *
+ *	If we have the system timer mapped we read that - it's a couple of
+ *	uncached loads rather than a trip through the vDSO - otherwise we
+ *	use CLOCK_MONOTONIC. The system timer only counts in microseconds,
+ *	so nanos () is then only good to the microsecond. The virtual clock
+ *	(piClockSetup) takes precedence over both.
  *********************************************************************************
  */
 
-unsigned int millis (void)
+uint64_t nanos (void)
 {
-  uint64_t now ;
+  struct timespec ts ;
 
-#ifdef	OLD_WAY
-  struct timeval tv ;
+  if (piClockVirtual)
+    return piTimerNow () - epochNanos ;
 
-  gettimeofday (&tv, NULL) ;
-  now  = (uint64_t)tv.tv_sec * (uint64_t)1000 + (uint64_t)(tv.tv_usec / 1000) ;
+  if (sysTimer != NULL)
+    return (sysTimerRead () - epochSysTimer) * (uint64_t)1000 ;
 
-#else
-  struct  timespec ts ;
+  clock_gettime (CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * (uint64_t)1000000000 + (uint64_t)ts.tv_nsec - epochNanos ;
+}
 
-  clock_gettime (CLOCK_MONOTONIC_RAW, &ts) ;
-  now  = (uint64_t)ts.tv_sec * (uint64_t)1000 + (uint64_t)(ts.tv_nsec / 1000000L) ;
-#endif
+uint64_t micros64 (void)
+{
+  if ((sysTimer != NULL) && !piClockVirtual)
+    return sysTimerRead () - epochSysTimer ;
+
+  return nanos () / 1000 ;
+}
+
+
+/*
+ * millis:
+ *	Return a number of milliseconds as an unsigned int.
+ *	Wraps at 49 days.
+ *********************************************************************************
+ */
 
-  return (uint32_t)(now - epochMilli) ;
+unsigned int millis (void)
+{
+  return (uint32_t)(micros64 () / 1000) ;
 }
 
 
@@ -2210,21 +2833,7 @@ unsigned int millis (void)
 
 unsigned int micros (void)
 {
-  uint64_t now ;
-#ifdef	OLD_WAY
-  struct timeval tv ;
-
-  gettimeofday (&tv, NULL) ;
-  now  = (uint64_t)tv.tv_sec * (uint64_t)1000000 + (uint64_t)tv.tv_usec ;
-#else
-  struct  timespec ts ;
-
-  clock_gettime (CLOCK_MONOTONIC_RAW, &ts) ;
-  now  = (uint64_t)ts.tv_sec * (uint64_t)1000000 + (uint64_t)(ts.tv_nsec / 1000) ;
-#endif
-
-
-  return (uint32_t)(now - epochMicro) ;
+  return (uint32_t)micros64 () ;
 }
 
 /*
@@ -2240,6 +2849,25 @@ void wiringPiVersion (int *major, int *minor)
 }
 
 
+/*
+ * journalCheck:
+ *	Start the journal if WIRINGPI_JOURNAL names a file for it.
+ *	WIRINGPI_JOURNAL_SIZE optionally gives the number of records to keep.
+ *********************************************************************************
+ */
+
+static void journalCheck (void)
+{
+  const char *path, *size ;
+
+  if ((path = getenv (ENV_JOURNAL)) == NULL)
+    return ;
+
+  size = getenv (ENV_JOURNAL_SIZE) ;
+  (void)piJournalOpen (path, (size == NULL) ? 0 : atoi (size)) ;
+}
+
+
 /*
  * wiringPiSetup:
  *	Must be called once at the start of your program execution.
@@ -2267,6 +2895,8 @@ int wiringPiSetup (void)
   if (getenv (ENV_CODES) != NULL)
     wiringPiReturnCodes = TRUE ;
 
+  journalCheck () ;
+
   if (wiringPiDebug)
     printf ("wiringPi: wiringPiSetup called\n") ;
 
@@ -2281,9 +2911,9 @@ int wiringPiSetup (void)
   if ((model == PI_MODEL_CM) ||
       (model == PI_MODEL_CM3) ||
       (model == PI_MODEL_CM3P))
-    wiringPiMode = WPI_MODE_GPIO ;
+    setWiringPiMode (WPI_MODE_GPIO) ;
   else
-    wiringPiMode = WPI_MODE_PINS ;
+    setWiringPiMode (WPI_MODE_PINS) ;
 
   /**/ if (piGpioLayout () == 1)	// A, B, Rev 1, 1.1
   {
@@ -2347,6 +2977,7 @@ int wiringPiSetup (void)
   GPIO_BASE	  = piGpioBase + 0x00200000 ;
   GPIO_TIMER	  = piGpioBase + 0x0000B000 ;
   GPIO_PWM	  = piGpioBase + 0x0020C000 ;
+  GPIO_SYSTIMER	  = piGpioBase + 0x00003000 ;
 
 // Map the individual hardware components
 
@@ -2356,23 +2987,10 @@ int wiringPiSetup (void)
   if (gpio == MAP_FAILED)
     return wiringPiFailure (WPI_ALMOST, "wiringPiSetup: mmap (GPIO) failed: %s\n", strerror (errno)) ;
 
-//	PWM
-
-  pwm = (uint32_t *)mmap(0, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, GPIO_PWM) ;
-  if (pwm == MAP_FAILED)
-    return wiringPiFailure (WPI_ALMOST, "wiringPiSetup: mmap (PWM) failed: %s\n", strerror (errno)) ;
-
-//	Clock control (needed for PWM)
+//	PWM, Clock control and the drive pads are mapped when first used.
+//	See mapPeripheral ()
 
-  clk = (uint32_t *)mmap(0, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, GPIO_CLOCK_BASE) ;
-  if (clk == MAP_FAILED)
-    return wiringPiFailure (WPI_ALMOST, "wiringPiSetup: mmap (CLOCK) failed: %s\n", strerror (errno)) ;
-
-//	The drive pads
-
-  pads = (uint32_t *)mmap(0, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, GPIO_PADS) ;
-  if (pads == MAP_FAILED)
-    return wiringPiFailure (WPI_ALMOST, "wiringPiSetup: mmap (PADS) failed: %s\n", strerror (errno)) ;
+  memFd = fd ;
 
 //	The system timer
 
@@ -2388,12 +3006,21 @@ int wiringPiSetup (void)
   *(timer + TIMER_PRE_DIV) = 0x00000F9 ;
   timerIrqRaw = timer + TIMER_IRQ_RAW ;
 
+//	The 64-bit system timer, for micros64 () and friends. /dev/gpiomem
+//	only gives us the GPIO block, so we can only have it with /dev/mem.
+//	It's not essential - we fall back to clock_gettime () without it.
+
+  if (!usingGpioMem)
+  {
+    sysTimer = (uint32_t *)mmap(0, BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, GPIO_SYSTIMER) ;
+    if (sysTimer == MAP_FAILED)
+      sysTimer = NULL ;
+  }
+
 // Export the base addresses for any external software that might need them
+//	(The PWM, clock and pads ones get filled in when they're mapped)
 
   _wiringPiGpio  = gpio ;
-  _wiringPiPwm   = pwm ;
-  _wiringPiClk   = clk ;
-  _wiringPiPads  = pads ;
   _wiringPiTimer = timer ;
 
   initialiseEpoch () ;
@@ -2418,7 +3045,7 @@ int wiringPiSetupGpio (void)
   if (wiringPiDebug)
     printf ("wiringPi: wiringPiSetupGpio called\n") ;
 
-  wiringPiMode = WPI_MODE_GPIO ;
+  setWiringPiMode (WPI_MODE_GPIO) ;
 
   return 0 ;
 }
@@ -2440,7 +3067,7 @@ int wiringPiSetupPhys (void)
   if (wiringPiDebug)
     printf ("wiringPi: wiringPiSetupPhys called\n") ;
 
-  wiringPiMode = WPI_MODE_PHYS ;
+  setWiringPiMode (WPI_MODE_PHYS) ;
 
   return 0 ;
 }
@@ -2471,6 +3098,8 @@ int wiringPiSetupSys (void)
   if (getenv (ENV_CODES) != NULL)
     wiringPiReturnCodes = TRUE ;
 
+  journalCheck () ;
+
   if (wiringPiDebug)
     printf ("wiringPi: wiringPiSetupSys called\n") ;
 
@@ -2496,7 +3125,7 @@ int wiringPiSetupSys (void)
 
   initialiseEpoch () ;
 
-  wiringPiMode = WPI_MODE_GPIO_SYS ;
+  setWiringPiMode (WPI_MODE_GPIO_SYS) ;
 
   return 0 ;
 }
@@ -56,6 +56,7 @@
 
 #include "../include/wiringPi.h"
 #include "../include/wiringPiI2C.h"
+#include "../include/piStats.h"
 
 // I2C definitions
 
@@ -103,6 +104,10 @@ static inline int i2c_smbus_access (int fd, char rw, uint8_t command, int size,
 {
   struct i2c_smbus_ioctl_data args ;
 
+// Bytes on the wire after the address: the command, then any data
+
+  PI_STAT_I2C (fd, (size == I2C_SMBUS_WORD_DATA) ? 3 : (size == I2C_SMBUS_BYTE_DATA) ? 2 : 1) ;
+
   args.read_write = rw ;
   args.command    = command ;
   args.size       = size ;
@@ -36,6 +36,7 @@
 #include "../include/wiringPi.h"
 
 #include "../include/wiringPiSPI.h"
+#include "../include/piStats.h"
 
 
 // The SPI bus parameters
@@ -89,6 +90,8 @@ int wiringPiSPIDataRW (int channel, unsigned char *data, int len)
   spi.speed_hz      = spiSpeeds [channel] ;
   spi.bits_per_word = spiBPW ;
 
+  PI_STAT_SPI (spiFds [channel], len) ;
+
   return ioctl (spiFds [channel], SPI_IOC_MESSAGE(1), &spi) ;
 }
 
@@ -22,11 +22,70 @@
  ***********************************************************************
  */
 
+#include <stdio.h>
 #include <stdint.h>
 
 #include "../include/wiringPi.h"
+#include "../include/piTimer.h"
+#include "../include/piJournal.h"
 #include "../include/wiringShift.h"
 
+
+/*
+ * resolve: pinSet: pinGet:
+ *	Work out the registers for a pin once, then use them for every bit.
+ *	Pins we can't resolve (on a node, or under wiringPiSetupSys) go
+ *	through digitalWrite/digitalRead as before.
+ *********************************************************************************
+ */
+
+static void resolve (struct shiftBusPin *p, int pin)
+{
+  struct wiringPiPinHandle handle ;
+
+  p->pin = pin ;
+  p->set = NULL ;
+
+  if ((pin >= 0) && (wiringPiGetPinHandle (pin, &handle) == 0))
+  {
+    p->set  = handle.set ;
+    p->clr  = handle.clr ;
+    p->lev  = handle.lev ;
+    p->mask = handle.mask ;
+  }
+}
+
+static inline void pinSet (const struct shiftBusPin *p, int value)
+{
+  if (p->set == NULL)
+  {
+    digitalWrite (p->pin, value) ;
+    return ;
+  }
+
+  if (piJournalActive)		// digitalWrite logs its own
+    piJournalLog (PI_JOURNAL_DIGITAL_WRITE, p->pin, value) ;
+
+  if (value == 0)
+    *p->clr = p->mask ;
+  else
+    *p->set = p->mask ;
+}
+
+static inline int pinGet (const struct shiftBusPin *p)
+{
+  int value ;
+
+  if (p->set == NULL)
+    return digitalRead (p->pin) ;
+
+  value = (*p->lev & p->mask) != 0 ;
+  if (piJournalActive)
+    piJournalLog (PI_JOURNAL_DIGITAL_READ, p->pin, value) ;
+  return value ;
+}
+
+
 /*
  * shiftIn:
  *	Shift data in from a clocked source
@@ -35,22 +94,26 @@
 
 uint8_t shiftIn (uint8_t dPin, uint8_t cPin, uint8_t order)
 {
+  struct shiftBusPin d, c ;
   uint8_t value = 0 ;
   int8_t  i ;
+
+  resolve (&d, dPin) ;
+  resolve (&c, cPin) ;
  
   if (order == MSBFIRST)
     for (i = 7 ; i >= 0 ; --i)
     {
-      digitalWrite (cPin, HIGH) ;
-      value |= digitalRead (dPin) << i ;
-      digitalWrite (cPin, LOW) ;
+      pinSet (&c, HIGH) ;
+      value |= pinGet (&d) << i ;
+      pinSet (&c, LOW) ;
     }
   else
     for (i = 0 ; i < 8 ; ++i)
     {
-      digitalWrite (cPin, HIGH) ;
-      value |= digitalRead (dPin) << i ;
-      digitalWrite (cPin, LOW) ;
+      pinSet (&c, HIGH) ;
+      value |= pinGet (&d) << i ;
+      pinSet (&c, LOW) ;
     }
 
   return value;
@@ -64,20 +127,137 @@ uint8_t shiftIn (uint8_t dPin, uint8_t cPin, uint8_t order)
 
 void shiftOut (uint8_t dPin, uint8_t cPin, uint8_t order, uint8_t val)
 {
+  struct shiftBusPin d, c ;
   int8_t i;
 
+  resolve (&d, dPin) ;
+  resolve (&c, cPin) ;
+
   if (order == MSBFIRST)
     for (i = 7 ; i >= 0 ; --i)
     {
-      digitalWrite (dPin, val & (1 << i)) ;
-      digitalWrite (cPin, HIGH) ;
-      digitalWrite (cPin, LOW) ;
+      pinSet (&d, val & (1 << i)) ;
+      pinSet (&c, HIGH) ;
+      pinSet (&c, LOW) ;
     }
   else
     for (i = 0 ; i < 8 ; ++i)
     {
-      digitalWrite (dPin, val & (1 << i)) ;
-      digitalWrite (cPin, HIGH) ;
-      digitalWrite (cPin, LOW) ;
+      pinSet (&d, val & (1 << i)) ;
+      pinSet (&c, HIGH) ;
+      pinSet (&c, LOW) ;
+    }
+}
+
+
+/*
+ * shiftBusSetup:
+ *	Set up a bit-banged SPI style bus. Either data pin may be -1 if it's
+ *	not used. speed is the clock rate in Hz, or 0 to go as fast as the
+ *	pins can be toggled. The pins must already be inputs/outputs; the
+ *	clock is set to its idle level here.
+ *********************************************************************************
+ */
+
+int shiftBusSetup (struct shiftBus *bus, int dOutPin, int dInPin, int clkPin, int mode, int order, unsigned int speed)
+{
+  if ((clkPin < 0) || (mode < 0) || (mode > 3))
+    return -1 ;
+
+  resolve (&bus->dOut, dOutPin) ;
+  resolve (&bus->dIn,  dInPin) ;
+  resolve (&bus->clk,  clkPin) ;
+
+  bus->mode       = mode ;
+  bus->order      = order ;
+  bus->halfPeriod = (speed == 0) ? 0 : 500000000 / speed ;
+
+  pinSet (&bus->clk, (mode & 2) ? HIGH : LOW) ;
+
+  return 0 ;
+}
+
+
+/*
+ * halfPeriod:
+ *	Spin to the next clock edge. Nothing to do when running flat out.
+ *	The virtual clock doesn't move while we spin, so sleep on it instead.
+ *********************************************************************************
+ */
+
+static inline void halfPeriod (const struct shiftBus *bus, uint64_t *next)
+{
+  if (bus->halfPeriod == 0)
+    return ;
+
+  *next += bus->halfPeriod ;
+
+  if (piClockVirtual)
+  {
+    piSleepUntil (*next) ;
+    return ;
+  }
+
+  while (piTimerNow () < *next)
+    ;
+}
+
+
+/*
+ * shiftBusTransfer:
+ *	Clock len bytes out of tx and into rx at the same time. Either may
+ *	be NULL - zeros are sent if tx is.
+ *	Edges are timed against absolute deadlines, so the time spent on the
+ *	pins themselves comes out of the half period rather than adding to it.
+ *********************************************************************************
+ */
+
+void shiftBusTransfer (struct shiftBus *bus, const uint8_t *tx, uint8_t *rx, int len)
+{
+  const int idle   = (bus->mode & 2) ? HIGH : LOW ;
+  const int active = !idle ;
+  const int cpha   = bus->mode & 1 ;
+  const int hasOut = bus->dOut.pin >= 0 ;
+  const int hasIn  = bus->dIn.pin  >= 0 ;
+  uint64_t next = 0 ;
+  int i, bit, shift, in ;
+
+  if (bus->halfPeriod != 0)
+    next = piTimerNow () ;
+
+  for (i = 0 ; i < len ; ++i)
+  {
+    in = 0 ;
+
+    for (bit = 0 ; bit < 8 ; ++bit)
+    {
+      shift = (bus->order == MSBFIRST) ? 7 - bit : bit ;
+
+      if (cpha == 0)			// Data out, then sample on the leading edge
+      {
+	if (hasOut)
+	  pinSet (&bus->dOut, (tx != NULL) && (tx [i] & (1 << shift))) ;
+	halfPeriod (bus, &next) ;
+	pinSet (&bus->clk, active) ;
+	if (hasIn)
+	  in |= pinGet (&bus->dIn) << shift ;
+	halfPeriod (bus, &next) ;
+	pinSet (&bus->clk, idle) ;
+      }
+      else				// Data out on the leading edge, sample on the trailing
+      {
+	pinSet (&bus->clk, active) ;
+	if (hasOut)
+	  pinSet (&bus->dOut, (tx != NULL) && (tx [i] & (1 << shift))) ;
+	halfPeriod (bus, &next) ;
+	pinSet (&bus->clk, idle) ;
+	if (hasIn)
+	  in |= pinGet (&bus->dIn) << shift ;
+	halfPeriod (bus, &next) ;
+      }
     }
+
+    if (rx != NULL)
+      rx [i] = in ;
+  }
 }
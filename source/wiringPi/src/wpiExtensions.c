@@ -357,9 +357,9 @@ static int doExtensionSr595 (char *progName, int pinBase, char *params)
   if ((params = extractInt (progName, params, &pins)) == NULL)
     return FALSE ;
 
-  if ((pins < 8) || (pins > 32))
+  if ((pins < 8) || (pins > SR595_MAX_PINS))
   {
-    verbError ("%s: pin count (%d) out of range - 8-32 expected.", progName, pins) ;
+    verbError ("%s: pin count (%d) out of range - 8-%d expected.", progName, pins, SR595_MAX_PINS) ;
     return FALSE ;
   }
 
@@ -378,6 +378,43 @@ static int doExtensionSr595 (char *progName, int pinBase, char *params)
 }
 
 
+/*
+ * doExtensionSr595SPI:
+ *	Shift Register 74x595 on the SPI bus
+ *	sr595spi:base:pins:spi[:latch]
+ *	With no latch pin, the SPI chip enable drives the latch.
+ *********************************************************************************
+ */
+
+static int doExtensionSr595SPI (char *progName, int pinBase, char *params)
+{
+  int pins, spi, latch = -1 ;
+
+  if ((params = extractInt (progName, params, &pins)) == NULL)
+    return FALSE ;
+
+  if ((pins < 8) || (pins > SR595_MAX_PINS))
+  {
+    verbError ("%s: pin count (%d) out of range - 8-%d expected.", progName, pins, SR595_MAX_PINS) ;
+    return FALSE ;
+  }
+
+  if ((params = extractInt (progName, params, &spi)) == NULL)
+    return FALSE ;
+
+  if ((spi < 0) || (spi > 1))
+  {
+    verbError ("%s: SPI address (%d) out of range", progName, spi) ;
+    return FALSE ;
+  }
+
+  if ((*params == ':') && ((params = extractInt (progName, params, &latch)) == NULL))
+    return FALSE ;
+
+  return sr595SPISetup (pinBase, pins, spi, latch) ;
+}
+
+
 /*
  * doExtensionPcf8574:
  *	Digital IO (Crude!)
@@ -837,6 +874,7 @@ static struct extensionFunctionStruct extensionFunctions [] =
   { "mcp23s08",		&doExtensionMcp23s08 	},
   { "mcp23s17",		&doExtensionMcp23s17 	},
   { "sr595",		&doExtensionSr595	},
+  { "sr595spi",		&doExtensionSr595SPI	},
   { "pcf8574",		&doExtensionPcf8574	},
   { "pcf8591",		&doExtensionPcf8591	},
   { "bmp180",		&doExtensionBmp180	},
@@ -0,0 +1,507 @@
+/*
+ * wpiLoop.c:
+ *	A reactor: one thread waits in one epoll set for everything the
+ *	program is interested in - edges on GPIO pins, timers, serial ports,
+ *	sockets - and calls back for each as it happens. Nothing blocks on
+ *	its own fd and nothing polls.
+ *
+ *	All the timers share one timerfd, set for the soonest. They're kept
+ *	in time order, the way the soft PWM keeps its edges.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with wiringPi.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "../include/wiringPi.h"
+#include "../include/piTimer.h"
+#include "../include/wpiLoop.h"
+
+#define	MAX_EVENTS	32
+
+#define	WATCH_FREE	0
+#define	WATCH_EDGE	1
+#define	WATCH_FD	2
+#define	WATCH_TIMER	3
+
+#define	INDEX_BITS	8		// WPI_LOOP_MAX
+#define	INDEX_MASK	((1 << INDEX_BITS) - 1)
+#define	GEN_MASK	0x7FFFFF
+
+// epoll data for our own fds - watch numbers are never negative
+
+#define	ID_TIMER	-1
+#define	ID_STOP		-2
+
+struct watch
+{
+  int       type ;
+  int       gen ;
+  int       fd ;
+  int       pin ;
+  uint64_t  when ;		// Timers
+  uint64_t  period ;
+
+  void    (*edgeFn) (int pin, int level, void *arg) ;
+  void    (*fdFn)   (int fd, int events, void *arg) ;
+  void    (*timerFn)(void *arg) ;
+  void     *arg ;
+} ;
+
+static struct watch watches [WPI_LOOP_MAX] ;
+static int          numWatches ;
+
+static int          order [WPI_LOOP_MAX] ;	// Timers, soonest first
+static int          numTimers ;
+
+static int          epollFd = -1 ;
+static int          timerFd = -1 ;
+static int          stopFd  = -1 ;
+static uint64_t     timerSetFor ;		// 0 for not set
+static volatile int stopping ;
+
+
+/*
+ * loopInit:
+ *	The epoll set, with our timerfd and the eventfd wpiLoopStop pokes
+ *********************************************************************************
+ */
+
+static int loopInit (void)
+{
+  struct epoll_event ev ;
+
+  if (epollFd != -1)
+    return 0 ;
+
+  epollFd = epoll_create1 (EPOLL_CLOEXEC) ;
+  timerFd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK) ;
+  stopFd  = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK) ;
+  if ((epollFd < 0) || (timerFd < 0) || (stopFd < 0))
+    return wiringPiFailure (WPI_FATAL, "wpiLoop: Unable to create epoll/timerfd/eventfd: %s\n", strerror (errno)) ;
+
+  memset (&ev, 0, sizeof (ev)) ;
+  ev.events  = EPOLLIN ;
+  ev.data.fd = ID_TIMER ;
+  epoll_ctl (epollFd, EPOLL_CTL_ADD, timerFd, &ev) ;
+  ev.data.fd = ID_STOP ;
+  epoll_ctl (epollFd, EPOLL_CTL_ADD, stopFd, &ev) ;
+
+  return 0 ;
+}
+
+
+/*
+ * newWatch: watchId: freeWatch:
+ *********************************************************************************
+ */
+
+static int newWatch (int type)
+{
+  int i ;
+
+  if (loopInit () < 0)
+    return -1 ;
+
+  for (i = 0 ; i < WPI_LOOP_MAX ; ++i)
+    if (watches [i].type == WATCH_FREE)
+    {
+      watches [i].type = type ;
+      ++numWatches ;
+      return i ;
+    }
+
+  return wiringPiFailure (WPI_ALMOST, "wpiLoop: Too many watches (%d)\n", WPI_LOOP_MAX) ;
+}
+
+static int watchId (int i)
+{
+  return (watches [i].gen << INDEX_BITS) | i ;
+}
+
+static void freeWatch (int i)
+{
+  watches [i].type = WATCH_FREE ;
+  watches [i].gen  = (watches [i].gen + 1) & GEN_MASK ;
+  --numWatches ;
+}
+
+
+/*
+ * addFd:
+ *	Put a watch's fd in the epoll set. One watch per fd.
+ *********************************************************************************
+ */
+
+static int addFd (int i, uint32_t events)
+{
+  struct epoll_event ev ;
+
+  memset (&ev, 0, sizeof (ev)) ;
+  ev.events  = events ;
+  ev.data.fd = watchId (i) ;
+
+  if (epoll_ctl (epollFd, EPOLL_CTL_ADD, watches [i].fd, &ev) < 0)
+  {
+    freeWatch (i) ;
+    return wiringPiFailure (WPI_ALMOST, "wpiLoop: Unable to watch fd %d: %s\n", watches [i].fd, strerror (errno)) ;
+  }
+
+  return watchId (i) ;
+}
+
+
+/*
+ * armTimer:
+ *	Set the timerfd for the soonest timer, if that's changed
+ *********************************************************************************
+ */
+
+static void armTimer (void)
+{
+  struct itimerspec its ;
+  uint64_t when = (numTimers > 0) ? watches [order [0]].when : 0 ;
+
+  if (when == timerSetFor)
+    return ;
+
+  memset (&its, 0, sizeof (its)) ;
+  if (when != 0)
+  {
+    its.it_value.tv_sec  = (time_t)(when / 1000000000) ;
+    its.it_value.tv_nsec = (long)  (when % 1000000000) ;
+    if ((its.it_value.tv_sec == 0) && (its.it_value.tv_nsec == 0))
+      its.it_value.tv_nsec = 1 ;		// 0 would disarm it
+  }
+  timerfd_settime (timerFd, TFD_TIMER_ABSTIME, &its, NULL) ;
+  timerSetFor = when ;
+}
+
+
+/*
+ * insertTimer: removeTimer:
+ *	Keep order [] sorted by when
+ *********************************************************************************
+ */
+
+static void insertTimer (int i)
+{
+  int j ;
+
+  for (j = numTimers++ ; (j > 0) && (watches [order [j - 1]].when > watches [i].when) ; --j)
+    order [j] = order [j - 1] ;
+  order [j] = i ;
+}
+
+static void removeTimer (int i)
+{
+  int j ;
+
+  for (j = 0 ; j < numTimers ; ++j)
+    if (order [j] == i)
+    {
+      memmove (&order [j], &order [j + 1], sizeof (int) * (size_t)(numTimers - j - 1)) ;
+      --numTimers ;
+      return ;
+    }
+}
+
+
+/*
+ * wpiLoopEdge:
+ *	Call fn with the pin and its new level on each edge. mode is as for
+ *	wiringPiISR, and as there, it's fixed once the pin is set up.
+ *********************************************************************************
+ */
+
+int wpiLoopEdge (int pin, int mode, void (*fn)(int pin, int level, void *arg), void *arg)
+{
+  int i, fd ;
+
+  if (fn == NULL)
+    return -1 ;
+
+  if ((fd = wiringPiEdgeSetup (pin, mode)) < 0)
+    return -1 ;
+
+  if ((i = newWatch (WATCH_EDGE)) < 0)
+    return -1 ;
+
+  watches [i].fd     = fd ;
+  watches [i].pin    = pin ;
+  watches [i].edgeFn = fn ;
+  watches [i].arg    = arg ;
+
+  return addFd (i, EPOLLPRI | EPOLLERR) ;
+}
+
+
+/*
+ * wpiLoopFd:
+ *	Call fn when fd is readable and/or writable. The fd is still the
+ *	caller's - cancel the watch before closing it.
+ *********************************************************************************
+ */
+
+int wpiLoopFd (int fd, int events, void (*fn)(int fd, int events, void *arg), void *arg)
+{
+  uint32_t ev = 0 ;
+  int i ;
+
+  if ((fn == NULL) || (fd < 0))
+    return -1 ;
+
+  if (events & WPI_LOOP_READ)  ev |= EPOLLIN ;
+  if (events & WPI_LOOP_WRITE) ev |= EPOLLOUT ;
+
+  if ((i = newWatch (WATCH_FD)) < 0)
+    return -1 ;
+
+  watches [i].fd   = fd ;
+  watches [i].fdFn = fn ;
+  watches [i].arg  = arg ;
+
+  return addFd (i, ev) ;
+}
+
+
+/*
+ * wpiLoopTimer:
+ *	Call fn at first, then every period nS after if period isn't 0.
+ *	A periodic timer that falls behind skips the ticks it's missed.
+ *********************************************************************************
+ */
+
+int wpiLoopTimer (uint64_t first, uint64_t period, void (*fn)(void *arg), void *arg)
+{
+  int i ;
+
+  if (fn == NULL)
+    return -1 ;
+
+  if ((i = newWatch (WATCH_TIMER)) < 0)
+    return -1 ;
+
+  watches [i].when    = (first != 0) ? first : 1 ;
+  watches [i].period  = period ;
+  watches [i].timerFn = fn ;
+  watches [i].arg     = arg ;
+  insertTimer (i) ;
+
+  return watchId (i) ;
+}
+
+
+/*
+ * wpiLoopCancel:
+ *	Stop watching. Safe from inside a callback, including its own.
+ *	Returns 0, or -1 if there's no such watch.
+ *********************************************************************************
+ */
+
+int wpiLoopCancel (int watch)
+{
+  struct watch *w ;
+  int i = watch & INDEX_MASK ;
+
+  if (watch < 0)
+    return -1 ;
+
+  w = &watches [i] ;
+  if ((w->type == WATCH_FREE) || (w->gen != (watch >> INDEX_BITS)))
+    return -1 ;
+
+  if (w->type == WATCH_TIMER)
+    removeTimer (i) ;
+  else
+    epoll_ctl (epollFd, EPOLL_CTL_DEL, w->fd, NULL) ;
+
+  freeWatch (i) ;
+
+  return 0 ;
+}
+
+
+/*
+ * runTimers:
+ *	Everything that's due
+ *********************************************************************************
+ */
+
+static void runTimers (void)
+{
+  struct watch *w ;
+  uint64_t now = piTimerNow () ;
+  void (*fn)(void *arg) ;
+  void *arg ;
+  int i ;
+
+  while ((numTimers > 0) && (watches [order [0]].when <= now) && !stopping)
+  {
+    i   = order [0] ;
+    w   = &watches [i] ;
+    fn  = w->timerFn ;
+    arg = w->arg ;
+    removeTimer (i) ;
+
+    if (w->period == 0)
+      freeWatch (i) ;			// Before the call, so it can add another
+    else
+    {
+      w->when += w->period ;
+      if (w->when <= now)
+	w->when += ((now - w->when) / w->period + 1) * w->period ;
+      insertTimer (i) ;
+    }
+
+    fn (arg) ;
+  }
+}
+
+
+/*
+ * dispatch:
+ *	One epoll event
+ *********************************************************************************
+ */
+
+static void dispatch (struct epoll_event *ev)
+{
+  struct watch *w ;
+  uint64_t count ;
+  int id = ev->data.fd, events = 0 ;
+  char c ;
+
+  if (id == ID_TIMER)
+  {
+    (void)read (timerFd, &count, sizeof (count)) ;
+    timerSetFor = 0 ;
+    return ;
+  }
+
+  if (id == ID_STOP)
+  {
+    (void)read (stopFd, &count, sizeof (count)) ;
+    return ;
+  }
+
+  w = &watches [id & INDEX_MASK] ;
+  if ((w->type == WATCH_FREE) || (watchId (id & INDEX_MASK) != id))	// Cancelled by an earlier callback
+    return ;
+
+  if (w->type == WATCH_EDGE)
+  {
+    lseek (w->fd, 0, SEEK_SET) ;			// Read to clear it, as waitForInterrupt
+    if (read (w->fd, &c, 1) != 1)
+      c = '0' ;
+    w->edgeFn (w->pin, (c == '0') ? LOW : HIGH, w->arg) ;
+    return ;
+  }
+
+  if (ev->events & EPOLLIN)              events |= WPI_LOOP_READ ;
+  if (ev->events & EPOLLOUT)             events |= WPI_LOOP_WRITE ;
+  if (ev->events & (EPOLLERR | EPOLLHUP)) events |= WPI_LOOP_ERROR ;
+
+  w->fdFn (w->fd, events, w->arg) ;
+}
+
+
+/*
+ * wpiLoopRun:
+ *	Run until wpiLoopStop, or there's nothing left to watch. Returns 0,
+ *	or -1 on error.
+ *********************************************************************************
+ */
+
+int wpiLoopRun (void)
+{
+  struct epoll_event events [MAX_EVENTS] ;
+  int n, i ;
+
+  if (loopInit () < 0)
+    return -1 ;
+
+// The stop flag is cleared as we leave rather than as we start, so a
+//	wpiLoopStop that gets in before wpiLoopRun isn't lost.
+
+  while (!stopping && (numWatches > 0))
+  {
+    runTimers () ;
+    if (stopping || (numWatches == 0))
+      break ;
+
+// The timerfd only knows real time. On the virtual clock take whatever's
+//	ready now, and if there's nothing, sleep on the clock to the next timer.
+
+    if (piClockVirtual && (numTimers > 0))
+    {
+      if ((n = epoll_wait (epollFd, events, MAX_EVENTS, 0)) == 0)
+      {
+	piSleepUntil (watches [order [0]].when) ;
+	continue ;
+      }
+    }
+    else
+    {
+      armTimer () ;
+      n = epoll_wait (epollFd, events, MAX_EVENTS, -1) ;
+    }
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+	continue ;
+      stopping = FALSE ;
+      return -1 ;
+    }
+
+    for (i = 0 ; (i < n) && !stopping ; ++i)
+      dispatch (&events [i]) ;
+  }
+
+  stopping = FALSE ;
+  return 0 ;
+}
+
+
+/*
+ * wpiLoopStop:
+ *	Make wpiLoopRun return once the callback it's in (if any) is done.
+ *	From any thread, or a signal handler. If the loop isn't running yet
+ *	the next wpiLoopRun returns straight away.
+ *********************************************************************************
+ */
+
+void wpiLoopStop (void)
+{
+  uint64_t one = 1 ;
+
+  stopping = TRUE ;
+  if (stopFd != -1)
+    (void)write (stopFd, &one, sizeof (one)) ;
+}
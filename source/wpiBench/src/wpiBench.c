@@ -0,0 +1,1236 @@
+/*
+ * wpiBench.c:
+ *	Measure the timing of the software PWM, tone and servo engines,
+ *	and the throughput and latency of the piRing queues.
+ *
+ *	The engines are built into this program from the library sources,
+ *	on top of a GPIO backend that doesn't touch any hardware - it just
+ *	timestamps every edge it's given. After each run we work out how far
+ *	each period and each pulse was from what it should have been, and
+ *	print the spread, along with how much CPU the engine took.
+ *
+ *	It runs anywhere Linux does, so numbers from the Pi and from a
+ *	desktop can be compared. The GPIO stores themselves aren't timed -
+ *	every edge goes through digitalWrite here, where on a Pi the engines
+ *	write the GPSET/GPCLR registers directly.
+ *
+ *	The rings are run against a mutex and condition variable queue
+ *	doing the same job, which is what they're there to replace.
+ *
+ *	The shift bus runs on the same backend, once through digitalWrite
+ *	and once on handles to a block of memory standing in for the GPIO
+ *	registers, and we report the bit rate it gets.
+ *
+ *	The gpio, clock and setup engines time the real library instead:
+ *	it's loaded with dlopen, so its digitalWrite and the one here don't
+ *	meet. gpio needs a Pi and a pin that's free to be toggled; clock
+ *	runs anywhere, but only reads the system timer on a Pi as root;
+ *	setup needs a Pi, and starts a fresh process for every run.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "wiringPi.h"
+#include "softPwm.h"
+#include "softTone.h"
+#include "softServo.h"
+#include "wiringShift.h"
+#include "piTimer.h"
+#include "piJournal.h"
+
+#define	MAX_PINS	64
+#define	MAX_RUNS	16
+
+#define	WARM_UP		200000000	// nS of output we ignore at the start
+#define	MAX_EDGE_RATE	6000		// Edges per second per pin we allow for
+
+#define	ENGINE_PWM	1
+#define	ENGINE_TONE	2
+#define	ENGINE_SERVO	4
+#define	ENGINE_RING	8
+#define	ENGINE_GPIO	16
+#define	ENGINE_CLOCK	32
+#define	ENGINE_SETUP	64
+#define	ENGINE_SHIFT	128
+
+#define	RING_SLOTS	4096
+#define	RING_POP	64		// Most the consumer takes at once
+#define	RING_GAP	100000		// nS between items per producer, for latency
+#define	MAX_PRODUCERS	8
+
+#define	QUEUE_MUTEX	-1		// Not a ring - the mutex queue
+
+#define	OPS		1000000		// Calls per timed loop on the real library
+#define	REPEATS		5		//	and we keep the best of this many
+#define	SETUP_RUNS	20		// Fresh processes for the setup engine
+
+#define	SHIFT_BYTES	4096		// A transfer
+#define	SHIFT_BUFFERS	64		//	and how many we time at a time
+
+static const char *usage =
+  "Usage: %s [-e pwm,tone,servo,ring,gpio,clock,setup,shift] [-n pins,...] [-p priority,...] [-t seconds]\n"
+  "          [-g pin] [-l library]\n"
+  "  -e  Engines to measure (default pwm,tone,servo)\n"
+  "  -n  Pin counts to run each one with (default 1,8,32)\n"
+  "  -p  Thread priorities, SCHED_FIFO, 0 for none (default 0)\n"
+  "  -t  Seconds per run (default 2)\n"
+  "  -g  A free pin (BCM_GPIO) the gpio engine can toggle\n"
+  "  -l  The wiringPi library to time (default libwiringPi.so)\n" ;
+
+// The edges we've been given, per pin. Only the engine thread writes to
+//	these while it's running.
+
+struct edgeLog
+{
+  uint64_t *time ;
+  uint8_t  *level ;
+  int       num ;
+  int       size ;
+} ;
+
+static struct edgeLog edges [MAX_PINS] ;
+
+// Registers for the shift bus's handles, when we're giving it them
+
+static int                   fakeRegisters ;
+static volatile unsigned int fakeGpio [3] ;	// set, clear, level
+
+static int priority ;
+static int priorityFailed ;
+static int anyPriorityFailed ;
+
+// The queue under test, and the mutex queue
+
+static int             queueKind ;
+static struct piRing  *ring ;
+
+static uint64_t        mutexItems [RING_SLOTS] ;
+static unsigned int    mutexHead, mutexTail ;
+static pthread_mutex_t mutexLock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t  mutexCond = PTHREAD_COND_INITIALIZER ;
+
+static volatile int    stopProducers ;
+static int             producerBatch ;
+static int             timedItems ;	// Items are timestamps, paced RING_GAP apart
+
+// The real library, and what we use of it
+
+static const char *libName = "libwiringPi.so" ;
+static void       *lib ;
+
+static struct
+{
+  int  (*setup)        (void) ;
+  int  (*setupGpio)    (void) ;
+  int  (*setupPhys)    (void) ;
+  int  (*wpiToGpio)    (int pin) ;
+  int  (*physToGpio)   (int pin) ;
+  void (*pinMode)      (int pin, int mode) ;
+  void (*digitalWrite) (int pin, int value) ;
+  int  (*digitalRead)  (int pin) ;
+  int  (*getPinHandle) (int pin, struct wiringPiPinHandle *handle) ;
+  uint64_t     (*nanos)    (void) ;
+  uint64_t     (*micros64) (void) ;
+  unsigned int (*micros)   (void) ;
+  void         (*boardId)  (int *model, int *rev, int *mem, int *maker, int *overVolted) ;
+} wpi ;
+
+
+/*
+ *********************************************************************************
+ * The GPIO backend.
+ *	Just enough of wiringPi for the engines to run on.
+ *********************************************************************************
+ */
+
+void digitalWrite (int pin, int value)
+{
+  struct edgeLog *e ;
+
+  if ((pin < 0) || (pin >= MAX_PINS))
+    return ;
+
+  e = &edges [pin] ;
+  if (e->num < e->size)
+  {
+    e->time  [e->num] = piTimerNow () ;
+    e->level [e->num] = (uint8_t)value ;
+    ++e->num ;
+  }
+}
+
+int digitalRead (UNU int pin)
+{
+  return LOW ;
+}
+
+void pinMode (UNU int pin, UNU int mode)
+{
+}
+
+int wiringPiGetPinHandle (int pin, struct wiringPiPinHandle *handle)
+{
+  if (!fakeRegisters)
+    return -1 ;		// Everything through digitalWrite, so we see it
+
+  handle->set  = &fakeGpio [0] ;
+  handle->clr  = &fakeGpio [1] ;
+  handle->lev  = &fakeGpio [2] ;
+  handle->mask = 1 << (pin & 31) ;
+
+  return 0 ;
+}
+
+int pwmToneChannel (UNU int pin)
+{
+  return -1 ;		// No PWM hardware - softTone does it all
+}
+
+void pwmToneWrite (UNU int pin, UNU int freq)
+{
+}
+
+int piJournalActive = FALSE ;		// Never - we'd only be timing the journal
+
+void piJournalLog (UNU int op, UNU int pin, UNU int value)
+{
+}
+
+int piRealtimeThread (UNU int role)
+{
+  struct sched_param param ;
+
+  if (priority == 0)
+    return 0 ;
+
+  memset (&param, 0, sizeof (param)) ;
+  param.sched_priority = priority ;
+  if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &param) != 0)
+  {
+    priorityFailed = TRUE ;
+    return -1 ;
+  }
+
+  return 0 ;
+}
+
+int wiringPiFailure (UNU int fatal, const char *message, ...)
+{
+  va_list argp ;
+
+  va_start (argp, message) ;
+    vfprintf (stderr, message, argp) ;
+  va_end (argp) ;
+
+  exit (EXIT_FAILURE) ;
+}
+
+
+/*
+ * parseList:
+ *	Comma separated numbers
+ *********************************************************************************
+ */
+
+static int parseList (const char *s, int *list)
+{
+  int n = 0 ;
+  char *end ;
+
+  while ((*s != 0) && (n < MAX_RUNS))
+  {
+    list [n++] = (int)strtol (s, &end, 10) ;
+    if (end == s)
+      return -1 ;
+    s = (*end == ',') ? end + 1 : end ;
+  }
+
+  return n ;
+}
+
+
+/*
+ * cmpU64: percentile:
+ *********************************************************************************
+ */
+
+static int cmpU64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b ;
+
+  return (x > y) - (x < y) ;
+}
+
+static double percentile (const uint64_t *sorted, int n, double fraction)
+{
+  int i ;
+
+  if (n == 0)
+    return 0.0 ;
+
+  i = (int)((double)(n - 1) * fraction + 0.5) ;
+  return (double)sorted [i] / 1000.0 ;
+}
+
+
+/*
+ * expected:
+ *	What each pin in a run is set to, and the period and pulse width
+ *	that should give.
+ *********************************************************************************
+ */
+
+static void expected (int engine, int pin, int *value, uint64_t *period, uint64_t *width)
+{
+  switch (engine)
+  {
+    case ENGINE_PWM:				// Range 100 at 100uS a step: 10mS
+      *value  = 10 + (pin * 37) % 80 ;
+      *period = 10000000 ;
+      *width  = (uint64_t)*value * 100000 ;
+      break ;
+
+    case ENGINE_TONE:
+      *value  = 200 + pin * 37 ;
+      *width  = 500000000 / (uint64_t)*value ;
+      *period = 2 * *width ;
+      break ;
+
+    default:					// Servo: 8mS frames
+      *value  = (pin * 37) % 1000 ;
+      *period = 8000000 ;
+      *width  = (uint64_t)(*value + 1000) * 1000 ;
+      break ;
+  }
+}
+
+
+/*
+ * analyse:
+ *	Go through the edges for a pin, adding the error in each period
+ *	(rising edge to rising edge) and each pulse (rising to falling) to
+ *	the lists. Periods more than half as long again as they should be
+ *	are overruns.
+ *********************************************************************************
+ */
+
+static void analyse (int engine, int pin, uint64_t from, uint64_t *periodErr, int *numPeriods,
+	uint64_t *widthErr, int *numWidths, int *overruns)
+{
+  struct edgeLog *e = &edges [pin] ;
+  uint64_t period, width, rise = 0, t, d ;
+  int value, level = -1, i ;
+
+  expected (engine, pin, &value, &period, &width) ;
+
+  for (i = 0 ; i < e->num ; ++i)
+  {
+    if (e->level [i] == level)		// Same again - not an edge
+      continue ;
+    level = e->level [i] ;
+    t     = e->time  [i] ;
+
+    if (t < from)
+    {
+      if (level == HIGH)
+	rise = 0 ;
+      continue ;
+    }
+
+    if (level == HIGH)
+    {
+      if (rise != 0)
+      {
+	d = t - rise ;
+	periodErr [(*numPeriods)++] = (d > period) ? d - period : period - d ;
+	if (d > period + period / 2)
+	  ++*overruns ;
+      }
+      rise = t ;
+    }
+    else if (rise != 0)
+    {
+      d = t - rise ;
+      widthErr [(*numWidths)++] = (d > width) ? d - width : width - d ;
+    }
+  }
+}
+
+
+/*
+ * run:
+ *	One engine, one pin count, one priority
+ *********************************************************************************
+ */
+
+static void run (int engine, int pins, int seconds)
+{
+  static const char *names [] = { "", "softPwm", "softTone", "", "softServo" } ;
+  struct rusage before, after ;
+  uint64_t start, period, width, *periodErr, *widthErr ;
+  int size, pin, value, numPeriods = 0, numWidths = 0, overruns = 0 ;
+  double cpu ;
+
+  size = (seconds + 1) * MAX_EDGE_RATE + 1024 ;
+  for (pin = 0 ; pin < pins ; ++pin)
+  {
+    edges [pin].time  = malloc (sizeof (uint64_t) * (size_t)size) ;
+    edges [pin].level = malloc ((size_t)size) ;
+    edges [pin].num   = 0 ;
+    edges [pin].size  = size ;
+    if ((edges [pin].time == NULL) || (edges [pin].level == NULL))
+    {
+      fprintf (stderr, "Out of memory\n") ;
+      exit (EXIT_FAILURE) ;
+    }
+  }
+
+  priorityFailed = FALSE ;
+  start          = piTimerNow () ;
+
+  for (pin = 0 ; pin < pins ; ++pin)
+  {
+    expected (engine, pin, &value, &period, &width) ;
+    /**/ if (engine == ENGINE_PWM)
+      softPwmCreate (pin, value, 100) ;
+    else if (engine == ENGINE_TONE)
+    {
+      softToneCreate (pin) ;
+      softToneWrite  (pin, value) ;
+    }
+    else
+      softServoCreate (pin, value) ;
+  }
+
+  usleep (WARM_UP / 1000) ;
+  getrusage (RUSAGE_SELF, &before) ;
+  sleep (seconds) ;
+  getrusage (RUSAGE_SELF, &after) ;
+
+  for (pin = 0 ; pin < pins ; ++pin)
+    /**/ if (engine == ENGINE_PWM)
+      softPwmStop (pin) ;
+    else if (engine == ENGINE_TONE)
+      softToneStop (pin) ;
+    else
+      softServoStop (pin) ;
+
+  cpu = (double)(after.ru_utime.tv_sec  - before.ru_utime.tv_sec  + after.ru_stime.tv_sec  - before.ru_stime.tv_sec) +
+	(double)(after.ru_utime.tv_usec - before.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1000000.0 ;
+
+  periodErr = malloc (sizeof (uint64_t) * (size_t)size * (size_t)pins) ;
+  widthErr  = malloc (sizeof (uint64_t) * (size_t)size * (size_t)pins) ;
+  if ((periodErr == NULL) || (widthErr == NULL))
+  {
+    fprintf (stderr, "Out of memory\n") ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  for (pin = 0 ; pin < pins ; ++pin)
+    analyse (engine, pin, start + WARM_UP, periodErr, &numPeriods, widthErr, &numWidths, &overruns) ;
+
+  qsort (periodErr, (size_t)numPeriods, sizeof (uint64_t), cmpU64) ;
+  qsort (widthErr,  (size_t)numWidths,  sizeof (uint64_t), cmpU64) ;
+
+  printf ("%-10s %4d %4d%s %6.1f %8d %8.1f %8.1f %8.1f   %8.1f %8.1f %8.1f\n",
+	names [engine], pins, priority, priorityFailed ? "!" : " ", 100.0 * cpu / seconds, overruns,
+	percentile (periodErr, numPeriods, 0.50), percentile (periodErr, numPeriods, 0.99), percentile (periodErr, numPeriods, 1.0),
+	percentile (widthErr,  numWidths,  0.50), percentile (widthErr,  numWidths,  0.99), percentile (widthErr,  numWidths,  1.0)) ;
+  fflush (stdout) ;
+
+  if (priorityFailed)
+    anyPriorityFailed = TRUE ;
+
+  free (periodErr) ;
+  free (widthErr) ;
+  for (pin = 0 ; pin < pins ; ++pin)
+  {
+    free (edges [pin].time) ;
+    free (edges [pin].level) ;
+    memset (&edges [pin], 0, sizeof (edges [pin])) ;
+  }
+}
+
+
+/*
+ *********************************************************************************
+ * The queues.
+ *	push/pop/wait on either a piRing or the mutex queue
+ *********************************************************************************
+ */
+
+static int queuePush (const uint64_t *items, int count)
+{
+  int n ;
+
+  if (queueKind != QUEUE_MUTEX)
+    return piRingPush (ring, items, count) ;
+
+  pthread_mutex_lock (&mutexLock) ;
+    for (n = 0 ; (n < count) && ((mutexHead - mutexTail) < RING_SLOTS) ; ++n)
+      mutexItems [mutexHead++ % RING_SLOTS] = items [n] ;
+    if (n > 0)
+      pthread_cond_signal (&mutexCond) ;
+  pthread_mutex_unlock (&mutexLock) ;
+
+  return n ;
+}
+
+static int queuePop (uint64_t *items, int max)
+{
+  int n ;
+
+  if (queueKind != QUEUE_MUTEX)
+    return piRingPop (ring, items, max) ;
+
+  pthread_mutex_lock (&mutexLock) ;
+    for (n = 0 ; (n < max) && (mutexTail != mutexHead) ; ++n)
+      items [n] = mutexItems [mutexTail++ % RING_SLOTS] ;
+  pthread_mutex_unlock (&mutexLock) ;
+
+  return n ;
+}
+
+static void queueWait (void)
+{
+  struct timespec ts ;
+
+  if (queueKind != QUEUE_MUTEX)
+  {
+    (void)piRingWait (ring, 10) ;
+    return ;
+  }
+
+  clock_gettime (CLOCK_REALTIME, &ts) ;
+  ts.tv_nsec += 10000000 ;
+  if (ts.tv_nsec >= 1000000000)
+  {
+    ts.tv_nsec -= 1000000000 ;
+    ++ts.tv_sec ;
+  }
+
+  pthread_mutex_lock (&mutexLock) ;
+    if (mutexTail == mutexHead)
+      pthread_cond_timedwait (&mutexCond, &mutexLock, &ts) ;
+  pthread_mutex_unlock (&mutexLock) ;
+}
+
+
+/*
+ * producer:
+ *	Push as fast as the consumer will take them, or timestamps RING_GAP
+ *	apart when we're after the latency.
+ *********************************************************************************
+ */
+
+static void *producer (UNU void *arg)
+{
+  uint64_t items [RING_POP], next ;
+  int done, i ;
+
+  (void)piRealtimeThread (PI_RT_MAIN) ;
+
+  for (i = 0 ; i < producerBatch ; ++i)
+    items [i] = (uint64_t)i ;
+  next = piTimerNow () ;
+
+  while (!stopProducers)
+  {
+    if (timedItems)
+    {
+      next += RING_GAP ;
+      piSleepUntil (next) ;
+      items [0] = piTimerNow () ;
+    }
+
+    for (done = 0 ; (done < producerBatch) && !stopProducers ; )
+    {
+      if ((i = queuePush (items + done, producerBatch - done)) == 0)
+	sched_yield () ;			// Full
+      done += i ;
+    }
+  }
+
+  return NULL ;
+}
+
+
+/*
+ * ringRun:
+ *	One kind of queue with a number of producers: first flat out for
+ *	throughput, then paced with the consumer waiting, for latency.
+ *********************************************************************************
+ */
+
+static void ringRun (int kind, int producers, int batch, int seconds)
+{
+  static const char *names [] = { "mutex", "spsc", "mpsc" } ;
+  pthread_t threads [MAX_PRODUCERS] ;
+  struct sched_param oldParam ;
+  uint64_t items [RING_POP], start, end, now, popped = 0, *latency ;
+  int numLatency = 0, size, pass, n, i, oldPolicy ;
+  double rate = 0.0 ;
+
+  size    = seconds * (int)(1000000000 / RING_GAP) * producers + RING_POP ;
+  latency = malloc (sizeof (uint64_t) * (size_t)size) ;
+  if (latency == NULL)
+  {
+    fprintf (stderr, "Out of memory\n") ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  queueKind      = kind ;
+  priorityFailed = FALSE ;
+
+// We're the consumer, so we take the run's priority too - and put ours
+//	back afterwards, or the next run would start from it.
+
+  pthread_getschedparam (pthread_self (), &oldPolicy, &oldParam) ;
+  (void)piRealtimeThread (PI_RT_MAIN) ;
+
+  for (pass = 0 ; pass < 2 ; ++pass)
+  {
+    if ((kind != QUEUE_MUTEX) && ((ring = piRingCreate (kind | PI_RING_WAKE, RING_SLOTS, sizeof (uint64_t))) == NULL))
+    {
+      fprintf (stderr, "Unable to create the ring\n") ;
+      exit (EXIT_FAILURE) ;
+    }
+    mutexHead = mutexTail = 0 ;
+
+    stopProducers = FALSE ;
+    timedItems    = (pass == 1) ;
+    producerBatch = timedItems ? 1 : batch ;
+    for (i = 0 ; i < producers ; ++i)
+      pthread_create (&threads [i], NULL, producer, NULL) ;
+
+    start = piTimerNow () ;
+    end   = start + (uint64_t)seconds * 1000000000 ;
+    while ((now = piTimerNow ()) < end)
+    {
+      if ((n = queuePop (items, RING_POP)) == 0)
+      {
+	if (timedItems)
+	  queueWait () ;
+	else
+	  sched_yield () ;
+	continue ;
+      }
+
+      if (!timedItems)
+	popped += (uint64_t)n ;
+      else if (now > start + WARM_UP)
+      {
+	now = piTimerNow () ;
+	for (i = 0 ; (i < n) && (numLatency < size) ; ++i)
+	  latency [numLatency++] = now - items [i] ;
+      }
+    }
+
+    stopProducers = TRUE ;
+    while (queuePop (items, RING_POP) > 0)	// Anyone stuck on a full queue
+      ;
+    for (i = 0 ; i < producers ; ++i)
+      pthread_join (threads [i], NULL) ;
+
+    if (!timedItems)
+      rate = (double)popped / (double)(piTimerNow () - start) * 1000.0 ;
+
+    if (kind != QUEUE_MUTEX)
+      piRingFree (ring) ;
+  }
+
+  pthread_setschedparam (pthread_self (), oldPolicy, &oldParam) ;
+
+  qsort (latency, (size_t)numLatency, sizeof (uint64_t), cmpU64) ;
+
+  printf ("%-10s %4d %5d %4d%s %10.2f   %8.1f %8.1f %8.1f\n",
+	names [kind + 1], producers, batch, priority, priorityFailed ? "!" : " ", rate,
+	percentile (latency, numLatency, 0.50), percentile (latency, numLatency, 0.99), percentile (latency, numLatency, 1.0)) ;
+  fflush (stdout) ;
+
+  if (priorityFailed)
+    anyPriorityFailed = TRUE ;
+
+  free (latency) ;
+}
+
+
+/*
+ * ringRuns:
+ *	The rings against the mutex queue, one producer and several, one
+ *	item at a time and in batches.
+ *********************************************************************************
+ */
+
+static void ringRuns (int numPriorities, const int *priorities, int seconds)
+{
+  static const int kinds     [] = { QUEUE_MUTEX, PI_RING_SPSC, PI_RING_MPSC, QUEUE_MUTEX, PI_RING_MPSC } ;
+  static const int producers [] = { 1,           1,            1,            4,           4            } ;
+  int i, j, batch ;
+
+  printf ("\n%-10s %4s %5s %5s %10s   %26s\n", "", "", "", "", "", "latency (uS)") ;
+  printf ("%-10s %4s %5s %5s %10s   %8s %8s %8s\n", "queue", "prod", "batch", "prio", "Mitems/s", "p50", "p99", "max") ;
+
+  for (i = 0 ; i < numPriorities ; ++i)
+    for (j = 0 ; j < (int)(sizeof (kinds) / sizeof (kinds [0])) ; ++j)
+      for (batch = 1 ; batch <= 32 ; batch *= 32)
+      {
+	priority = priorities [i] ;
+	ringRun (kinds [j], producers [j], batch, seconds) ;
+      }
+}
+
+
+/*
+ * best: nsPerOp:
+ *	Keep the quickest of the repeats - anything slower was us being
+ *	interrupted, not the code being slower.
+ *********************************************************************************
+ */
+
+static void best (uint64_t *fastest, uint64_t start)
+{
+  uint64_t took = piTimerNow () - start ;
+
+  if ((*fastest == 0) || (took < *fastest))
+    *fastest = took ;
+}
+
+static double nsPerOp (uint64_t fastest)
+{
+  return (double)fastest / (double)OPS ;
+}
+
+
+/*
+ * shiftRun:
+ *	One way of driving the bus, one SPI mode, one clock rate. Flat out
+ *	we keep the best of REPEATS lots of SHIFT_BUFFERS; clocked we just
+ *	do a tenth of a second's worth once - it's spinning to the edges,
+ *	so what we want to see is how close it gets.
+ *********************************************************************************
+ */
+
+static void shiftRun (int registers, int mode, unsigned int speed)
+{
+  static uint8_t tx [SHIFT_BYTES], rx [SHIFT_BYTES] ;
+  struct shiftBus bus ;
+  uint64_t start, fastest = 0, bits ;
+  int len, buffers, r, i ;
+
+  for (i = 0 ; i < SHIFT_BYTES ; ++i)
+    tx [i] = (uint8_t)(i * 37) ;
+
+  fakeRegisters = registers ;
+  shiftBusSetup (&bus, 0, 1, 2, mode, MSBFIRST, speed) ;
+  fakeRegisters = FALSE ;
+
+  len     = (speed == 0) ? SHIFT_BYTES : (int)(speed / 80) ;
+  buffers = (speed == 0) ? SHIFT_BUFFERS : 1 ;
+  bits    = (uint64_t)len * 8 * (uint64_t)buffers ;
+
+  for (r = 0 ; r < ((speed == 0) ? REPEATS : 1) ; ++r)
+  {
+    start = piTimerNow () ;
+    for (i = 0 ; i < buffers ; ++i)
+      shiftBusTransfer (&bus, tx, rx, len) ;
+    best (&fastest, start) ;
+  }
+
+  if (speed == 0)
+    printf ("%-12s %4d %12s %10.2f\n", registers ? "registers" : "digitalWrite", mode, "flat out",
+	(double)bits * 1000.0 / (double)fastest) ;
+  else
+    printf ("%-12s %4d %12u %10.2f\n", registers ? "registers" : "digitalWrite", mode, speed,
+	(double)bits * 1000.0 / (double)fastest) ;
+  fflush (stdout) ;
+}
+
+
+/*
+ * shiftRuns:
+ *	All four modes flat out both ways, then clocked on the registers
+ *********************************************************************************
+ */
+
+static void shiftRuns (void)
+{
+  static const unsigned int speeds [] = { 1000000, 100000 } ;
+  int registers, mode, i ;
+
+  printf ("\n%-12s %4s %12s %10s\n", "shift bus", "mode", "clock (Hz)", "Mbit/s") ;
+
+  for (registers = FALSE ; registers <= TRUE ; ++registers)
+    for (mode = SHIFT_MODE_0 ; mode <= SHIFT_MODE_3 ; ++mode)
+      shiftRun (registers, mode, 0) ;
+
+  for (i = 0 ; i < (int)(sizeof (speeds) / sizeof (speeds [0])) ; ++i)
+    shiftRun (TRUE, SHIFT_MODE_0, speeds [i]) ;
+}
+
+
+/*
+ *********************************************************************************
+ * The real library.
+ *********************************************************************************
+ */
+
+/*
+ * onPi:
+ *	Setting up the real library anywhere else just gets us thrown out.
+ *********************************************************************************
+ */
+
+static int onPi (void)
+{
+  return access ("/dev/gpiomem", F_OK) == 0 ;
+}
+
+
+/*
+ * libLoad: libSym:
+ *	dlopen the library and find what we need in it. Loaded rather than
+ *	linked, so that it calls its own digitalWrite and not ours.
+ *********************************************************************************
+ */
+
+static void *libSym (const char *name)
+{
+  void *sym ;
+
+  if ((sym = dlsym (lib, name)) == NULL)
+  {
+    fprintf (stderr, "%s: no %s\n", libName, name) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  return sym ;
+}
+
+static void libLoad (void)
+{
+  if (lib != NULL)
+    return ;
+
+  if ((lib = dlopen (libName, RTLD_NOW | RTLD_LOCAL)) == NULL)
+  {
+    fprintf (stderr, "Unable to load the library: %s\n", dlerror ()) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  *(void **)&wpi.setup        = libSym ("wiringPiSetup") ;
+  *(void **)&wpi.setupGpio    = libSym ("wiringPiSetupGpio") ;
+  *(void **)&wpi.setupPhys    = libSym ("wiringPiSetupPhys") ;
+  *(void **)&wpi.wpiToGpio    = libSym ("wpiPinToGpio") ;
+  *(void **)&wpi.physToGpio   = libSym ("physPinToGpio") ;
+  *(void **)&wpi.pinMode      = libSym ("pinMode") ;
+  *(void **)&wpi.digitalWrite = libSym ("digitalWrite") ;
+  *(void **)&wpi.digitalRead  = libSym ("digitalRead") ;
+  *(void **)&wpi.getPinHandle = libSym ("wiringPiGetPinHandle") ;
+  *(void **)&wpi.nanos        = libSym ("nanos") ;
+  *(void **)&wpi.micros64     = libSym ("micros64") ;
+  *(void **)&wpi.micros       = libSym ("micros") ;
+  *(void **)&wpi.boardId      = libSym ("piBoardId") ;
+}
+
+
+/*
+ * gpioWriteRead:
+ *	digitalWrite and digitalRead on one pin in the current setup mode
+ *********************************************************************************
+ */
+
+static void gpioWriteRead (const char *mode, int pin)
+{
+  uint64_t start, write = 0, read = 0 ;
+  int i, r ;
+  volatile int sink = 0 ;
+
+  for (r = 0 ; r < REPEATS ; ++r)
+  {
+    start = piTimerNow () ;
+    for (i = 0 ; i < OPS ; ++i)
+      wpi.digitalWrite (pin, i & 1) ;
+    best (&write, start) ;
+
+    start = piTimerNow () ;
+    for (i = 0 ; i < OPS ; ++i)
+      sink += wpi.digitalRead (pin) ;
+    best (&read, start) ;
+  }
+
+  printf ("%-18s %-6s %4d %10.1f\n", "digitalWrite", mode, pin, nsPerOp (write)) ;
+  printf ("%-18s %-6s %4d %10.1f\n", "digitalRead",  mode, pin, nsPerOp (read)) ;
+}
+
+
+/*
+ * gpioRuns:
+ *	Each setup mode's digitalWrite/digitalRead, then the handle. We have
+ *	to go wiringPiSetup, Phys, Gpio in that order - a second
+ *	wiringPiSetup doesn't change the mode back.
+ *********************************************************************************
+ */
+
+static void gpioRuns (int bcmPin)
+{
+  struct wiringPiPinHandle handle ;
+  uint64_t start, write = 0, read = 0 ;
+  int pin, i, r ;
+  volatile int sink = 0 ;
+
+  printf ("\n%-18s %-6s %4s %10s\n", "gpio", "mode", "pin", "nS/op") ;
+
+  if (!onPi () || (bcmPin < 0) || (bcmPin > 53))
+  {
+    printf ("%-18s %s\n", "", onPi () ? "(skipped - needs a free pin, -g)" : "(skipped - not a Pi)") ;
+    return ;
+  }
+
+  libLoad () ;
+
+  wpi.setup () ;
+  for (pin = 0 ; (pin < 64) && (wpi.wpiToGpio (pin) != bcmPin) ; ++pin)
+    ;
+  if (pin < 64)
+  {
+    wpi.pinMode (pin, OUTPUT) ;
+    gpioWriteRead ("wpi", pin) ;
+  }
+
+  wpi.setupPhys () ;
+  for (pin = 1 ; (pin < 64) && (wpi.physToGpio (pin) != bcmPin) ; ++pin)
+    ;
+  if (pin < 64)
+    gpioWriteRead ("phys", pin) ;
+
+  wpi.setupGpio () ;
+  wpi.pinMode (bcmPin, OUTPUT) ;
+  gpioWriteRead ("gpio", bcmPin) ;
+
+  if (wpi.getPinHandle (bcmPin, &handle) == 0)
+  {
+    for (r = 0 ; r < REPEATS ; ++r)
+    {
+      start = piTimerNow () ;
+      for (i = 0 ; i < OPS ; ++i)
+	digitalWriteFast (&handle, i & 1) ;
+      best (&write, start) ;
+
+      start = piTimerNow () ;
+      for (i = 0 ; i < OPS ; ++i)
+	sink += digitalReadFast (&handle) ;
+      best (&read, start) ;
+    }
+
+    printf ("%-18s %-6s %4d %10.1f\n", "digitalWriteFast", "handle", bcmPin, nsPerOp (write)) ;
+    printf ("%-18s %-6s %4d %10.1f\n", "digitalReadFast",  "handle", bcmPin, nsPerOp (read)) ;
+  }
+
+  wpi.digitalWrite (bcmPin, LOW) ;
+  wpi.pinMode      (bcmPin, INPUT) ;
+  fflush (stdout) ;
+}
+
+
+/*
+ * The clocks:
+ *	The library's, plus clock_gettime on its own, and micros () as it
+ *	was - CLOCK_MONOTONIC_RAW, which many kernels don't do in the vDSO.
+ *	Everything goes through one of these so each pays the same call.
+ *********************************************************************************
+ */
+
+static uint64_t oldEpoch ;
+
+static uint64_t clockNanos    (void) { return wpi.nanos    () ; }
+static uint64_t clockMicros64 (void) { return wpi.micros64 () ; }
+static uint64_t clockMicros   (void) { return wpi.micros   () ; }
+
+static uint64_t clockMonotonic (void)
+{
+  struct timespec ts ;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * (uint64_t)1000000000 + (uint64_t)ts.tv_nsec ;
+}
+
+static uint64_t clockOldMicros (void)
+{
+  struct timespec ts ;
+  uint64_t now ;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &ts) ;
+  now = (uint64_t)ts.tv_sec * (uint64_t)1000000 + (uint64_t)(ts.tv_nsec / 1000) ;
+
+  return (uint32_t)(now - oldEpoch) ;
+}
+
+
+/*
+ * clockRuns:
+ *	nS per call of each. On a Pi we set the library up first, so as
+ *	root it has the system timer to read.
+ *********************************************************************************
+ */
+
+static void clockRuns (void)
+{
+  static const char *names [] = { "nanos", "micros64", "micros", "CLOCK_MONOTONIC", "micros (old, RAW)" } ;
+  static uint64_t (*clocks [])(void) = { clockNanos, clockMicros64, clockMicros, clockMonotonic, clockOldMicros } ;
+  uint64_t start, fastest ;
+  volatile uint64_t sink = 0 ;
+  int c, i, r ;
+
+  libLoad () ;
+  if (onPi ())
+    wpi.setupGpio () ;
+  oldEpoch = clockOldMicros () ;
+
+  printf ("\n%-18s %-16s %10s\n", "clock", "source", "nS/call") ;
+
+  for (c = 0 ; c < (int)(sizeof (clocks) / sizeof (clocks [0])) ; ++c)
+  {
+    fastest = 0 ;
+    for (r = 0 ; r < REPEATS ; ++r)
+    {
+      start = piTimerNow () ;
+      for (i = 0 ; i < OPS ; ++i)
+	sink += clocks [c] () ;
+      best (&fastest, start) ;
+    }
+
+    printf ("%-18s %-16s %10.1f\n", names [c],
+	(c > 2) ? "clock_gettime" : (onPi () && (geteuid () == 0)) ? "system timer" : "clock_gettime",
+	nsPerOp (fastest)) ;
+  }
+
+  fflush (stdout) ;
+}
+
+
+/*
+ * setupChild:
+ *	One fresh process: the first piBoardId, then a cached one, then the
+ *	first wiringPiSetup and the ones after - which is what the server
+ *	pays on every packet. Passed back up the pipe in nS.
+ *********************************************************************************
+ */
+
+static void setupChild (int fd)
+{
+  uint64_t times [4], start ;
+  int model, rev, mem, maker, overVolted, i ;
+
+  libLoad () ;
+
+  start = piTimerNow () ;
+  wpi.boardId (&model, &rev, &mem, &maker, &overVolted) ;
+  times [0] = piTimerNow () - start ;
+
+  start = piTimerNow () ;
+  for (i = 0 ; i < OPS ; ++i)
+    wpi.boardId (&model, &rev, &mem, &maker, &overVolted) ;
+  times [1] = (piTimerNow () - start) / OPS ;
+
+  start = piTimerNow () ;
+  wpi.setup () ;
+  times [2] = piTimerNow () - start ;
+
+  start = piTimerNow () ;
+  for (i = 0 ; i < OPS ; ++i)
+    wpi.setup () ;
+  times [3] = (piTimerNow () - start) / OPS ;
+
+  if (write (fd, times, sizeof (times)) != sizeof (times))
+    _exit (EXIT_FAILURE) ;
+  _exit (EXIT_SUCCESS) ;
+}
+
+
+/*
+ * setupRuns:
+ *	Setup only happens once per process, so every run is a new one.
+ *	This has to go before anything loads the library in this process,
+ *	or the children would all start out set up.
+ *********************************************************************************
+ */
+
+static void setupRuns (void)
+{
+  static const char *names [] = { "piBoardId", "piBoardId again", "wiringPiSetup", "wiringPiSetup again" } ;
+  uint64_t times [4], results [4][SETUP_RUNS] ;
+  int fds [2], runs, status, t ;
+  pid_t pid ;
+
+  printf ("\n%-20s %10s %10s\n", "setup", "p50 nS", "max nS") ;
+
+  if (!onPi ())
+  {
+    printf ("%-20s %s\n", "", "(skipped - not a Pi)") ;
+    return ;
+  }
+
+  fflush (stdout) ;		// Or the children print it again
+
+  for (runs = 0 ; runs < SETUP_RUNS ; ++runs)
+  {
+    if (pipe (fds) < 0)
+    {
+      fprintf (stderr, "Unable to create a pipe\n") ;
+      exit (EXIT_FAILURE) ;
+    }
+
+    if ((pid = fork ()) == 0)
+    {
+      close (fds [0]) ;
+      setupChild (fds [1]) ;
+    }
+
+    close (fds [1]) ;
+    t = (pid < 0) ? -1 : (int)read (fds [0], times, sizeof (times)) ;
+    close (fds [0]) ;
+    if (pid > 0)
+      waitpid (pid, &status, 0) ;
+
+    if (t != (int)sizeof (times))
+    {
+      printf ("%-20s %s\n", "", "(setup failed)") ;
+      return ;
+    }
+
+    for (t = 0 ; t < 4 ; ++t)
+      results [t][runs] = times [t] ;
+  }
+
+  for (t = 0 ; t < 4 ; ++t)
+  {
+    qsort (results [t], SETUP_RUNS, sizeof (uint64_t), cmpU64) ;
+    printf ("%-20s %10.1f %10.1f\n", names [t],
+	1000.0 * percentile (results [t], SETUP_RUNS, 0.50), 1000.0 * percentile (results [t], SETUP_RUNS, 1.0)) ;
+  }
+
+  fflush (stdout) ;
+}
+
+
+/*
+ * main:
+ *********************************************************************************
+ */
+
+int main (int argc, char *argv [])
+{
+  int pinCounts  [MAX_RUNS] = { 1, 8, 32 } ;
+  int priorities [MAX_RUNS] = { 0 } ;
+  int numPinCounts = 3, numPriorities = 1, engines = ENGINE_PWM | ENGINE_TONE | ENGINE_SERVO ;
+  int seconds = 2, bcmPin = -1, opt, e, i, j, failed = FALSE ;
+
+  while ((opt = getopt (argc, argv, "e:n:p:t:g:l:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'e':
+	engines = 0 ;
+	if (strstr (optarg, "pwm")   != NULL) engines |= ENGINE_PWM ;
+	if (strstr (optarg, "tone")  != NULL) engines |= ENGINE_TONE ;
+	if (strstr (optarg, "servo") != NULL) engines |= ENGINE_SERVO ;
+	if (strstr (optarg, "ring")  != NULL) engines |= ENGINE_RING ;
+	if (strstr (optarg, "gpio")  != NULL) engines |= ENGINE_GPIO ;
+	if (strstr (optarg, "clock") != NULL) engines |= ENGINE_CLOCK ;
+	if (strstr (optarg, "setup") != NULL) engines |= ENGINE_SETUP ;
+	if (strstr (optarg, "shift") != NULL) engines |= ENGINE_SHIFT ;
+	failed = (engines == 0) ;
+	break ;
+
+      case 'n': failed = ((numPinCounts  = parseList (optarg, pinCounts))  <= 0) ; break ;
+      case 'p': failed = ((numPriorities = parseList (optarg, priorities)) <= 0) ; break ;
+      case 't': seconds = atoi (optarg) ; break ;
+      case 'g': bcmPin  = atoi (optarg) ; break ;
+      case 'l': libName = optarg ;        break ;
+
+      default:
+	failed = TRUE ;
+	break ;
+    }
+    if (failed)
+      break ;
+  }
+
+  for (i = 0 ; i < numPinCounts ; ++i)
+    if ((pinCounts [i] < 1) || (pinCounts [i] > MAX_PINS))
+      failed = TRUE ;
+  for (i = 0 ; i < numPriorities ; ++i)
+    if ((priorities [i] < 0) || (priorities [i] > 99))
+      failed = TRUE ;
+
+  if (failed || (optind != argc) || (seconds < 1))
+  {
+    fprintf (stderr, usage, argv [0]) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  if (engines & (ENGINE_PWM | ENGINE_TONE | ENGINE_SERVO))
+  {
+    printf ("%-10s %4s %5s %6s %8s %26s   %26s\n", "", "", "", "", "", "period error (uS)", "pulse width error (uS)") ;
+    printf ("%-10s %4s %5s %6s %8s %8s %8s %8s   %8s %8s %8s\n",
+	"engine", "pins", "prio", "cpu%", "overruns", "p50", "p99", "max", "p50", "p99", "max") ;
+  }
+
+  for (e = ENGINE_PWM ; e <= ENGINE_SERVO ; e <<= 1)
+    if (engines & e)
+      for (i = 0 ; i < numPriorities ; ++i)
+	for (j = 0 ; j < numPinCounts ; ++j)
+	{
+	  priority = priorities [i] ;
+	  run (e, pinCounts [j], seconds) ;
+	}
+
+  if (engines & ENGINE_RING)
+    ringRuns (numPriorities, priorities, seconds) ;
+
+  if (engines & ENGINE_SHIFT)
+    shiftRuns () ;
+
+  if (engines & ENGINE_SETUP)
+    setupRuns () ;
+
+  if (engines & ENGINE_GPIO)
+    gpioRuns (bcmPin) ;
+
+  if (engines & ENGINE_CLOCK)
+    clockRuns () ;
+
+  if (anyPriorityFailed)
+    printf ("\n! - Unable to set the priority (needs root), so that run was at normal priority.\n") ;
+
+  return 0 ;
+}
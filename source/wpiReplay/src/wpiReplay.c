@@ -0,0 +1,240 @@
+/*
+ * wpiReplay.c:
+ *	Play back a journal recorded with WIRINGPI_JOURNAL (see piJournal.c)
+ *
+ *	The pin operations are re-issued in order, either at the speed they
+ *	were recorded or as fast as they'll go. Reads are re-done and
+ *	compared with what was read at the time.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "wiringPi.h"
+#include "wpiExtensions.h"
+#include "piTimer.h"
+#include "piJournal.h"
+
+#define	MAX_EXTENSIONS	8
+
+static const char *usage =
+  "Usage: %s [-g | -1 | -z] [-s] [-v] [-x extension:params] ... journal\n"
+  "  -g  Replay using BCM_GPIO pin numbers\n"
+  "  -1  Replay using physical pin numbers\n"
+  "  -z  Replay using the /sys/class/gpio interface (BCM_GPIO numbers)\n"
+  "  -s  Go as fast as possible rather than at the recorded speed\n"
+  "  -v  Print every read that doesn't match the recording\n"
+  "  -x  Load an extension first, as with the gpio command\n"
+  "Use the same pin numbering and extensions as the recording program.\n" ;
+
+
+/*
+ * replay:
+ *	Re-issue one record. Returns FALSE if it was a read that came back
+ *	different to when it was recorded.
+ *********************************************************************************
+ */
+
+static int replay (const struct piJournalRecord *r, int verbose)
+{
+  int value ;
+
+  switch (r->op)
+  {
+    case PI_JOURNAL_PIN_MODE:
+
+// The writes done by the soft PWM and tone threads are in the journal
+//	too, so we don't start them again - just make the pin an output.
+
+      if ((r->value == SOFT_PWM_OUTPUT) || (r->value == SOFT_TONE_OUTPUT))
+	pinMode (r->pin, OUTPUT) ;
+      else
+	pinMode (r->pin, r->value) ;
+      break ;
+
+    case PI_JOURNAL_DIGITAL_WRITE:
+      digitalWrite (r->pin, r->value) ;
+      break ;
+
+    case PI_JOURNAL_BANK_CLEAR:
+      digitalWriteBank (r->pin, 0, (unsigned int)r->value) ;
+      break ;
+
+    case PI_JOURNAL_BANK_SET:
+      digitalWriteBank (r->pin, (unsigned int)r->value, 0) ;
+      break ;
+
+    case PI_JOURNAL_PWM_WRITE:
+      pwmWrite (r->pin, r->value) ;
+      break ;
+
+    case PI_JOURNAL_DIGITAL_READ:
+      if ((value = digitalRead (r->pin)) != r->value)
+      {
+	if (verbose)
+	  printf ("%10u: digitalRead (%d): %d, recorded %d\n", r->seq, r->pin, value, r->value) ;
+	return FALSE ;
+      }
+      break ;
+
+    case PI_JOURNAL_ANALOG_READ:
+      if ((value = analogRead (r->pin)) != r->value)
+      {
+	if (verbose)
+	  printf ("%10u: analogRead (%d): %d, recorded %d\n", r->seq, r->pin, value, r->value) ;
+	return FALSE ;
+      }
+      break ;
+  }
+
+  return TRUE ;
+}
+
+
+/*
+ * main:
+ *********************************************************************************
+ */
+
+int main (int argc, char *argv [])
+{
+  struct piJournal *j ;
+  const struct piJournalRecord *r ;
+  char *extensions [MAX_EXTENSIONS] ;
+  uint64_t first, last, head, i, start, base, at, due, now, late, maxLate = 0, sumLate = 0 ;
+  uint64_t count = 0, mismatches = 0, torn = 0 ;
+  int numExtensions = 0 ;
+  int opt, mode = WPI_MODE_PINS, flatOut = FALSE, verbose = FALSE ;
+
+  while ((opt = getopt (argc, argv, "g1zsvx:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'g': mode = WPI_MODE_GPIO ;     break ;
+      case '1': mode = WPI_MODE_PHYS ;     break ;
+      case 'z': mode = WPI_MODE_GPIO_SYS ; break ;
+      case 's': flatOut = TRUE ;           break ;
+      case 'v': verbose = TRUE ;           break ;
+      case 'x':
+	if (numExtensions == MAX_EXTENSIONS)
+	{
+	  fprintf (stderr, "%s: Too many extensions\n", argv [0]) ;
+	  exit (EXIT_FAILURE) ;
+	}
+	extensions [numExtensions++] = optarg ;
+	break ;
+      default:
+	fprintf (stderr, usage, argv [0]) ;
+	exit (EXIT_FAILURE) ;
+    }
+  }
+
+  if (optind != argc - 1)
+  {
+    fprintf (stderr, usage, argv [0]) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+// Don't journal the replay over the top of the journal we're replaying
+
+  unsetenv ("WIRINGPI_JOURNAL") ;
+
+  if ((j = piJournalMap (argv [optind])) == NULL)
+  {
+    fprintf (stderr, "%s: Unable to open journal %s: %s\n", argv [0], argv [optind], strerror (errno)) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  /**/ if (mode == WPI_MODE_GPIO)     wiringPiSetupGpio () ;
+  else if (mode == WPI_MODE_PHYS)     wiringPiSetupPhys () ;
+  else if (mode == WPI_MODE_GPIO_SYS) wiringPiSetupSys  () ;
+  else                                wiringPiSetup     () ;
+
+  for (i = 0 ; i < (uint64_t)numExtensions ; ++i)
+    if (!loadWPiExtension (argv [0], extensions [i], TRUE))
+      exit (EXIT_FAILURE) ;
+
+// Work out where the journal starts - if it's wrapped, the oldest
+//	records have been overwritten
+
+  head  = j->head ;
+  last  = head ;
+  first = (head > j->size) ? head - j->size : 0 ;
+
+  if (first == last)
+  {
+    printf ("%s: Journal is empty\n", argv [0]) ;
+    return 0 ;
+  }
+
+  start = piTimerNow () ;
+  base  = at = 0 ;
+
+  for (i = first ; i < last ; ++i)
+  {
+    r = &j->records [i & (j->size - 1)] ;
+
+    if ((r->op == 0) || (r->seq != (uint32_t)i))	// Never finished writing
+    {
+      ++torn ;
+      continue ;
+    }
+
+// Threads take their slot before they read the time, so a record can be
+//	a little older than the one before it. Never go backwards.
+
+    if (count == 0)
+      base = at = r->ns ;
+    else if (r->ns > at)
+      at = r->ns ;
+
+    if (!flatOut)
+    {
+      due = start + (at - base) ;
+      piSleepUntil (due) ;
+      now      = piTimerNow () ;
+      late     = (now > due) ? now - due : 0 ;
+      sumLate += late ;
+      if (late > maxLate)
+	maxLate = late ;
+    }
+
+    if (!replay (r, verbose))
+      ++mismatches ;
+    ++count ;
+  }
+
+  printf ("Replayed:   %llu records in %.3f mS\n", (unsigned long long)count, (double)(piTimerNow () - start) / 1000000.0) ;
+  if (first != 0)
+    printf ("Lost:       %llu records overwritten before the journal ended\n", (unsigned long long)first) ;
+  if (torn != 0)
+    printf ("Torn:       %llu records were incomplete\n", (unsigned long long)torn) ;
+  printf ("Mismatches: %llu reads\n", (unsigned long long)mismatches) ;
+  if (!flatOut && (count != 0))
+    printf ("Lateness:   mean %.1f uS, max %.1f uS\n", (double)sumLate / (double)count / 1000.0, (double)maxLate / 1000.0) ;
+
+  piJournalUnmap (j) ;
+
+  return 0 ;
+}
@@ -0,0 +1,321 @@
+/*
+ * wpistat.c:
+ *	Print the counters of a running wiringPi program, live.
+ *
+ *	The library has to be built with WPI_STATS=1 for there to be any.
+ *	We map the program's /dev/shm/wiringPi.<pid> segment read-only, so
+ *	looking doesn't disturb it at all.
+ ***********************************************************************
+ * This file is part of wiringPi:
+ *	https://github.com/WiringPi/WiringPi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "piStats.h"
+
+#ifndef	TRUE
+#  define	TRUE	(1==1)
+#  define	FALSE	(!TRUE)
+#endif
+
+static const char *usage =
+  "Usage: %s [-i seconds] [-n count] [-t] [pid]\n"
+  "  -i  Seconds between samples (default 1)\n"
+  "  -n  Stop after this many samples (default: until the program exits)\n"
+  "  -t  Show each thread as well as the totals\n"
+  "With no pid, the only wiringPi program with counters is used.\n" ;
+
+static const char *counterNames [PI_STAT_COUNTERS] =
+{
+  "pinMode", "pullUpDnControl", "digitalRead", "digitalWrite", "pwmWrite",
+  "analogRead", "analogWrite", "softPwm overruns", "softTone overruns",
+  "ISR dispatches",
+} ;
+
+static const char *histNames [PI_STAT_HISTOGRAMS] =
+{
+  "node callbacks", "ISR handlers",
+} ;
+
+
+/*
+ * findPid:
+ *	Look for a single /dev/shm/wiringPi.<pid>
+ *********************************************************************************
+ */
+
+static int findPid (const char *progName)
+{
+  DIR *dir ;
+  struct dirent *d ;
+  int pid = -1, p, count = 0 ;
+
+  if ((dir = opendir ("/dev/shm")) == NULL)
+    return -1 ;
+
+  while ((d = readdir (dir)) != NULL)
+    if ((sscanf (d->d_name, "wiringPi.%d", &p) == 1) && (kill (p, 0) == 0 || errno == EPERM))
+    {
+      if (count++ == 0)
+	pid = p ;
+      else
+      {
+	if (count == 2)
+	  fprintf (stderr, "%s: More than one program - pick one of:\n  %d\n", progName, pid) ;
+	fprintf (stderr, "  %d\n", p) ;
+      }
+    }
+
+  closedir (dir) ;
+
+  return (count == 1) ? pid : -1 ;
+}
+
+
+/*
+ * percentile:
+ *	Upper bound of the bucket the given fraction of the samples falls in
+ *********************************************************************************
+ */
+
+static uint64_t percentile (const uint64_t *buckets, uint64_t total, double fraction)
+{
+  uint64_t want = (uint64_t)((double)total * fraction + 0.999999), seen = 0 ;
+  int i ;
+
+  if (want == 0)
+    want = 1 ;
+
+  for (i = 0 ; i < PI_STATS_BUCKETS - 1 ; ++i)
+    if ((seen += buckets [i]) >= want)
+      break ;
+
+  return (uint64_t)2 << i ;
+}
+
+
+/*
+ * printTime:
+ *********************************************************************************
+ */
+
+static void printTime (uint64_t ns)
+{
+  /**/ if (ns < 10000)      printf (" %7llu nS", (unsigned long long)ns) ;
+  else if (ns < 10000000)   printf (" %7llu uS", (unsigned long long)ns / 1000) ;
+  else                      printf (" %7llu mS", (unsigned long long)ns / 1000000) ;
+}
+
+
+/*
+ * sum:
+ *	Add all the slots up into one
+ *********************************************************************************
+ */
+
+static void sum (const struct piStats *stats, struct piStatsSlot *total)
+{
+  const struct piStatsSlot *s ;
+  int i, j, k ;
+
+  memset (total, 0, sizeof (*total)) ;
+
+  for (i = 0 ; i <= PI_STATS_SLOTS ; ++i)	// The extra one is the retired total
+  {
+    s = (i == PI_STATS_SLOTS) ? &stats->retired : &stats->slot [i] ;
+    if (s->tid == 0)
+      continue ;
+
+    for (j = 0 ; j < PI_STAT_COUNTERS ; ++j)
+      total->counters [j] += s->counters [j] ;
+
+    for (j = 0 ; j < PI_STATS_FDS ; ++j)
+    {
+      total->i2c [j].transactions += s->i2c [j].transactions ;
+      total->i2c [j].bytes        += s->i2c [j].bytes ;
+      total->spi [j].transactions += s->spi [j].transactions ;
+      total->spi [j].bytes        += s->spi [j].bytes ;
+    }
+
+    for (j = 0 ; j < PI_STAT_HISTOGRAMS ; ++j)
+      for (k = 0 ; k < PI_STATS_BUCKETS ; ++k)
+	total->histograms [j][k] += s->histograms [j][k] ;
+  }
+}
+
+
+/*
+ * show:
+ *	Print one sample. Rates are since the last one.
+ *********************************************************************************
+ */
+
+static void show (const struct piStats *stats, const struct piStatsSlot *now, const struct piStatsSlot *last, double seconds, int threads)
+{
+  const struct piStatsSlot *s ;
+  uint64_t total, ops ;
+  int i, j ;
+
+  printf ("\n%-20s %14s %12s\n", "wiringPi", "total", "/sec") ;
+  for (i = 0 ; i < PI_STAT_COUNTERS ; ++i)
+    if (now->counters [i] != 0)
+      printf ("%-20s %14llu %12.0f\n", counterNames [i], (unsigned long long)now->counters [i],
+	(double)(now->counters [i] - last->counters [i]) / seconds) ;
+
+  for (i = 0 ; i < PI_STATS_FDS ; ++i)
+  {
+    if (now->i2c [i].transactions != 0)
+      printf ("I2C fd %2d%s          %14llu %12.0f  %llu bytes\n", i, (i == PI_STATS_FDS - 1) ? "+" : " ",
+	(unsigned long long)now->i2c [i].transactions,
+	(double)(now->i2c [i].transactions - last->i2c [i].transactions) / seconds,
+	(unsigned long long)now->i2c [i].bytes) ;
+    if (now->spi [i].transactions != 0)
+      printf ("SPI fd %2d%s          %14llu %12.0f  %llu bytes\n", i, (i == PI_STATS_FDS - 1) ? "+" : " ",
+	(unsigned long long)now->spi [i].transactions,
+	(double)(now->spi [i].transactions - last->spi [i].transactions) / seconds,
+	(unsigned long long)now->spi [i].bytes) ;
+  }
+
+  for (i = 0 ; i < PI_STAT_HISTOGRAMS ; ++i)
+  {
+    for (total = 0, j = 0 ; j < PI_STATS_BUCKETS ; ++j)
+      total += now->histograms [i][j] ;
+    if (total == 0)
+      continue ;
+
+    printf ("%-20s p50 <", histNames [i]) ; printTime (percentile (now->histograms [i], total, 0.50)) ;
+    printf ("  p99 <")                      ; printTime (percentile (now->histograms [i], total, 0.99)) ;
+    printf ("  max <")                      ; printTime (percentile (now->histograms [i], total, 1.00)) ;
+    printf ("\n") ;
+  }
+
+  if (!threads)
+    return ;
+
+  printf ("%-8s %-16s %14s\n", "tid", "thread", "ops") ;
+  for (i = 0 ; i <= PI_STATS_SLOTS ; ++i)
+  {
+    s = (i == PI_STATS_SLOTS) ? &stats->retired : &stats->slot [i] ;
+    if (s->tid == 0)
+      continue ;
+    for (ops = 0, j = 0 ; j < PI_STAT_COUNTERS ; ++j)
+      ops += s->counters [j] ;
+    printf ("%-8d %-16.16s %14llu\n", s->tid, s->name, (unsigned long long)ops) ;
+  }
+}
+
+
+/*
+ * main:
+ *********************************************************************************
+ */
+
+int main (int argc, char *argv [])
+{
+  struct piStats *stats ;
+  static struct piStatsSlot now, last ;
+  char name [32] ;
+  double interval = 1.0 ;
+  int opt, pid, fd, count = -1, threads = FALSE ;
+
+  while ((opt = getopt (argc, argv, "i:n:t")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i': interval = atof (optarg) ; break ;
+      case 'n': count    = atoi (optarg) ; break ;
+      case 't': threads  = TRUE ;          break ;
+      default:
+	fprintf (stderr, usage, argv [0]) ;
+	exit (EXIT_FAILURE) ;
+    }
+  }
+
+  if (interval <= 0.0)
+    interval = 1.0 ;
+
+  /**/ if (optind == argc - 1)
+    pid = atoi (argv [optind]) ;
+  else if (optind == argc)
+    pid = findPid (argv [0]) ;
+  else
+  {
+    fprintf (stderr, usage, argv [0]) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  if (pid <= 0)
+  {
+    fprintf (stderr, "%s: No wiringPi program with counters found (was the library built with WPI_STATS=1?)\n", argv [0]) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  snprintf (name, sizeof (name), PI_STATS_NAME, pid) ;
+  if ((fd = shm_open (name, O_RDONLY, 0)) < 0)
+  {
+    fprintf (stderr, "%s: Unable to open %s: %s\n", argv [0], name, strerror (errno)) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  stats = mmap (NULL, sizeof (struct piStats), PROT_READ, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (stats == MAP_FAILED)
+  {
+    fprintf (stderr, "%s: Unable to map %s: %s\n", argv [0], name, strerror (errno)) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  if ((stats->magic != PI_STATS_MAGIC) || (stats->version != PI_STATS_VERSION) ||
+      (stats->slots != PI_STATS_SLOTS) || (stats->slotSize != sizeof (struct piStatsSlot)))
+  {
+    fprintf (stderr, "%s: %s is from a different version of wiringPi\n", argv [0], name) ;
+    exit (EXIT_FAILURE) ;
+  }
+
+  sum (stats, &last) ;
+
+  while (count != 0)
+  {
+    usleep ((useconds_t)(interval * 1000000.0)) ;
+
+    if ((kill (pid, 0) != 0) && (errno != EPERM))
+    {
+      printf ("%s: Process %d has gone\n", argv [0], pid) ;
+      break ;
+    }
+
+    sum  (stats, &now) ;
+    show (stats, &now, &last, interval, threads) ;
+    fflush (stdout) ;
+
+    last = now ;
+    if (count > 0)
+      --count ;
+  }
+
+  return 0 ;
+}